@@ -1,37 +1,76 @@
 #include "compilium.h"
 
 static struct Node *in_function;  // ASTFuncDef
-static int reg_used_table[NUM_OF_SCRATCH_REGS];
-static struct Node *reg_node_table[NUM_OF_SCRATCH_REGS];
 
-static void AllocReg(struct Node *n) {
-  assert(n);
-  for (int i = 1; i <= NUM_OF_SCRATCH_REGS; i++) {
-    if (!reg_used_table[i]) {
-      reg_used_table[i] = 1;
-      reg_node_table[i] = n;
-      n->reg = i;
-      return;
+static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx);
+
+static void AnalyzeInitializer(struct Node *init, struct SymbolEntry **ctx) {
+  if (IsASTInitializerList(init)) {
+    for (int i = 0; i < GetSizeOfList(init); i++) {
+      AnalyzeInitializer(GetNodeAt(init, i), ctx);
     }
+    return;
   }
-  fprintf(stderr, "\n**** Allocated regs ****\n");
-  for (int i = 1; i <= NUM_OF_SCRATCH_REGS; i++) {
-    fprintf(stderr, "reg[%d]:\n", i);
-    if (reg_node_table[i]->op) {
-      PrintTokenLine(reg_node_table[i]->op);
-    } else {
-      fprintf(stderr, "Op info not found\n");
+  AnalyzeNode(init, ctx);
+}
+
+static void SkipInitializersOfType(struct Node *type, struct Node *list,
+                                   int *pos) {
+  // Advances *pos over the initializers in list for one object of type,
+  // in the same way as EmitStaticDataForType() in generator.c consumes them.
+  type = GetTypeWithoutAttr(type);
+  if (*pos >= GetSizeOfList(list)) return;
+  struct Node *init = GetNodeAt(list, *pos);
+  if (IsASTInitializerList(init) ||
+      (type->type == kTypeArray &&
+       IsTokenWithType(init->op, kTokenStringLiteral) &&
+       GetSizeOfType(type->type_array_type_of) == 1)) {
+    (*pos)++;
+    return;
+  }
+  if (type->type == kTypeArray) {
+    int elem_size = GetSizeOfType(type->type_array_type_of);
+    int num_of_elems = GetSizeOfType(type) / (elem_size ? elem_size : 1);
+    for (int i = 0; i < num_of_elems && *pos < GetSizeOfList(list); i++) {
+      SkipInitializersOfType(type->type_array_type_of, list, pos);
     }
+    return;
   }
-  fprintf(stderr, "\n**** Tried to allocate reg for ****\n");
-  PrintASTNode(n);
-  ErrorWithToken(n->op, "No free registers found");
+  if (type->type == kTypeStruct) {
+    struct Node *dict = type->type_struct_spec->struct_member_dict;
+    for (int i = 0; i < GetSizeOfList(dict) && *pos < GetSizeOfList(list);
+         i++) {
+      struct Node *member = GetNodeAt(dict, i)->value;
+      SkipInitializersOfType(member->struct_member_ent_type, list, pos);
+    }
+    return;
+  }
+  (*pos)++;
 }
 
-static void FreeReg(int reg) {
-  assert(1 <= reg && reg <= NUM_OF_SCRATCH_REGS);
-  reg_used_table[reg] = 0;
-  reg_node_table[reg] = NULL;
+static void CompleteUnsizedArrayType(struct Node *type, struct Node *init) {
+  // int a[] = {1, 2, 3}; => int a[3]
+  // struct {int x, y;} a[] = {1, 2, 3}; => a[2], as braces can be omitted
+  if (type->type != kTypeArray || type->type_array_index_decl) return;
+  int count;
+  if (IsTokenWithType(init->op, kTokenStringLiteral)) {
+    count = DecodeStringLiteral(init->op, NULL) + 1;
+  } else {
+    if (!IsASTInitializerList(init)) {
+      ErrorWithToken(init->op, "Invalid initializer for an array");
+    }
+    count = 0;
+    int pos = 0;
+    while (pos < GetSizeOfList(init)) {
+      SkipInitializersOfType(type->type_array_type_of, init, &pos);
+      count++;
+    }
+  }
+  char s[16];
+  snprintf(s, sizeof(s), "%d", count);
+  struct Node *index_decl = AllocNode(kASTExpr);
+  index_decl->op = CreateToken(strdup(s));
+  type->type_array_index_decl = index_decl;
 }
 
 static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
@@ -43,16 +82,12 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
     return;
   }
   if (node->type == kASTExprFuncCall) {
-    node->stack_size_needed = (GetLastLocalVarOffset(*ctx) + 0xF) & ~0xF;
-    AllocReg(node);
     AnalyzeNode(node->func_expr, ctx);
-    FreeReg(node->func_expr->reg);
     node->expr_type =
         GetReturnTypeOfFunction(GetTypeWithoutAttr(node->func_expr->expr_type));
     for (int i = 0; i < GetSizeOfList(node->arg_expr_list); i++) {
       struct Node *n = GetNodeAt(node->arg_expr_list, i);
       AnalyzeNode(n, ctx);
-      FreeReg(n->reg);
     }
     return;
   } else if (node->type == kASTFuncDef) {
@@ -77,6 +112,7 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
     }
     assert(!in_function);
     in_function = node;
+    node->stack_size_needed = GetLastLocalVarOffset(*ctx);
     AnalyzeNode(node->func_body, ctx);
     in_function = NULL;
     *ctx = saved_ctx;
@@ -86,37 +122,38 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
   if (node->type == kASTExpr) {
     if (IsTokenWithType(node->op, kTokenIntegerConstant) ||
         IsTokenWithType(node->op, kTokenCharLiteral)) {
-      AllocReg(node);
       node->expr_type = CreateTypeBase(CreateToken("int"));
       return;
     } else if (IsTokenWithType(node->op, kTokenStringLiteral)) {
-      AllocReg(node);
       node->expr_type = CreateTypePointer(CreateTypeBase(CreateToken("char")));
       return;
     } else if (IsEqualTokenWithCStr(node->op, "(")) {
       AnalyzeNode(node->right, ctx);
-      node->reg = node->right->reg;
       node->expr_type = node->right->expr_type;
       return;
     } else if (IsEqualTokenWithCStr(node->op, "[")) {
       AnalyzeNode(node->left, ctx);
       AnalyzeNode(node->right, ctx);
-      node->reg = node->left->reg;
-      FreeReg(node->right->reg);
       assert(node->left->expr_type);
       struct Node *left_type = GetTypeWithoutAttr(node->left->expr_type);
+      struct Node *elem_type;
       if (left_type->type == kTypeArray) {
-        node->expr_type = CreateTypeLValue(left_type->type_array_type_of);
+        elem_type = left_type->type_array_type_of;
       } else if (left_type->type == kTypePointer) {
-        node->expr_type = CreateTypeLValue(left_type->right);
+        elem_type = left_type->right;
       } else {
         assert(false);
       }
+      if (GetTypeWithoutAttr(elem_type)->type == kTypeStruct) {
+        // Structs are referred by their address like local struct vars
+        node->expr_type = elem_type;
+        return;
+      }
+      node->expr_type = CreateTypeLValue(elem_type);
       return;
     } else if (IsEqualTokenWithCStr(node->op, ".") ||
                IsEqualTokenWithCStr(node->op, "->")) {
       AnalyzeNode(node->left, ctx);
-      node->reg = node->left->reg;
       PrintASTNode(node->left->expr_type);
       assert(node->right && node->right->type == kNodeToken);
       struct Node *struct_type = NULL;
@@ -148,7 +185,6 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
       struct Node *ident_info = FindLocalVar(*ctx, node->op);
       if (ident_info) {
         node->byte_offset = ident_info->byte_offset;
-        AllocReg(node);
         enum NodeType expr_type =
             GetTypeWithoutAttr(ident_info->expr_type)->type;
         if (expr_type == kTypeStruct || expr_type == kTypeArray) {
@@ -160,25 +196,25 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
       }
       struct Node *global_var_type = FindGlobalVar(*ctx, node->op);
       if (global_var_type) {
-        AllocReg(node);
+        if (GetTypeWithoutAttr(global_var_type)->type == kTypeStruct) {
+          node->expr_type = global_var_type;
+          return;
+        }
         node->expr_type = CreateTypeLValue(global_var_type);
         return;
       }
       struct Node *external_var_type = FindExternVar(*ctx, node->op);
       if (external_var_type) {
-        AllocReg(node);
         node->expr_type = CreateTypeLValue(external_var_type);
         return;
       }
       struct Node *func_def = FindFuncDef(*ctx, node->op);
       if (func_def) {
-        AllocReg(node);
         node->expr_type = func_def->func_type;
         return;
       }
       struct Node *func_decl_type = FindFuncDeclType(*ctx, node->op);
       if (func_decl_type) {
-        AllocReg(node);
         node->expr_type = GetTypeWithoutAttr(func_decl_type);
         return;
       }
@@ -187,29 +223,28 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
       AnalyzeNode(node->cond, ctx);
       AnalyzeNode(node->left, ctx);
       AnalyzeNode(node->right, ctx);
-      FreeReg(node->left->reg);
-      FreeReg(node->right->reg);
-      assert(
-          IsSameTypeExceptAttr(node->left->expr_type, node->right->expr_type));
-      node->reg = node->cond->reg;
-      node->expr_type = GetRValueType(node->right->expr_type);
+      if (IsSameTypeExceptAttr(node->left->expr_type,
+                               node->right->expr_type)) {
+        node->expr_type = GetRValueType(node->right->expr_type);
+        return;
+      }
+      // x ? c : 0 with char c is an int, as both are promoted
+      assert(GetTypeWithoutAttr(node->left->expr_type)->type == kTypeBase &&
+             GetTypeWithoutAttr(node->right->expr_type)->type == kTypeBase);
+      node->expr_type = CreateTypeBase(CreateToken("int"));
       return;
     } else if (!node->left && node->right) {
       AnalyzeNode(node->right, ctx);
       if (IsEqualTokenWithCStr(node->op, "--") ||
           IsEqualTokenWithCStr(node->op, "++")) {
         assert(IsLValueType(node->right->expr_type));
-        node->reg = node->right->reg;
         node->expr_type = GetRValueType(node->right->expr_type);
         return;
       }
       if (IsTokenWithType(node->op, kTokenKwSizeof)) {
-        FreeReg(node->right->reg);
-        AllocReg(node);
         node->expr_type = CreateTypeBase(CreateToken("int"));
         return;
       }
-      node->reg = node->right->reg;
       if (IsEqualTokenWithCStr(node->op, "&")) {
         node->expr_type =
             CreateTypePointer(GetRValueType(node->right->expr_type));
@@ -229,7 +264,6 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
           IsEqualTokenWithCStr(node->op, "--")) {
         AnalyzeNode(node->left, ctx);
         assert(IsLValueType(node->left->expr_type));
-        node->reg = node->left->reg;
         node->expr_type = GetRValueType(node->left->expr_type);
         return;
       }
@@ -238,13 +272,9 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
       AnalyzeNode(node->right, ctx);
       if (IsEqualTokenWithCStr(node->op, "=") ||
           IsEqualTokenWithCStr(node->op, ",")) {
-        FreeReg(node->left->reg);
-        node->reg = node->right->reg;
         node->expr_type = GetRValueType(node->right->expr_type);
         return;
       }
-      FreeReg(node->right->reg);
-      node->reg = node->left->reg;
       node->expr_type = GetRValueType(node->left->expr_type);
       return;
     }
@@ -253,7 +283,6 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
   if (node->type == kASTExprStmt) {
     if (!node->left) return;
     AnalyzeNode(node->left, ctx);
-    if (node->left->reg) FreeReg(node->left->reg);
     return;
   } else if (node->type == kASTList) {
     struct SymbolEntry *saved_ctx = *ctx;
@@ -290,27 +319,49 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
         return;
       }
       assert(type_ident);
+      assert(node->right->type == kASTDecltor);
+      struct Node *init_expr = node->right->decltor_init_expr;
       if (IsASTDeclOfExtern(node)) {
+        if (init_expr) {
+          ErrorWithToken(type_ident, "extern variable cannot be initialized");
+        }
         AddExternVar(ctx, CreateTokenStr(type_ident), type);
-      } else {
-        AddGlobalVar(ctx, CreateTokenStr(type_ident), type);
+        return;
       }
-      assert(node->right->type == kASTDecltor);
-      if (node->right->decltor_init_expr) {
-        assert(false);
+      if (init_expr) CompleteUnsizedArrayType(type, init_expr->right);
+      struct Node *global_var = AddGlobalVar(ctx, type_ident, type);
+      if (init_expr) {
+        if (global_var->decltor_init_expr) {
+          ErrorWithToken(type_ident, "Redefinition of global variable");
+        }
+        AnalyzeInitializer(init_expr->right, ctx);
+        global_var->decltor_init_expr = init_expr->right;
+        global_var->is_const = IsASTDeclOfConstObject(node);
       }
       return;
     }
     // Local definitions
     assert(type_ident);
-    AddLocalVar(ctx, CreateTokenStr(type_ident), type);
     assert(node->right->type == kASTDecltor);
-    if (node->right->decltor_init_expr) {
+    struct Node *init_expr = node->right->decltor_init_expr;
+    if (init_expr) CompleteUnsizedArrayType(type, init_expr->right);
+    struct Node *local_var =
+        AddLocalVar(ctx, CreateTokenStr(type_ident), type);
+    if (local_var->byte_offset > in_function->stack_size_needed) {
+      in_function->stack_size_needed = local_var->byte_offset;
+    }
+    if (init_expr) {
       struct Node *left_expr = AllocNode(kASTExpr);
       left_expr->op = type_ident;
-      node->right->decltor_init_expr->left = left_expr;
-      AnalyzeNode(node->right->decltor_init_expr, ctx);
-      FreeReg(node->right->decltor_init_expr->reg);
+      init_expr->left = left_expr;
+      if (IsASTInitializerList(init_expr->right) ||
+          type->type == kTypeArray) {
+        // Aggregates are initialized member by member in BuildIR
+        AnalyzeNode(left_expr, ctx);
+        AnalyzeInitializer(init_expr->right, ctx);
+        return;
+      }
+      AnalyzeNode(init_expr, ctx);
     }
     return;
   } else if (node->type == kASTJumpStmt) {
@@ -321,13 +372,11 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
     if (IsTokenWithType(node->op, kTokenKwReturn)) {
       if (!node->right) return;
       AnalyzeNode(node->right, ctx);
-      FreeReg(node->right->reg);
       return;
     }
   } else if (node->type == kASTSelectionStmt) {
     if (IsTokenWithType(node->op, kTokenKwIf)) {
       AnalyzeNode(node->cond, ctx);
-      FreeReg(node->cond->reg);
       AnalyzeNode(node->if_true_stmt, ctx);
       if (node->if_else_stmt) {
         AnalyzeNode(node->if_else_stmt, ctx);
@@ -337,21 +386,17 @@ static void AnalyzeNode(struct Node *node, struct SymbolEntry **ctx) {
   } else if (node->type == kASTForStmt) {
     if (node->init) {
       AnalyzeNode(node->init, ctx);
-      if (node->init->reg) FreeReg(node->init->reg);
     }
     if (node->cond) {
       AnalyzeNode(node->cond, ctx);
-      FreeReg(node->cond->reg);
     }
     if (node->updt) {
       AnalyzeNode(node->updt, ctx);
-      FreeReg(node->updt->reg);
     }
     AnalyzeNode(node->body, ctx);
     return;
   } else if (node->type == kASTWhileStmt) {
     AnalyzeNode(node->cond, ctx);
-    FreeReg(node->cond->reg);
     AnalyzeNode(node->body, ctx);
     return;
   }
@@ -11,6 +11,19 @@ bool IsASTDeclOfExtern(struct Node *n) {
           IsTokenWithType(GetNodeAt(n->op, 0), kTokenKwExtern));
 }
 
+bool IsASTDeclOfConstObject(struct Node *n) {
+  // const qualifies the declared object itself only if it is not a pointer
+  if (!n || n->type != kASTDecl || !n->right || n->right->left) return false;
+  for (int i = 0; i < GetSizeOfList(n->op); i++) {
+    if (IsTokenWithType(GetNodeAt(n->op, i), kTokenKwConst)) return true;
+  }
+  return false;
+}
+
+bool IsASTInitializerList(struct Node *n) {
+  return IsASTList(n) && IsEqualTokenWithCStr(n->op, "{");
+}
+
 struct Node *AllocNode(enum NodeType type) {
   struct Node *node = calloc(1, sizeof(struct Node));
   node->type = type;
@@ -62,6 +75,11 @@ struct Node *CreateASTFuncDef(struct Node *func_decl, struct Node *func_body) {
   assert(IsToken(n->func_name_token));
   n->func_type = GetTypeWithoutAttr(type);
   assert(n->func_type && n->func_type->type == kTypeFunction);
+  for (int i = 0; i < GetSizeOfList(func_decl->op); i++) {
+    struct Node *t = GetNodeAt(func_decl->op, i);
+    if (IsTokenWithType(t, kTokenKwStatic)) n->is_static = true;
+    if (IsTokenWithType(t, kTokenKwInline)) n->is_inline = true;
+  }
   return n;
 }
 
@@ -79,6 +97,12 @@ struct Node *CreateASTLocalVar(int byte_offset, struct Node *var_type) {
   return n;
 }
 
+struct Node *CreateASTGlobalVar(struct Node *var_type) {
+  struct Node *n = AllocNode(kASTGlobalVar);
+  n->expr_type = var_type;
+  return n;
+}
+
 struct Node *CreateTypeBase(struct Node *t) {
   struct Node *n = AllocNode(kTypeBase);
   n->op = t;
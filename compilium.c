@@ -1,8 +1,15 @@
 #include "compilium.h"
 
 const char *symbol_prefix;
+const char *rodata_section_directive;
+const char *relro_section_directive;
+const char *cstring_section_directive;
+const char *external_call_suffix;
 const char *include_path;
 bool is_preprocess_only = false;
+bool is_debug_requested = false;
+bool is_ir_dump_requested = false;
+int vector_size = 16;
 
 _Noreturn void Error(const char *fmt, ...) {
   fflush(stdout);
@@ -25,19 +32,46 @@ static struct Node *ParseCompilerArgs(int argc, char **argv) {
   // returns replacement_list: ASTList which contains macro replacement
   struct Node *replacement_list = AllocList();
   symbol_prefix = "_";
+  rodata_section_directive = ".const";
+  relro_section_directive = ".const_data";
+  cstring_section_directive = ".cstring";
+  external_call_suffix = "";
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--target-os") == 0) {
       i++;
       if (strcmp(argv[i], "Darwin") == 0) {
         symbol_prefix = "_";
+        rodata_section_directive = ".const";
+        relro_section_directive = ".const_data";
+        cstring_section_directive = ".cstring";
+        external_call_suffix = "";
         // Define __APPLE__ macro
         PushKeyValueToList(replacement_list, "__APPLE__",
                            CreateMacroReplacement(NULL, NULL));
       } else if (strcmp(argv[i], "Linux") == 0) {
         symbol_prefix = "";
+        rodata_section_directive = ".section .rodata";
+        relro_section_directive = ".section .data.rel.ro,\"aw\"";
+        // Mergeable null-terminated strings with 1 byte entries
+        cstring_section_directive =
+            ".section .rodata.str1.1,\"aMS\",@progbits,1";
+        // Calls to functions defined outside of this file go through the PLT
+        external_call_suffix = "@PLT";
       } else {
         Error("Unknown os type %s", argv[i]);
       }
+    } else if (strcmp(argv[i], "--march") == 0) {
+      i++;
+      if (!argv[i]) Error("Architecture (--march <arch>) is missing");
+      if (strcmp(argv[i], "x86-64") == 0) {
+        // SSE2 is always available on x86-64
+        vector_size = 16;
+      } else if (strcmp(argv[i], "x86-64-v3") == 0) {
+        // AVX2
+        vector_size = 32;
+      } else {
+        Error("Unknown arch %s", argv[i]);
+      }
     } else if (strcmp(argv[i], "-I") == 0) {
       i++;
       include_path = argv[i];
@@ -50,8 +84,16 @@ static struct Node *ParseCompilerArgs(int argc, char **argv) {
       TestList();
     } else if (strcmp(argv[i], "--run-unittest=Type") == 0) {
       TestType();
+    } else if (strcmp(argv[i], "-o") == 0) {
+      i++;
+      if (!argv[i]) Error("Output path (-o <path>) is missing");
+      SetEmitterOutputPath(argv[i]);
     } else if (strcmp(argv[i], "-E") == 0) {
       is_preprocess_only = true;
+    } else if (strcmp(argv[i], "-g") == 0) {
+      is_debug_requested = true;
+    } else if (strcmp(argv[i], "--dump-ir") == 0) {
+      is_ir_dump_requested = true;
     } else {
       Error("Unknown argument: %s", argv[i]);
     }
@@ -198,56 +240,34 @@ void TestList() {
 //    otherwise
 
 // Compilium register plan:
-//  RAX: reserved for return values
-//  RCX: reserved for shift ops
-//  RDX: 3rd parameter, reserved for div/mul ops
-//  RBX: reserved (callee-saved)
+//  RAX: return values, dividend of div ops and scratch in code sequences
 //  RSP: reserved for stack pointer
 //  RBP: reserved for frame pointer
-//  RSI: 2nd parameter
-//  RDI: 1st parameter
-//  R8 : 5th parameter
-//  R9 : 6th parameter
-//  R10: scratch
-//  R11: scratch
-//  R12: reserved (callee-saved)
-//  R13: reserved (callee-saved)
-//  R14: reserved (callee-saved)
-//  R15: reserved (callee-saved)
-
-const char *reg_names_64[NUM_OF_SCRATCH_REGS + 1] = {
-    // padding
-    NULL,
-    // params
-    "rdi", "rsi", "r8", "r9",
-    // scratch
-    "r10", "r11",
-    // callee-saved
-    "r12", "r13", "r14", "r15"};
-const char *reg_names_32[NUM_OF_SCRATCH_REGS + 1] = {
-    // padding
-    NULL,
-    // params
-    "edi", "esi", "r8d", "r9d",
-    // scratch
-    "r10d", "r11d",
-    // callee-saved
-    "r12d", "r13d", "r14d", "r15d"};
-const char *reg_names_8[NUM_OF_SCRATCH_REGS + 1] = {
-    // padding
-    NULL,
-    // params
-    "dil", "sil", "r8b", "r9b",
-    // scratch
-    "r10b", "r11b",
-    // callee-saved
-    "r12b", "r13b", "r14b", "r15d"};
-const char *param_reg_names_64[NUM_OF_PARAM_REGISTERS] = {"rdi", "rsi", "rdx",
-                                                          "rcx", "r8",  "r9"};
-const char *param_reg_names_32[NUM_OF_PARAM_REGISTERS] = {"edi", "esi", "edx",
-                                                          "ecx", "r8d", "r9d"};
-const char *param_reg_names_8[NUM_OF_PARAM_REGISTERS] = {"dl", "sil", "dl",
-                                                         "cl", "r8b", "r9b"};
+//  R10: reserved for reloading spilled values
+//  R11: reserved for reloading spilled values
+//  otherwise: allocated to virtual registers by regalloc.c
+//    (parameters, RCX for shift ops and RDX for div ops are fixed there)
+//  XMM0-XMM15 (or YMM0-YMM15): numbered by the loop vectorizer in
+//    optimizer.c, since nothing else uses them in vector loops
+//  XMM15: scratch in unrolled memset / memcpy outside of vector loops
+
+const char *reg_names_64[kNumOfPhysicalRegs] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"};
+const char *reg_names_32[kNumOfPhysicalRegs] = {
+    "eax", "ecx", "edx",  "ebx",  "esp",  "ebp",  "esi",  "edi",
+    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"};
+const char *reg_names_8[kNumOfPhysicalRegs] = {
+    "al",  "cl",  "dl",   "bl",   "spl",  "bpl",  "sil",  "dil",
+    "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"};
+const char *vec_reg_names_16[kNumOfPhysicalRegs] = {
+    "xmm0", "xmm1", "xmm2",  "xmm3",  "xmm4",  "xmm5",  "xmm6",  "xmm7",
+    "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15"};
+const char *vec_reg_names_32[kNumOfPhysicalRegs] = {
+    "ymm0", "ymm1", "ymm2",  "ymm3",  "ymm4",  "ymm5",  "ymm6",  "ymm7",
+    "ymm8", "ymm9", "ymm10", "ymm11", "ymm12", "ymm13", "ymm14", "ymm15"};
+const int param_regs[NUM_OF_PARAM_REGISTERS] = {kRegRDI, kRegRSI, kRegRDX,
+                                                kRegRCX, kRegR8,  kRegR9};
 
 #define INITIAL_INPUT_SIZE 8192
 const char *ReadFile(FILE *fp) {
@@ -6,6 +6,8 @@
 
 char *strndup(const char *s, size_t n);
 char *strdup(const char *s);
+int creat(const char *path, int mode);
+long write(int fd, const void *buf, size_t n);
 
 #define assert(expr) \
   ((void)((expr) || (__assert(#expr, __FILE__, __LINE__), 0)))
@@ -31,6 +33,7 @@ enum NodeType {
   kASTFuncDef,
   kASTKeyValue,
   kASTLocalVar,
+  kASTGlobalVar,
   kASTStructSpec,
   //
   kTypeBase,
@@ -56,6 +59,7 @@ enum TokenType {
   kTokenKwExtern,
   kTokenKwFor,
   kTokenKwIf,
+  kTokenKwInline,
   kTokenKwInt,
   kTokenKwLong,
   kTokenKwReturn,
@@ -92,6 +96,9 @@ Node expr-stmt:
 struct Node {
   enum NodeType type;
   int reg;
+  // for expressions: Sethi-Ullman number, 0 if it is not computed yet
+  int num_of_regs_needed;
+  bool has_side_effect;
   struct Node *expr_type;
   struct Node *op;
   struct Node *left;
@@ -117,6 +124,8 @@ struct Node {
   struct Node *value;
   // for local var
   int byte_offset;
+  // for global var
+  bool is_const;
   // for string literal
   int label_number;
   // kASTExprFuncCall
@@ -128,6 +137,8 @@ struct Node {
   struct Node *func_body;
   struct Node *func_type;
   struct Node *func_name_token;
+  bool is_static;  // of the function definition
+  bool is_inline;
   struct Node *tag;
   struct Node *type_struct_spec;
   struct Node *type_array_type_of;
@@ -141,6 +152,165 @@ struct Node {
   int line;
 };
 
+// Registers in the order of their encoding in x86-64 instructions.
+// Register numbers from kNumOfPhysicalRegs denote virtual registers.
+enum PhysicalRegister {
+  kRegRAX,
+  kRegRCX,
+  kRegRDX,
+  kRegRBX,
+  kRegRSP,
+  kRegRBP,
+  kRegRSI,
+  kRegRDI,
+  kRegR8,
+  kRegR9,
+  kRegR10,
+  kRegR11,
+  kRegR12,
+  kRegR13,
+  kRegR14,
+  kRegR15,
+  kNumOfPhysicalRegs,
+};
+
+enum OperandType {
+  kOperandNone,
+  kOperandReg,         // reg
+  kOperandImm,         // imm
+  kOperandMem,         // [reg + index * scale + imm]
+  kOperandLocalVar,    // [index * scale + local var at byte offset imm]
+  kOperandSpillSlot,   // spill slot imm in the frame
+  kOperandRipLabel,    // [rip + L<imm>]
+  kOperandGOTEntry,    // [rip + symbol@GOTPCREL]
+  kOperandRipSymbol,   // [rip + symbol + imm]
+  kOperandLabel,       // L<imm>
+  kOperandFuncSymbol,  // symbol (through PLT if is_external)
+  kOperandVecReg,      // xmm<reg> if size is 16, ymm<reg> if size is 32
+};
+
+struct Operand {
+  enum OperandType type;
+  int size;  // in bytes. 0 means the size of a memory operand is inferred.
+  int reg;
+  int index;  // for kOperandMem and kOperandLocalVar
+  int scale;  // 0 if index is not used
+  long imm;
+  const char *symbol;
+  bool is_external;
+};
+
+#define MAX_NUM_OF_OPERANDS 3
+
+// x86-64 instruction which may refer virtual registers
+struct Inst {
+  const char *mnemonic;  // NULL if this is a definition of label
+  int label;
+  bool is_aligned;  // for labels of loop headers
+  int num_of_operands;
+  struct Operand operands[MAX_NUM_OF_OPERANDS];
+  int num_of_call_args;  // for call: number of parameter registers used
+};
+
+struct MachineFunc {
+  struct Inst *insts;
+  int num_of_insts;
+  int capacity;
+  int num_of_vregs;
+  bool has_call;
+  int num_of_stack_args;  // max number of args passed on the stack by calls
+  bool has_stack_param;   // reads params passed on the stack via rbp
+  // Filled by AllocateRegisters()
+  int used_callee_saved_regs;  // bitmap of enum PhysicalRegister
+  int num_of_spill_slots;
+};
+
+// Three-address code. dst and srcs are virtual registers numbered from 1.
+enum IROp {
+  kIRParam,       // dst = parameter imm
+  kIRConst,       // dst = imm
+  kIRCopy,        // dst = srcs[0]
+  kIRSext,        // dst = low size bytes of srcs[0], sign-extended
+  kIRPhi,         // dst = srcs[i] if control came from preds[i]
+  kIRLocalAddr,   // dst = address of the local var at byte offset imm
+  kIRGlobalAddr,  // dst = address of symbol
+  kIRStringAddr,  // dst = address of the string literal node
+  kIRLoad,        // dst = sign-extended size bytes at srcs[0]
+  kIRStore,       // size bytes at srcs[0] = srcs[1]
+  kIRMemset,      // srcs[2] bytes at srcs[0] = low byte of srcs[1]
+  kIRMemcpy,      // srcs[2] bytes at srcs[0] = those at srcs[1], forward
+  kIRNeg,         // dst = -srcs[0]
+  kIRNot,         // dst = ~srcs[0]
+  kIRAdd,         // dst = srcs[0] + srcs[1], and so on
+  kIRSub,
+  kIRMul,
+  kIRDiv,
+  kIRMod,
+  kIRShl,
+  kIRSar,
+  kIRAnd,
+  kIROr,
+  kIRXor,
+  kIREq,  // dst = srcs[0] == srcs[1] ? 1 : 0, and so on
+  kIRNe,
+  kIRLt,
+  kIRLe,
+  kIRGt,
+  kIRGe,
+  kIRCall,    // dst = symbol(srcs...), or srcs[0](srcs[1]...) without symbol
+  kIRJump,    // goto targets[0]
+  kIRBranch,  // goto srcs[0] ? targets[0] : targets[1]
+  kIRReturn,  // return srcs[0] if num_of_srcs is 1
+  // Vector ops on lanes of size bytes, in the vector register numbered imm
+  kIRVecSplat,  // dst = srcs[0] in every lane
+  kIRVecLoad,   // dst = vector_size bytes at srcs[0]
+  kIRVecStore,  // vector_size bytes at srcs[0] = srcs[1]
+  kIRVecAdd,    // dst = srcs[0] + srcs[1] in each lane, and so on
+  kIRVecSub,
+  kIRVecAnd,
+  kIRVecOr,
+  kIRVecXor,
+  kNumOfIROps,
+};
+
+struct IRInst {
+  enum IROp op;
+  int dst;  // 0 if the inst does not have a result
+  int num_of_srcs;
+  int *srcs;
+  int size;  // bytes of memory access, or of the return value of calls
+  long imm;  // also the vector register of the result of vector ops
+  const char *symbol;
+  bool is_external;  // for kIRCall and kIRGlobalAddr: symbol is not defined
+                     // in this unit
+  struct Node *node;  // for kIRStringAddr
+  struct IRBlock *targets[2];
+  int inline_depth;  // for kIRCall: number of inlined calls it came from
+};
+
+struct IRBlock {
+  int id;  // index in IRFunc.blocks
+  int num_of_insts;
+  int capacity;
+  struct IRInst *insts;  // the last one is kIRJump, kIRBranch or kIRReturn
+  int num_of_succs;
+  struct IRBlock *succs[2];
+  int num_of_preds;
+  struct IRBlock **preds;
+  bool is_reachable;
+  bool is_loop_header;  // the target of the back edge of a loop
+};
+
+struct IRFunc {
+  struct Node *func_def;
+  struct SymbolEntry *toplevel_ctx;
+  int num_of_blocks;
+  int capacity;
+  struct IRBlock **blocks;  // blocks[0] is the entry. In the layout order.
+  int num_of_vregs;         // including the unused register 0
+  int stack_size;           // bytes of local vars which stay in memory
+};
+
 _Noreturn void Error(const char *fmt, ...);
 _Noreturn void __assert(const char *expr_str, const char *file, int line);
 
@@ -156,17 +326,25 @@ struct Node *GetNodeAt(struct Node *list, int index);
 struct Node *GetNodeByTokenKey(struct Node *list, struct Node *key);
 
 extern const char *symbol_prefix;
+extern const char *rodata_section_directive;
+extern const char *relro_section_directive;
+extern const char *cstring_section_directive;
+extern const char *external_call_suffix;
 extern const char *include_path;
+extern bool is_debug_requested;
+extern bool is_ir_dump_requested;
+extern int vector_size;  // bytes of the vector registers used for loops
 
-#define NUM_OF_SCRATCH_REGS 10
-extern const char *reg_names_64[NUM_OF_SCRATCH_REGS + 1];
-extern const char *reg_names_32[NUM_OF_SCRATCH_REGS + 1];
-extern const char *reg_names_8[NUM_OF_SCRATCH_REGS + 1];
+extern const char *reg_names_64[kNumOfPhysicalRegs];
+extern const char *reg_names_32[kNumOfPhysicalRegs];
+extern const char *reg_names_8[kNumOfPhysicalRegs];
+extern const char *vec_reg_names_16[kNumOfPhysicalRegs];
+extern const char *vec_reg_names_32[kNumOfPhysicalRegs];
 
 #define NUM_OF_PARAM_REGISTERS 6
-extern const char *param_reg_names_64[NUM_OF_PARAM_REGISTERS];
-extern const char *param_reg_names_32[NUM_OF_PARAM_REGISTERS];
-extern const char *param_reg_names_8[NUM_OF_PARAM_REGISTERS];
+// kIRMemset and kIRMemcpy of constant sizes up to this are unrolled
+#define MAX_UNROLLED_MEM_OP_SIZE 256
+extern const int param_regs[NUM_OF_PARAM_REGISTERS];
 
 // @analyzer.c
 struct SymbolEntry *Analyze(struct Node *node);
@@ -177,6 +355,8 @@ bool IsTokenWithType(struct Node *n, enum TokenType type);
 bool IsASTList(struct Node *);
 bool IsASTDeclOfTypedef(struct Node *n);
 bool IsASTDeclOfExtern(struct Node *n);
+bool IsASTDeclOfConstObject(struct Node *n);
+bool IsASTInitializerList(struct Node *n);
 struct Node *AllocNode(enum NodeType type);
 struct Node *CreateASTBinOp(struct Node *t, struct Node *left,
                             struct Node *right);
@@ -188,6 +368,7 @@ struct Node *CreateASTFuncDef(struct Node *func_decl, struct Node *func_body);
 struct Node *CreateASTKeyValue(const char *key, struct Node *value);
 
 struct Node *CreateASTLocalVar(int byte_offset, struct Node *var_type);
+struct Node *CreateASTGlobalVar(struct Node *var_type);
 
 struct Node *CreateTypeBase(struct Node *t);
 
@@ -209,9 +390,75 @@ void PrintASTNode(struct Node *n);
 // @compilium.c
 const char *ReadFile(FILE *fp);
 
+// @emitter.c
+void SetEmitterOutputPath(const char *path);
+void EmitFlush(void);
+void EmitChar(char c);
+void EmitStrN(const char *s, int len);
+void EmitQuotedBytes(const char *s, int len);
+void EmitStr(const char *s);
+void EmitInt(long v);
+void EmitSymbol(const char *name);
+void EmitLabelRef(int label);
+void EmitLabelDef(int label);
+void EmitSymbolDef(const char *name);
+void EmitGlobalSymbol(const char *name);
+void EmitDirective(const char *directive);
+void EmitDirectiveInt(const char *directive, long v);
+void EmitMnemonic(const char *mnemonic);
+void EmitOperandReg(const char *reg);
+void EmitOperandImm(long imm);
+void EmitOperandMem(const char *size, const char *base, int disp);
+void EmitOperandMemWithIndex(const char *size, const char *base,
+                             const char *index, int scale, int disp);
+void EmitOperandLabel(int label);
+void EmitOperandRipLabel(int label);
+void EmitOperandGOTEntry(const char *name);
+void EmitOperandRipSymbol(const char *size, const char *name, int disp);
+void EmitOperandFuncSymbol(const char *name, bool is_external);
+void EmitEndOfInst(void);
+void EmitOp(const char *mnemonic);
+void EmitOpReg(const char *mnemonic, const char *reg);
+void EmitOpRegReg(const char *mnemonic, const char *dst, const char *src);
+void EmitOpRegImm(const char *mnemonic, const char *dst, long imm);
+void EmitOpRegMem(const char *mnemonic, const char *dst, const char *size,
+                  const char *base, int disp);
+void EmitOpMemReg(const char *mnemonic, const char *size, const char *base,
+                  int disp, const char *src);
+void EmitOpMem(const char *mnemonic, const char *size, const char *base,
+               int disp);
+void EmitOpLabel(const char *mnemonic, int label);
+
 // @generate.c
 void Generate(struct Node *ast, struct SymbolEntry *);
 
+// @regalloc.c
+void AllocateRegisters(struct MachineFunc *mf);
+
+// @ir.c
+int NewIRVReg(struct IRFunc *f);
+bool IsIRBlockTerminated(struct IRBlock *b);
+void BuildIRCFG(struct IRFunc *f);
+struct IRFunc *BuildIR(struct Node *func_def,
+                       struct SymbolEntry *toplevel_ctx);
+struct IRInst *InsertIRInst(struct IRBlock *b, int index, enum IROp op,
+                            int dst, int num_of_srcs);
+void PrintIRFunc(struct IRFunc *f);
+
+// @optimizer.c
+bool EliminateTailRecursion(struct IRFunc *f);
+void InlineIRCalls(struct IRFunc *f, struct IRFunc **bodies,
+                   int num_of_bodies);
+void OptimizeIR(struct IRFunc *f);
+
+// @ssa.c
+void EliminateDeadIRInsts(struct IRFunc *f);
+int GetSignExtendedSizeOfIRInst(struct IRInst *def);
+void RemoveUnreachableIRBlocks(struct IRFunc *f);
+struct IRBlock **ComputeIRDominators(struct IRFunc *f);
+void ConvertToSSA(struct IRFunc *f);
+void DestructSSA(struct IRFunc *f);
+
 // @parser.c
 extern struct Node *toplevel_names;
 void InitParser(struct Node **);
@@ -248,8 +495,8 @@ struct Node *AddLocalVar(struct SymbolEntry **ctx, const char *key,
                          struct Node *var_type);
 void AddExternVar(struct SymbolEntry **ctx, const char *key,
                   struct Node *var_type);
-void AddGlobalVar(struct SymbolEntry **ctx, const char *key,
-                  struct Node *var_type);
+struct Node *AddGlobalVar(struct SymbolEntry **ctx, struct Node *key_token,
+                          struct Node *var_type);
 struct Node *FindExternVar(struct SymbolEntry *e, struct Node *key_token);
 struct Node *FindGlobalVar(struct SymbolEntry *e, struct Node *key_token);
 struct Node *FindLocalVar(struct SymbolEntry *e, struct Node *key_token);
@@ -269,6 +516,8 @@ struct Node *AllocToken(const char *src_str, int line, const char *begin,
 struct Node *DuplicateToken(struct Node *base_token);
 struct Node *DuplicateTokenSequence(struct Node *base_head);
 char *CreateTokenStr(struct Node *t);
+int DecodeStringLiteral(struct Node *t, char *buf);
+int EvalCharLiteral(struct Node *t);
 int IsEqualTokenWithCStr(struct Node *t, const char *s);
 void PrintTokenSequence(struct Node *t);
 void OutputTokenSequenceAsCSource(struct Node *t);
@@ -0,0 +1,275 @@
+#include "compilium.h"
+
+// Assembly text is accumulated in a large buffer and handed to the kernel
+// with write(2) only when the buffer is full or EmitFlush() is called.
+#define EMIT_BUF_SIZE (1 << 20)
+
+static char emit_buf[EMIT_BUF_SIZE];
+static int emit_buf_used;
+static int emit_fd = 1;
+static int emit_operand_count;
+
+void SetEmitterOutputPath(const char *path) {
+  assert(path);
+  emit_fd = creat(path, 0644);
+  if (emit_fd < 0) Error("Failed to open %s for writing", path);
+}
+
+void EmitFlush(void) {
+  int ofs = 0;
+  while (ofs < emit_buf_used) {
+    long written = write(emit_fd, emit_buf + ofs, emit_buf_used - ofs);
+    if (written <= 0) Error("Failed to write assembly output");
+    ofs += written;
+  }
+  emit_buf_used = 0;
+}
+
+static char *ReserveEmitBuf(int size) {
+  assert(size <= EMIT_BUF_SIZE);
+  if (emit_buf_used + size > EMIT_BUF_SIZE) EmitFlush();
+  char *p = &emit_buf[emit_buf_used];
+  emit_buf_used += size;
+  return p;
+}
+
+void EmitChar(char c) { *ReserveEmitBuf(1) = c; }
+
+void EmitStrN(const char *s, int len) {
+  while (len > EMIT_BUF_SIZE) {
+    EmitStrN(s, EMIT_BUF_SIZE);
+    s += EMIT_BUF_SIZE;
+    len -= EMIT_BUF_SIZE;
+  }
+  memcpy(ReserveEmitBuf(len), s, len);
+}
+
+void EmitStr(const char *s) { EmitStrN(s, strlen(s)); }
+
+void EmitQuotedBytes(const char *s, int len) {
+  // Emits s as a string for .ascii/.asciz. Bytes other than printable ASCII
+  // are written as octal escapes, so the assembler reads them back as is.
+  EmitChar('"');
+  for (int i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (' ' <= c && c <= '~' && c != '"' && c != '\\') {
+      EmitChar(c);
+      continue;
+    }
+    EmitChar('\\');
+    EmitChar('0' + (c >> 6));
+    EmitChar('0' + ((c >> 3) & 7));
+    EmitChar('0' + (c & 7));
+  }
+  EmitChar('"');
+}
+
+void EmitInt(long v) {
+  // Formats digits from the tail of a local buffer so that
+  // no printf-style format parsing is needed.
+  char digits[24];
+  int p = sizeof(digits);
+  unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+  do {
+    digits[--p] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (v < 0) digits[--p] = '-';
+  EmitStrN(&digits[p], sizeof(digits) - p);
+}
+
+void EmitSymbol(const char *name) {
+  EmitStr(symbol_prefix);
+  EmitStr(name);
+}
+
+void EmitLabelRef(int label) {
+  EmitChar('L');
+  EmitInt(label);
+}
+
+void EmitLabelDef(int label) {
+  EmitLabelRef(label);
+  EmitStrN(":\n", 2);
+}
+
+void EmitSymbolDef(const char *name) {
+  EmitSymbol(name);
+  EmitStrN(":\n", 2);
+}
+
+void EmitGlobalSymbol(const char *name) {
+  EmitStr(".global ");
+  EmitSymbol(name);
+  EmitChar('\n');
+}
+
+void EmitDirective(const char *directive) {
+  EmitStr(directive);
+  EmitChar('\n');
+}
+
+void EmitDirectiveInt(const char *directive, long v) {
+  EmitStr(directive);
+  EmitChar(' ');
+  EmitInt(v);
+  EmitChar('\n');
+}
+
+// Instructions are built as a mnemonic followed by operands.
+// The separators between operands are inserted automatically.
+
+void EmitMnemonic(const char *mnemonic) {
+  EmitStr(mnemonic);
+  emit_operand_count = 0;
+}
+
+static void EmitOperandSeparator(void) {
+  if (emit_operand_count++) {
+    EmitStrN(", ", 2);
+  } else {
+    EmitChar(' ');
+  }
+}
+
+void EmitOperandReg(const char *reg) {
+  EmitOperandSeparator();
+  EmitStr(reg);
+}
+
+void EmitOperandImm(long imm) {
+  EmitOperandSeparator();
+  EmitInt(imm);
+}
+
+void EmitOperandMem(const char *size, const char *base, int disp) {
+  EmitOperandMemWithIndex(size, base, NULL, 0, disp);
+}
+
+void EmitOperandMemWithIndex(const char *size, const char *base,
+                             const char *index, int scale, int disp) {
+  // size: "byte", "dword", "qword" or NULL (inferred from the other operand)
+  // index: NULL if the address does not have an index
+  EmitOperandSeparator();
+  if (size) {
+    EmitStr(size);
+    EmitStrN(" ptr ", 5);
+  }
+  EmitChar('[');
+  EmitStr(base);
+  if (index) {
+    EmitStrN(" + ", 3);
+    EmitStr(index);
+    if (scale != 1) {
+      EmitStrN(" * ", 3);
+      EmitInt(scale);
+    }
+  }
+  if (disp > 0) {
+    EmitStrN(" + ", 3);
+    EmitInt(disp);
+  } else if (disp < 0) {
+    EmitStrN(" - ", 3);
+    EmitInt(-disp);
+  }
+  EmitChar(']');
+}
+
+void EmitOperandLabel(int label) {
+  EmitOperandSeparator();
+  EmitLabelRef(label);
+}
+
+void EmitOperandRipLabel(int label) {
+  EmitOperandSeparator();
+  EmitStrN("[rip + ", 7);
+  EmitLabelRef(label);
+  EmitChar(']');
+}
+
+void EmitOperandGOTEntry(const char *name) {
+  EmitOperandSeparator();
+  EmitStrN("[rip + ", 7);
+  EmitSymbol(name);
+  EmitStr("@GOTPCREL]");
+}
+
+void EmitOperandRipSymbol(const char *size, const char *name, int disp) {
+  EmitOperandSeparator();
+  if (size) {
+    EmitStr(size);
+    EmitStrN(" ptr ", 5);
+  }
+  EmitStrN("[rip + ", 7);
+  EmitSymbol(name);
+  if (disp > 0) {
+    EmitStrN(" + ", 3);
+    EmitInt(disp);
+  } else if (disp < 0) {
+    EmitStrN(" - ", 3);
+    EmitInt(-disp);
+  }
+  EmitChar(']');
+}
+
+void EmitOperandFuncSymbol(const char *name, bool is_external) {
+  EmitOperandSeparator();
+  EmitSymbol(name);
+  if (is_external) EmitStr(external_call_suffix);
+}
+
+void EmitEndOfInst(void) { EmitChar('\n'); }
+
+void EmitOp(const char *mnemonic) {
+  EmitMnemonic(mnemonic);
+  EmitEndOfInst();
+}
+
+void EmitOpReg(const char *mnemonic, const char *reg) {
+  EmitMnemonic(mnemonic);
+  EmitOperandReg(reg);
+  EmitEndOfInst();
+}
+
+void EmitOpRegReg(const char *mnemonic, const char *dst, const char *src) {
+  EmitMnemonic(mnemonic);
+  EmitOperandReg(dst);
+  EmitOperandReg(src);
+  EmitEndOfInst();
+}
+
+void EmitOpRegImm(const char *mnemonic, const char *dst, long imm) {
+  EmitMnemonic(mnemonic);
+  EmitOperandReg(dst);
+  EmitOperandImm(imm);
+  EmitEndOfInst();
+}
+
+void EmitOpRegMem(const char *mnemonic, const char *dst, const char *size,
+                  const char *base, int disp) {
+  EmitMnemonic(mnemonic);
+  EmitOperandReg(dst);
+  EmitOperandMem(size, base, disp);
+  EmitEndOfInst();
+}
+
+void EmitOpMemReg(const char *mnemonic, const char *size, const char *base,
+                  int disp, const char *src) {
+  EmitMnemonic(mnemonic);
+  EmitOperandMem(size, base, disp);
+  EmitOperandReg(src);
+  EmitEndOfInst();
+}
+
+void EmitOpMem(const char *mnemonic, const char *size, const char *base,
+               int disp) {
+  EmitMnemonic(mnemonic);
+  EmitOperandMem(size, base, disp);
+  EmitEndOfInst();
+}
+
+void EmitOpLabel(const char *mnemonic, int label) {
+  EmitMnemonic(mnemonic);
+  EmitOperandLabel(label);
+  EmitEndOfInst();
+}
@@ -14,6 +14,8 @@
 int puts(char*);
 int printf(char*, int);
 void exit(int);
+void* memset(void*, int, int);
+void* memcpy(void*, void*, int);
 
 void ExpectEq(int actual, int expected, int line) {
   printf("Line %3d: ", line);
@@ -172,6 +174,161 @@ void TestStructVecSumRef(int x0, int y0, int x1, int y1, int x_expected,
   ExpectEq(vp0->y + v1.y, y_expected, __LINE__);
 }
 
+int global_int_with_init = 3 * 4 + 1;
+int global_array_with_init[5] = {2, 3, 5, 7};
+int global_2d_array_with_init[2][3] = {{1, 2, 3}, {4, 5}};
+const int global_const_table[] = {10, 20, 30};
+char global_char_array_with_init[] = "abc";
+char* global_str_ptr_with_init = "compilium";
+int* global_ptr_to_global = &global_array_with_init[2];
+struct Point2D global_points_with_init[] = {{1, 2}, {3, 4}};
+int* global_ptr_to_2d_elem = &global_2d_array_with_init[1][1];
+int* global_ptr_to_2d_row = global_2d_array_with_init[1];
+struct Point2D global_points_without_braces[] = {1, 2, 3, 4, 5};
+int global_redeclared_with_size[];
+int global_redeclared_with_size[3] = {1, 2, 3};
+int global_redeclared_without_size[2];
+int global_redeclared_without_size[] = {4, 5};
+char global_chars_truncated[2] = {256 + 44, 200};
+
+void TestGlobalInitializer() {
+  ExpectEq(global_int_with_init, 13, __LINE__);
+  ExpectEq(global_array_with_init[0], 2, __LINE__);
+  ExpectEq(global_array_with_init[3], 7, __LINE__);
+  ExpectEq(global_array_with_init[4], 0, __LINE__);
+  ExpectEq(global_2d_array_with_init[0][2], 3, __LINE__);
+  ExpectEq(global_2d_array_with_init[1][1], 5, __LINE__);
+  ExpectEq(global_2d_array_with_init[1][2], 0, __LINE__);
+  ExpectEq(sizeof(global_const_table), 12, __LINE__);
+  ExpectEq(global_const_table[2], 30, __LINE__);
+  ExpectEq(sizeof(global_char_array_with_init), 4, __LINE__);
+  ExpectEq(global_char_array_with_init[1], 'b', __LINE__);
+  ExpectEq(global_str_ptr_with_init[8], 'm', __LINE__);
+  ExpectEq(*global_ptr_to_global, 5, __LINE__);
+  ExpectEq(global_points_with_init[1].y, 4, __LINE__);
+  ExpectEq(*global_ptr_to_2d_elem, 5, __LINE__);
+  ExpectEq(global_ptr_to_2d_row[0], 4, __LINE__);
+  ExpectEq(sizeof(global_points_without_braces), 24, __LINE__);
+  ExpectEq(global_points_without_braces[1].y, 4, __LINE__);
+  ExpectEq(global_points_without_braces[2].x, 5, __LINE__);
+  ExpectEq(global_points_without_braces[2].y, 0, __LINE__);
+  ExpectEq(sizeof(global_redeclared_with_size), 12, __LINE__);
+  ExpectEq(global_redeclared_with_size[2], 3, __LINE__);
+  ExpectEq(sizeof(global_redeclared_without_size), 8, __LINE__);
+  ExpectEq(global_redeclared_without_size[1], 5, __LINE__);
+  ExpectEq(global_chars_truncated[0], 44, __LINE__);
+  ExpectEq(global_chars_truncated[1], -56, __LINE__);
+  struct Point2D local_points_without_braces[] = {1, 2, {3, 4}, 5};
+  ExpectEq(sizeof(local_points_without_braces), 24, __LINE__);
+  ExpectEq(local_points_without_braces[1].y, 4, __LINE__);
+  ExpectEq(local_points_without_braces[2].x, 5, __LINE__);
+}
+
+void TestStringLiteralPool() {
+  char* s0 = "pool";
+  char* s1 = "pool";
+  char* s2 = "p\157ol";
+  ExpectEq(s0 == s1, 1, __LINE__);
+  ExpectEq(s0 == s2, 1, __LINE__);
+  ExpectEq(s0 == global_str_ptr_with_init, 0, __LINE__);
+  ExpectEq("\x41\101"[1], 'A', __LINE__);
+  // Literals differing only after a null character are not merged
+  char* s3 = "a\0b";
+  char* s4 = "a\0c";
+  ExpectEq(s3[2], 'b', __LINE__);
+  ExpectEq(s4[2], 'c', __LINE__);
+  ExpectEq(s3 == s4, 0, __LINE__);
+  // Both spellings share one entry which holds the decoded byte
+  char* s5 = "\a";
+  char* s6 = "\7";
+  ExpectEq(s5 == s6, 1, __LINE__);
+  ExpectEq(s5[0], 7, __LINE__);
+  ExpectEq(s6[0], 7, __LINE__);
+  ExpectEq("\b\a"[1], 7, __LINE__);
+  ExpectEq("\"\\\n"[1], '\\', __LINE__);
+}
+
+int Identity(int v) { return v; }
+
+void TestLiveValuesAcrossCall() {
+  // Each left operand stays in a register while the right side calls
+  ExpectEq(Identity(1) +
+               (Identity(2) +
+                (Identity(3) +
+                 (Identity(4) +
+                  (Identity(5) +
+                   (Identity(6) + (Identity(7) + Identity(8))))))),
+           36, __LINE__);
+}
+
+int ClampToPercent(int v, int lo) {
+  if (v < lo) return lo;
+  if (v >= 100) return 100;
+  if (v == 50) return v;
+  return v + 0;
+}
+
+int SumDownTo(int n, int stop) {
+  // n stays in a callee-saved register across the call on the slow path
+  if (n <= stop) return stop;
+  return Identity(n) + SumDownTo(n - 1, stop);
+}
+
+int DoubleUnlessHuge(int n) {
+  if (n == 4294967296) return 1;
+  return Identity(n) * 2;
+}
+
+int SumIfPositive(int n, int m) {
+  if (n > 0) {
+    return Identity(n) + Identity(m);
+  }
+  return m - n;
+}
+
+void TestEarlyReturn() {
+  ExpectEq(ClampToPercent(-5, 0), 0, __LINE__);
+  ExpectEq(ClampToPercent(500, 0), 100, __LINE__);
+  ExpectEq(ClampToPercent(50, 0), 50, __LINE__);
+  ExpectEq(ClampToPercent(42, 0), 42, __LINE__);
+  ExpectEq(SumDownTo(5, 2), 14, __LINE__);
+  ExpectEq(SumDownTo(1, 2), 2, __LINE__);
+  ExpectEq(DoubleUnlessHuge(3), 6, __LINE__);
+  ExpectEq(SumIfPositive(3, 4), 7, __LINE__);
+  ExpectEq(SumIfPositive(-3, 4), 7, __LINE__);
+}
+
+void TestDeepExpression() {
+  // More values are live at once than there are registers
+  int v = 1;
+  ExpectEq(v +
+               (v +
+                (v +
+                 (v +
+                  (v +
+                   (v +
+                    (v +
+                     (v +
+                      (v +
+                       (v +
+                        (v +
+                         (v +
+                          (v +
+                           (v + Identity(v)))))))))))))),
+           15, __LINE__);
+}
+
+void TestEvaluationOrder() {
+  // The heavier right operands are evaluated first
+  int v = 3;
+  int a[2];
+  ExpectEq(v - (v * (v + (v - 1))), -12, __LINE__);
+  ExpectEq(v / (v - (v - 1)), 3, __LINE__);
+  ExpectEq(1 << (v + (v - v)), 8, __LINE__);
+  a[v - 2] = v * (v + (v - 1));
+  ExpectEq(a[1], 15, __LINE__);
+}
+
 int TestArray(int v0, int v1, int v2, int idx) {
   int a[3];
   a[0] = v0;
@@ -251,6 +408,13 @@ void TestReassign() {
   c = 2 + 3;
   ExpectEq(c, 5, __LINE__);
   ExpectEq(c + 2, 7, __LINE__);
+  int i;
+  int k = (i = 4) + 1;
+  ExpectEq(i + k, 9, __LINE__);
+  i = k = 7;
+  ExpectEq(i, 7, __LINE__);
+  ExpectEq((c = 300) == 44, 1, __LINE__);
+  ExpectEq((c += 2) != 46 || (k *= 2) != 14, 0, __LINE__);
 }
 
 int UnreachableReturn() {
@@ -301,6 +465,64 @@ void TestBreak() {
   ExpectEq(v, 15, __LINE__);
 }
 
+void TestContinue() {
+  int v = 0;
+  int i;
+  for (i = 0; i < 10; i++) {
+    if (i % 2) continue;
+    v += i;
+  }
+  ExpectEq(v, 20, __LINE__);
+  ExpectEq(i, 10, __LINE__);
+
+  v = 0;
+  i = 0;
+  while (i < 5) {
+    for (int k = 0; k < 3; k++) {
+      if (k == 1) continue;
+      v++;
+    }
+    i++;
+    if (i == 2) continue;
+    v += 10;
+  }
+  ExpectEq(v, 50, __LINE__);
+}
+
+void TestLocalVarsInRegisters() {
+  // Values assigned to locals are truncated to their types
+  char c = 300;
+  ExpectEq(c, 44, __LINE__);
+  c = c * 3;
+  ExpectEq(c, -124, __LINE__);
+  int a = 1;
+  int b = 2;
+  for (int i = 0; i < 3; i++) {
+    int t = a;
+    a = b;
+    b = t;
+  }
+  ExpectEq(a, 2, __LINE__);
+  ExpectEq(b, 1, __LINE__);
+  int v;
+  if (a == 2) v = 7;
+  if (a != 2) v = 9;
+  ExpectEq(v, 7, __LINE__);
+}
+
+int TestConstantFolding(int x) {
+  int k = 3;
+  int y = k * 4 + (2 > 1 ? 5 : 7) + sizeof(k) + ('a' == 97 && 0 || k);
+  ExpectEq(y, 22, __LINE__);
+  ExpectEq(1 / 1 * 2 / 2 * 3 / 3 * 100 % 7, 2, __LINE__);
+  ExpectEq(1 << 10 >> 3, 128, __LINE__);
+  if (k != 3) return 0;
+  while (0) {
+    x = 5;
+  }
+  return x + y;
+}
+
 void TestShortCircuitEval() {
   int v = 1;
   v++ && 0 && v++;
@@ -310,9 +532,255 @@ void TestShortCircuitEval() {
   ExpectEq(v, 1, __LINE__);
 }
 
+int TestConditionBranches(int a, int b) {
+  int n = 0;
+  if (a < b && !(a == 0) || b == 3) n++;
+  if (!(a > b || a++ != 2)) n += 10;
+  while (a && b--) n += 100;
+  return (n != 0 ? n : -1) + (a >= 3 && b <= -1);
+}
+
+void TestDivByConst(int n, int d) {
+  // Compares strength-reduced sequences with idiv by d
+  ExpectEq(n / 7, n / d, __LINE__);
+  ExpectEq(n % 7, n % d, __LINE__);
+  ExpectEq(n / -8 * -1, n / (d + 1), __LINE__);
+  ExpectEq(n % 8, n % (d + 1), __LINE__);
+  ExpectEq(n * 10, n * (d + 3), __LINE__);
+  ExpectEq(n * 12 / 4, n * 3, __LINE__);
+}
+
+int loop_invariant_global;
+
+int TestLoopInvariants(int n, int* p, int* q) {
+  // *p may be loop_invariant_global, and q may be NULL
+  int sum = 0;
+  loop_invariant_global = 1;
+  for (int i = 0; i < n; i++) {
+    sum += loop_invariant_global * (n + 2);
+    *p = *p + 1;
+    if (q) sum += *q;
+  }
+  return sum;
+}
+
+int TestInductionVars(int w, int h) {
+  int map[4][8];
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      map[y][x] = y * 10 + x;
+    }
+  }
+  int sum = 0;
+  for (int i = 1; i < w; i += 2) sum += map[h - 1][i];
+  return sum;
+}
+
+void AddIntArrays(int* dst, int* l, int* r, int n) {
+  for (int i = 0; i < n; i++) dst[i] = l[i] + r[i];
+}
+
+void XorCharArray(char* dst, char* src, int n, int k) {
+  for (int i = 0; i < n; i++) dst[i] = src[i] ^ k;
+}
+
+void TestVectorizedLoops(int n) {
+  int a[40];
+  int b[40];
+  char s[40];
+  for (int i = 0; i < 40; i++) {
+    a[i] = i;
+    b[i] = 100;
+    s[i] = i;
+  }
+  AddIntArrays(a, a, b, n);
+  ExpectEq(a[0] + a[n - 1] + a[n], 200 + n - 1 + n, __LINE__);
+  // Each element depends on the previous one
+  AddIntArrays(&b[1], b, a, n);
+  ExpectEq(b[n], 100 + n * 100 + (n - 1) * n / 2, __LINE__);
+  XorCharArray(s, s, n, 0x41);
+  ExpectEq(s[n - 1] + s[n], ((n - 1) ^ 0x41) + n, __LINE__);
+  XorCharArray(&s[1], s, n, 1);
+  ExpectEq(s[n], (0x41 ^ (n & 1)), __LINE__);
+}
+
+void FillIntArray(int* dst, int n, int v) {
+  for (int i = 0; i < n; i++) dst[i] = v;
+}
+
+void CopyIntArray(int* dst, int* src, int n) {
+  for (int i = 0; i < n; i++) dst[i] = src[i];
+}
+
+void TestMemoryFillAndCopy(int n) {
+  // Bytes not given by the initializers are cleared
+  int a[1200] = {1, 2, n};
+  char s[8] = "abc";
+  struct Point2D p = {n};
+  ExpectEq(a[0] + a[1] + a[2] + a[3] + a[1199], 3 + n, __LINE__);
+  ExpectEq(s[2] + s[3] + s[7] + p.x + p.y, 'c' + n, __LINE__);
+  FillIntArray(a, n, -1);
+  FillIntArray(&a[n], 1200 - n, 0);
+  ExpectEq(a[n - 1] + a[n] + a[1199], -1, __LINE__);
+  for (int i = 0; i < n; i++) a[i] = i;
+  CopyIntArray(&a[n], a, n);
+  ExpectEq(a[n + n - 1] + a[n + n], n - 1, __LINE__);
+  // Each element depends on the previous one
+  CopyIntArray(&a[1], a, n);
+  ExpectEq(a[n], 0, __LINE__);
+  memset(s, 'x', 5);
+  memcpy(&s[5], "yz", 3);
+  ExpectEq(s[0] + s[4] + s[6] + s[7], 'x' + 'x' + 'z', __LINE__);
+}
+
+void TestAddressingModes(int n) {
+  struct Point2D ps[4];
+  char cs[4];
+  for (int i = 0; i < n; i++) {
+    ps[i].x = i;
+    ps[i].y = -1;
+    cs[i] = 200;
+  }
+  struct Point2D* p = &ps[1];
+  p->y = 100000;
+  ExpectEq(ps[3].x + ps[2].y + ps[1].y, 100002, __LINE__);
+  ExpectEq(cs[n - 1], -56, __LINE__);
+}
+
+static inline int Clamp(int v, int lo, int hi) {
+  if (v < lo) return lo;
+  if (v > hi) return hi;
+  return v;
+}
+
+static int SumOfDigits(int v) {
+  char digits[4];
+  int sum = 0;
+  for (int i = 0; i < 4; i++) {
+    digits[i] = v % 10;
+    v /= 10;
+  }
+  for (int i = 0; i < 4; i++) sum += digits[i];
+  return sum;
+}
+
+static int IsOdd(int n);
+static int IsEven(int n) {
+  if (n == 0) return 1;
+  return IsOdd(n - 1);
+}
+static int IsOdd(int n) {
+  if (n == 0) return 0;
+  return IsEven(n - 1);
+}
+
+static int NeverCalled(void) { return 0; }
+
+static int inlined_calls;
+static void CountInlinedCall(void) { inlined_calls++; }
+
+void TestInlining(int n) {
+  inlined_calls = 0;
+  int sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += Clamp(i * 3, 5, 20) + SumOfDigits(i * 111);
+    CountInlinedCall();
+  }
+  ExpectEq(sum, 265, __LINE__);
+  ExpectEq(inlined_calls, n, __LINE__);
+  ExpectEq(IsEven(n) * 10 + IsOdd(n - 1), 11, __LINE__);
+}
+
+int Factorial(int n) {
+  if (n <= 1) return 1;
+  return n * Factorial(n - 1);
+}
+
+int SumUpTo(int n, int acc) {
+  if (n == 0) return acc;
+  return SumUpTo(n - 1, acc + n);
+}
+
+int CountBits(int v) {
+  if (!v) return 0;
+  return CountBits(v >> 1) + (v & 1);
+}
+
+static int tail_call_count;
+void CountDown(int n) {
+  if (n) {
+    tail_call_count++;
+    CountDown(n - 1);
+  }
+}
+
+int AddTen(int v) { return v + 10; }
+int CallAddTen(int v, int w) { return AddTen(v * w); }
+
+void TestTailCalls(int n) {
+  ExpectEq(Factorial(n), 3628800, __LINE__);
+  ExpectEq(SumUpTo(n * 100, 0), 500500, __LINE__);
+  ExpectEq(CountBits(n * 100 + 23), 10, __LINE__);
+  tail_call_count = 0;
+  CountDown(n);
+  ExpectEq(tail_call_count, n, __LINE__);
+  ExpectEq(CallAddTen(n, 3), 40, __LINE__);
+  ExpectEq(IsOdd(n * 101), 0, __LINE__);
+}
+
+int WeightedSum8(int a, int b, int c, int d, int e, int f, int g, int h) {
+  return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h;
+}
+
+char* SkipChars(int a, int b, int c, int d, int e, int f, char* s, int n) {
+  return s + a + b + c + d + e + f + n;
+}
+
+int RotateArgs(int n, int a, int b, int c, int d, int e, int f, int g) {
+  if (n == 0) return a * 10 + g;
+  return RotateArgs(n - 1, g, a, b, c, d, e, f);
+}
+
+void TestStackArgs(int n) {
+  ExpectEq(WeightedSum8(n, 2, 3, 4, 5, 6, 7, 8), 204, __LINE__);
+  ExpectEq(WeightedSum8(8, 7, 6, 5, 4, 3, 2, n), 120, __LINE__);
+  ExpectEq(*SkipChars(0, 0, 1, 0, 0, 0, "abcdef", n), 'c', __LINE__);
+  ExpectEq(RotateArgs(n + 2, 1, 2, 3, 4, 5, 6, 7), 54, __LINE__);
+  ExpectEq(WeightedSum8(WeightedSum8(n, 0, 0, 0, 0, 0, 0, 0), n, n, n, n,
+                        n, n, WeightedSum8(0, 0, 0, 0, 0, 0, 0, n)),
+           92, __LINE__);
+}
+
 int main(int argc, char** argv) {
+  TestGlobalInitializer();
+  TestStringLiteralPool();
+  TestLiveValuesAcrossCall();
+  TestEarlyReturn();
+  TestDeepExpression();
+  TestEvaluationOrder();
   TestShortCircuitEval();
+  TestAddressingModes(4);
+  TestInlining(10);
+  TestTailCalls(10);
+  TestStackArgs(1);
+  int v = 10;
+  ExpectEq(TestLoopInvariants(3, &v, 0), 15, __LINE__);
+  ExpectEq(TestLoopInvariants(3, &loop_invariant_global, &v), 69, __LINE__);
+  TestVectorizedLoops(37);
+  TestVectorizedLoops(3);
+  TestMemoryFillAndCopy(37);
+  TestMemoryFillAndCopy(580);
+  ExpectEq(TestInductionVars(8, 4), 136, __LINE__);
+  ExpectEq(TestInductionVars(3, 1), 1, __LINE__);
+  TestDivByConst(100, 7);
+  TestDivByConst(-100, 7);
+  TestDivByConst(-3, 7);
+  ExpectEq(TestConditionBranches(2, 3), 312, __LINE__);
+  ExpectEq(TestConditionBranches(0, 0), -1, __LINE__);
   TestBreak();
+  TestContinue();
+  TestLocalVarsInRegisters();
+  ExpectEq(TestConstantFolding(8), 30, __LINE__);
   TestConstTypeSpec();
   TestPtrOfVar();
   TestReassign();
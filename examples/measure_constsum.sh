@@ -1,6 +1,8 @@
 #!/bin/bash -e
 echo "building..."
 make constsum.bin >/dev/null 2>&1
+make constsum.S >/dev/null 2>&1
+echo "div instructions in constsum.S: $(grep -c div constsum.S || true)"
 make constsum.host.bin constsum.host_o3.bin >/dev/null 2>&1
 echo "running constsum.bin (by compilium)..."
 ( time ./constsum.bin ) 2>&1 | grep real
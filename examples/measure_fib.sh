@@ -1,6 +1,8 @@
 #!/bin/bash -e
 echo "building..."
 make fib.bin >/dev/null 2>&1
+make fib.S >/dev/null 2>&1
+echo "push instructions in fib.S: $(grep -c push fib.S || true)"
 make fib.host.bin fib.host_o3.bin >/dev/null 2>&1
 echo "running fib.bin (by compilium)..."
 ( time ./fib.bin ) 2>&1 | grep real
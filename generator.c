@@ -1,715 +1,1940 @@
 #include "compilium.h"
 
-static void GenerateForNodeRValue(struct Node *node);
-
 static struct Node *str_list;
-static int label_to_break;
-static int label_to_continue;
 
 static int GetLabelNumber() {
   static int label_number;
   return ++label_number;
 }
 
-static void EmitConvertToBool(int dst, int src) {
-  // This code also sets zero flag as boolean value
-  printf("cmp %s, 0\n", reg_names_64[src]);
-  printf("setnz %s\n", reg_names_8[src]);
-  printf("movzx %s, %s\n", reg_names_64[dst], reg_names_8[src]);
+static int GetStringLiteralLabel(struct Node *n) {
+  // String literals with the same content share one label in str_list
+  if (n->label_number) return n->label_number;
+  int length = DecodeStringLiteral(n->op, NULL);
+  char *s = malloc(length + 1);
+  DecodeStringLiteral(n->op, s);
+  s[length] = 0;
+  for (int i = 0; i < GetSizeOfList(str_list); i++) {
+    struct Node *kv = GetNodeAt(str_list, i);
+    if (DecodeStringLiteral(kv->value->op, NULL) != length) continue;
+    if (memcmp(kv->key, s, length)) continue;
+    n->label_number = kv->value->label_number;
+    return n->label_number;
+  }
+  n->label_number = GetLabelNumber();
+  PushKeyValueToList(str_list, s, n);
+  return n->label_number;
 }
 
-static void EmitCompareIntegers(int dst, int left, int right, const char *cc) {
-  printf("cmp %s, %s\n", reg_names_64[left], reg_names_64[right]);
-  printf("set%s %s\n", cc, reg_names_8[dst]);
-  printf("movzx %s, %s\n", reg_names_64[dst], reg_names_8[dst]);
+// Code of a function is built as instructions on virtual registers in mf.
+// They are emitted after AllocateRegisters() maps them to physical ones.
+static struct MachineFunc *mf;
+
+static struct Inst *AddInst(const char *mnemonic) {
+  if (mf->num_of_insts == mf->capacity) {
+    mf->capacity = mf->capacity * 2 + 64;
+    mf->insts = realloc(mf->insts, mf->capacity * sizeof(struct Inst));
+    assert(mf->insts);
+  }
+  struct Inst *inst = &mf->insts[mf->num_of_insts++];
+  inst->mnemonic = mnemonic;
+  inst->label = 0;
+  inst->is_aligned = false;
+  inst->num_of_operands = 0;
+  inst->num_of_call_args = 0;
+  return inst;
 }
 
-static void EmitMoveToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 8) {
-    printf("mov [%s], %s\n", reg_names_64[dst], reg_names_64[src]);
-    return;
+static void AddOperand(struct Inst *inst, struct Operand op) {
+  assert(inst->num_of_operands < MAX_NUM_OF_OPERANDS);
+  inst->operands[inst->num_of_operands++] = op;
+}
+
+static struct Inst *AddInst1(const char *mnemonic, struct Operand op0) {
+  struct Inst *inst = AddInst(mnemonic);
+  AddOperand(inst, op0);
+  return inst;
+}
+
+static struct Inst *AddInst2(const char *mnemonic, struct Operand op0,
+                             struct Operand op1) {
+  struct Inst *inst = AddInst1(mnemonic, op0);
+  AddOperand(inst, op1);
+  return inst;
+}
+
+static struct Inst *AddInst3(const char *mnemonic, struct Operand op0,
+                             struct Operand op1, struct Operand op2) {
+  struct Inst *inst = AddInst2(mnemonic, op0, op1);
+  AddOperand(inst, op2);
+  return inst;
+}
+
+static struct Inst *AddLabel(int label) {
+  struct Inst *inst = AddInst(NULL);
+  inst->label = label;
+  return inst;
+}
+
+static struct Operand AllocOperand(enum OperandType type) {
+  struct Operand op;
+  op.type = type;
+  op.size = 0;
+  op.reg = 0;
+  op.index = 0;
+  op.scale = 0;
+  op.imm = 0;
+  op.symbol = NULL;
+  op.is_external = false;
+  return op;
+}
+
+static struct Operand Reg(int reg, int size) {
+  struct Operand op = AllocOperand(kOperandReg);
+  op.reg = reg;
+  op.size = size;
+  return op;
+}
+
+static struct Operand Reg64(int reg) { return Reg(reg, 8); }
+
+static struct Operand Reg32(int reg) { return Reg(reg, 4); }
+
+static struct Operand Reg8(int reg) { return Reg(reg, 1); }
+
+static struct Operand Imm(long imm) {
+  struct Operand op = AllocOperand(kOperandImm);
+  op.imm = imm;
+  return op;
+}
+
+static struct Operand Mem(int size, int base, long disp) {
+  // size 0 means that the size is inferred from the other operand
+  struct Operand op = AllocOperand(kOperandMem);
+  op.size = size;
+  op.reg = base;
+  op.imm = disp;
+  return op;
+}
+
+static struct Operand LocalVar(int size, int byte_offset) {
+  struct Operand op = AllocOperand(kOperandLocalVar);
+  op.size = size;
+  op.imm = byte_offset;
+  return op;
+}
+
+static struct Operand Label(int label) {
+  struct Operand op = AllocOperand(kOperandLabel);
+  op.imm = label;
+  return op;
+}
+
+static struct Operand RipLabel(int label) {
+  struct Operand op = AllocOperand(kOperandRipLabel);
+  op.imm = label;
+  return op;
+}
+
+static struct Operand GOTEntry(const char *symbol) {
+  struct Operand op = AllocOperand(kOperandGOTEntry);
+  op.symbol = symbol;
+  return op;
+}
+
+static struct Operand RipSymbol(int size, const char *symbol, long disp) {
+  struct Operand op = AllocOperand(kOperandRipSymbol);
+  op.size = size;
+  op.symbol = symbol;
+  op.imm = disp;
+  return op;
+}
+
+static struct Operand FuncSymbol(const char *symbol, bool is_external) {
+  struct Operand op = AllocOperand(kOperandFuncSymbol);
+  op.symbol = symbol;
+  op.is_external = is_external;
+  return op;
+}
+
+static struct Operand VecReg(int reg, int size) {
+  struct Operand op = AllocOperand(kOperandVecReg);
+  op.reg = reg;
+  op.size = size;
+  return op;
+}
+
+static struct SymbolEntry *toplevel_ctx;
+
+// Frame of the function being generated:
+//   [rbp + 16 + 8 * (i - 6)]: param i passed on the stack
+//   [rbp + 8]: return address
+//   [rbp]: saved rbp
+//   [rbp - 8] ...: callee-saved registers used in the function
+//   [rbp - callee_saved_area_size - byte_offset]: local variables
+//   [rbp - spill_area_base - 8 * (slot + 1)]: spilled virtual registers
+//   [rsp + 8 * (i - 6)]: arg i passed on the stack to a callee
+static struct Node *func_being_generated;
+static bool has_frame;
+static int frame_size;
+static int callee_saved_area_size;
+static int spill_area_base;
+// Every return jumps to the epilogue placed at func_exit_label
+static int func_exit_label;
+// Upper halves of ymm registers are cleared before calls and returns, so
+// that SSE code outside does not pay for preserving them.
+static bool is_vzeroupper_needed;
+
+static bool IsCalleeSavedRegUsed(int reg) {
+  return mf->used_callee_saved_regs & (1 << reg);
+}
+
+static void PlanFrame(struct Node *func_def, int stack_size) {
+  // stack_size: bytes of local vars which stay in memory
+  func_being_generated = func_def;
+  int num_of_saved_regs = 0;
+  for (int i = 0; i < kNumOfPhysicalRegs; i++) {
+    if (IsCalleeSavedRegUsed(i)) num_of_saved_regs++;
   }
-  if (size == 4) {
-    printf("mov [%s], %s # 4 byte store\n", reg_names_64[dst],
-           reg_names_32[src]);
-    return;
+  callee_saved_area_size = num_of_saved_regs * 8;
+  spill_area_base =
+      callee_saved_area_size + ((stack_size + 7) & ~7);
+  frame_size = spill_area_base + mf->num_of_spill_slots * 8 +
+               mf->num_of_stack_args * 8;
+  // A leaf function which does not touch the stack runs without any frame
+  has_frame =
+      is_debug_requested || mf->has_call || mf->has_stack_param || frame_size;
+}
+
+static void EmitPrologue(void) {
+  if (!has_frame) return;
+  EmitOpReg("push", "rbp");
+  EmitOpRegReg("mov", "rbp", "rsp");
+  for (int i = 0; i < kNumOfPhysicalRegs; i++) {
+    if (IsCalleeSavedRegUsed(i)) EmitOpReg("push", reg_names_64[i]);
   }
-  if (size == 1) {
-    printf("mov [%s], %s\n", reg_names_64[dst], reg_names_8[src]);
+  // The whole frame is allocated here and rsp stays aligned to 16 bytes
+  // for every call in the function.
+  int stack_adjust = ((frame_size + 0xF) & ~0xF) - callee_saved_area_size;
+  if (stack_adjust) EmitOpRegImm("sub", "rsp", stack_adjust);
+}
+
+static void EmitFrameRelease(void) {
+  // Restores the registers and the stack pointer of the caller
+  if (is_vzeroupper_needed) EmitOp("vzeroupper");
+  if (!has_frame) return;
+  if (callee_saved_area_size) {
+    EmitOpRegMem("lea", "rsp", NULL, "rbp", -callee_saved_area_size);
+    for (int i = kNumOfPhysicalRegs - 1; i >= 0; i--) {
+      if (IsCalleeSavedRegUsed(i)) EmitOpReg("pop", reg_names_64[i]);
+    }
+  } else {
+    EmitOpRegReg("mov", "rsp", "rbp");
+  }
+  EmitOpReg("pop", "rbp");
+}
+
+static void EmitEpilogue(void) {
+  EmitFrameRelease();
+  EmitOp("ret");
+}
+
+static const char *GetPtrSizeName(int size) {
+  if (size == 8) return "qword";
+  if (size == 4) return "dword";
+  if (size == 1) return "byte";
+  assert(size == 0);
+  return NULL;
+}
+
+static const char *GetRegName(struct Operand *op) {
+  if (op->size == 8) return reg_names_64[op->reg];
+  if (op->size == 4) return reg_names_32[op->reg];
+  assert(op->size == 1);
+  return reg_names_8[op->reg];
+}
+
+static void EmitOperand(struct Operand *op) {
+  if (op->type == kOperandReg) {
+    EmitOperandReg(GetRegName(op));
+  } else if (op->type == kOperandImm) {
+    EmitOperandImm(op->imm);
+  } else if (op->type == kOperandMem) {
+    EmitOperandMemWithIndex(GetPtrSizeName(op->size), reg_names_64[op->reg],
+                            op->scale ? reg_names_64[op->index] : NULL,
+                            op->scale, op->imm);
+  } else if (op->type == kOperandLocalVar) {
+    EmitOperandMemWithIndex(GetPtrSizeName(op->size), "rbp",
+                            op->scale ? reg_names_64[op->index] : NULL,
+                            op->scale, -(callee_saved_area_size + op->imm));
+  } else if (op->type == kOperandSpillSlot) {
+    EmitOperandMem(NULL, "rbp", -(spill_area_base + 8 * (op->imm + 1)));
+  } else if (op->type == kOperandRipSymbol) {
+    EmitOperandRipSymbol(GetPtrSizeName(op->size), op->symbol, op->imm);
+  } else if (op->type == kOperandRipLabel) {
+    EmitOperandRipLabel(op->imm);
+  } else if (op->type == kOperandGOTEntry) {
+    EmitOperandGOTEntry(op->symbol);
+  } else if (op->type == kOperandLabel) {
+    EmitOperandLabel(op->imm);
+  } else if (op->type == kOperandFuncSymbol) {
+    EmitOperandFuncSymbol(op->symbol, op->is_external);
+  } else if (op->type == kOperandVecReg) {
+    EmitOperandReg(op->size == 32 ? vec_reg_names_32[op->reg]
+                                  : vec_reg_names_16[op->reg]);
+  } else {
+    assert(false);
+  }
+}
+
+static void EmitInst(struct Inst *inst) {
+  if (!inst->mnemonic) {
+    // Loop headers are aligned unless it takes more than 10 bytes of padding
+    if (inst->is_aligned) EmitDirective(".p2align 4,,10");
+    EmitLabelDef(inst->label);
     return;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  struct Operand *ops = inst->operands;
+  for (int i = 0; i < inst->num_of_operands; i++) {
+    if (ops[i].type == kOperandGOTEntry) EmitGlobalSymbol(ops[i].symbol);
+  }
+  EmitMnemonic(inst->mnemonic);
+  for (int i = 0; i < inst->num_of_operands; i++) EmitOperand(&ops[i]);
+  EmitEndOfInst();
+}
+
+// IR is lowered to x86-64 instructions one by one. IR register v becomes
+// the virtual register kNumOfPhysicalRegs + v in mf.
+//
+// Constants are folded into instructions as immediates, and additions of
+// constants and scaled indexes are folded into memory operands. The value of
+// an IR register is computed into a register only if some instruction needs
+// it there, which is found by PlanIRFunc() before lowering.
+static int *block_labels;
+static struct IRInst **ir_defs;  // NULL for registers defined more than once
+static bool *is_reg_needed;
+static int *reg_worklist;
+static int num_of_reg_work;
+static bool is_planning;
+
+static struct Operand DstReg(int ir_reg, int size) {
+  return Reg(kNumOfPhysicalRegs + ir_reg, size);
+}
+
+static void UseIRReg(int ir_reg) {
+  if (is_planning && !is_reg_needed[ir_reg]) {
+    is_reg_needed[ir_reg] = true;
+    reg_worklist[num_of_reg_work++] = ir_reg;
+  }
+}
+
+static struct Operand SrcReg(int ir_reg, int size) {
+  UseIRReg(ir_reg);
+  return Reg(kNumOfPhysicalRegs + ir_reg, size);
+}
+
+static bool IsInt32(long v) { return -2147483648L <= v && v <= 2147483647L; }
+
+static bool IsConstIRReg(int ir_reg) {
+  struct IRInst *def = ir_defs[ir_reg];
+  return def && def->op == kIRConst;
+}
+
+static bool IsImm32IRReg(int ir_reg) {
+  return IsConstIRReg(ir_reg) && IsInt32(ir_defs[ir_reg]->imm);
+}
+
+static struct Operand Src64(int ir_reg) {
+  // mov can take any immediate
+  if (IsConstIRReg(ir_reg)) return Imm(ir_defs[ir_reg]->imm);
+  return SrcReg(ir_reg, 8);
+}
+
+static struct Operand Src32(int ir_reg) {
+  // Other instructions take immediates sign-extended from 32 bits
+  if (IsImm32IRReg(ir_reg)) return Imm(ir_defs[ir_reg]->imm);
+  return SrcReg(ir_reg, 8);
+}
+
+static struct IRInst *GetDefOfIROp(int ir_reg, enum IROp op) {
+  // Returns the def of ir_reg if it can be folded into its uses. Registers
+  // for phi nodes may be copied to between the def and a use, so the def
+  // should not read them.
+  struct IRInst *def = ir_defs[ir_reg];
+  if (!def || def->op != op) return NULL;
+  for (int i = 0; i < def->num_of_srcs; i++) {
+    if (!ir_defs[def->srcs[i]]) return NULL;
+  }
+  return def;
+}
+
+static bool MatchScaledIndex(int ir_reg, int *index, int *scale) {
+  // Matches ir_reg = index * scale, with a scale usable in addresses
+  struct IRInst *mul = GetDefOfIROp(ir_reg, kIRMul);
+  if (!mul || !IsConstIRReg(mul->srcs[1])) return false;
+  long s = ir_defs[mul->srcs[1]]->imm;
+  if (s != 1 && s != 2 && s != 4 && s != 8) return false;
+  *index = mul->srcs[0];
+  *scale = s;
+  return true;
+}
+
+static struct Operand MemOfIRReg(int size, int ir_reg) {
+  // Returns the memory operand at the address in ir_reg, as
+  // [base + index * scale + disp] or [rbp + index * scale - ofs].
+  int base = ir_reg;
+  int index = 0;
+  int scale = 0;
+  long disp = 0;
+  for (;;) {
+    struct IRInst *add = GetDefOfIROp(base, kIRAdd);
+    if (!add) break;
+    int l = add->srcs[0];
+    int r = add->srcs[1];
+    if (IsConstIRReg(l)) {
+      l = add->srcs[1];
+      r = add->srcs[0];
+    }
+    if (IsConstIRReg(r)) {
+      if (!IsInt32(disp + ir_defs[r]->imm)) break;
+      disp += ir_defs[r]->imm;
+      base = l;
+      continue;
+    }
+    if (scale) break;
+    if (MatchScaledIndex(r, &index, &scale)) {
+      base = l;
+    } else if (MatchScaledIndex(l, &index, &scale)) {
+      base = r;
+    } else {
+      index = r;
+      scale = 1;
+      base = l;
+    }
+  }
+  struct Operand op;
+  struct IRInst *local = GetDefOfIROp(base, kIRLocalAddr);
+  struct IRInst *global = GetDefOfIROp(base, kIRGlobalAddr);
+  if (global && !global->is_external && !scale) {
+    // rip-relative addresses can't have an index
+    return RipSymbol(size, global->symbol, disp);
+  }
+  if (local && IsInt32(local->imm - disp)) {
+    op = LocalVar(size, local->imm - disp);
+  } else {
+    op = Mem(size, SrcReg(base, 8).reg, disp);
+  }
+  if (scale) {
+    op.index = SrcReg(index, 8).reg;
+    op.scale = scale;
+  }
+  return op;
 }
 
-static void EmitMoveFromMemory(struct Node *op, int dst, int src, int size) {
+static const char *GetMnemonicOfIROp(enum IROp op) {
+  if (op == kIRNeg) return "neg";
+  if (op == kIRNot) return "not";
+  if (op == kIRAdd) return "add";
+  if (op == kIRSub) return "sub";
+  if (op == kIRMul) return "imul";
+  if (op == kIRShl) return "sal";
+  if (op == kIRSar) return "sar";
+  if (op == kIRAnd) return "and";
+  if (op == kIROr) return "or";
+  if (op == kIRXor) return "xor";
+  if (op == kIREq) return "sete";
+  if (op == kIRNe) return "setne";
+  if (op == kIRLt) return "setl";
+  if (op == kIRLe) return "setle";
+  if (op == kIRGt) return "setg";
+  if (op == kIRGe) return "setge";
+  assert(false);
+}
+
+static enum IROp GetSwappedCompareIROp(enum IROp op) {
+  // a op b == b (returned op) a
+  if (op == kIRLt) return kIRGt;
+  if (op == kIRLe) return kIRGe;
+  if (op == kIRGt) return kIRLt;
+  if (op == kIRGe) return kIRLe;
+  return op;
+}
+
+static bool IsCommutativeIROp(enum IROp op) {
+  return op == kIRAdd || op == kIRMul || op == kIRAnd || op == kIROr ||
+         op == kIRXor || op == kIREq || op == kIRNe;
+}
+
+static void LowerLoad(int dst, int addr, int size) {
   if (size == 8) {
-    printf("mov %s, [%s]\n", reg_names_64[dst], reg_names_64[src]);
+    AddInst2("mov", DstReg(dst, 8), MemOfIRReg(0, addr));
+  } else if (size == 4) {
+    AddInst2("movsxd", DstReg(dst, 8), MemOfIRReg(4, addr));
+  } else {
+    assert(size == 1);
+    AddInst2("movsx", DstReg(dst, 8), MemOfIRReg(1, addr));
+  }
+}
+
+static void LowerStore(int addr, int value, int size) {
+  if (!IsImm32IRReg(value)) {
+    AddInst2("mov", MemOfIRReg(0, addr), SrcReg(value, size));
     return;
   }
-  if (size == 4) {
-    printf("movsxd %s, dword ptr [%s]\n", reg_names_64[dst], reg_names_64[src]);
+  long imm = ir_defs[value]->imm;
+  if (size == 4) imm = (int)imm;
+  if (size == 1) imm = (signed char)imm;
+  AddInst2("mov", MemOfIRReg(size, addr), Imm(imm));
+}
+
+static struct Operand NewTempReg(void) {
+  // Registers used only inside the insts lowered from an IR inst
+  return Reg64(kNumOfPhysicalRegs + mf->num_of_vregs++);
+}
+
+static int GetLog2(long v) {
+  // Returns k if v == 2^k, otherwise -1
+  if (v <= 0 || (v & (v - 1))) return -1;
+  int k = 0;
+  while (v >>= 1) k++;
+  return k;
+}
+
+static void LowerMulByConst(int dst, int l, long c) {
+  // c * 2^k with c = 1, 3, 5 or 9 is computed with lea and sal
+  int k = 0;
+  long m = c;
+  while (m > 0 && !(m & 1)) {
+    m >>= 1;
+    k++;
+  }
+  if (m != 1 && m != 3 && m != 5 && m != 9) {
+    AddInst3("imul", DstReg(dst, 8), SrcReg(l, 8), Imm(c));
     return;
   }
-  if (size == 1) {
-    printf("movsxb %s, byte ptr [%s]\n", reg_names_64[dst], reg_names_64[src]);
+  if (m == 1) {
+    AddInst2("mov", DstReg(dst, 8), SrcReg(l, 8));
+  } else {
+    struct Operand addr = Mem(0, SrcReg(l, 8).reg, 0);
+    addr.index = addr.reg;
+    addr.scale = m - 1;
+    AddInst2("lea", DstReg(dst, 8), addr);
+  }
+  if (k) AddInst2("sal", DstReg(dst, 8), Imm(k));
+}
+
+static void GetMagicForSignedDiv(long d, long *magic, int *shift) {
+  // Computes magic and shift such that
+  //   n / d == (mulhi(n, magic) +- n) >> shift, rounded toward zero
+  // for 2 <= |d|, as in Hacker's Delight 10-1.
+  const unsigned long two63 = 1UL << 63;
+  unsigned long ad = d < 0 ? -(unsigned long)d : (unsigned long)d;
+  unsigned long t = two63 + ((unsigned long)d >> 63);
+  unsigned long anc = t - 1 - t % ad;
+  unsigned long q1 = two63 / anc;
+  unsigned long r1 = two63 - q1 * anc;
+  unsigned long q2 = two63 / ad;
+  unsigned long r2 = two63 - q2 * ad;
+  unsigned long delta;
+  int p = 63;
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+  *magic = d < 0 ? -(q2 + 1) : q2 + 1;
+  *shift = p - 64;
+}
+
+static void LowerDivByPowerOf2(enum IROp op, int dst, int n, long d) {
+  // Negative n is biased by |d| - 1 to round the quotient toward zero.
+  int k = GetLog2(d < 0 ? -d : d);
+  struct Operand t = NewTempReg();
+  AddInst2("mov", t, SrcReg(n, 8));
+  AddInst2("sar", t, Imm(63));
+  AddInst2("shr", t, Imm(64 - k));
+  AddInst2("add", t, SrcReg(n, 8));
+  if (op == kIRMod) {
+    AddInst2("and", t, Imm(-(1L << k)));
+    AddInst2("mov", DstReg(dst, 8), SrcReg(n, 8));
+    AddInst2("sub", DstReg(dst, 8), t);
     return;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  AddInst2("sar", t, Imm(k));
+  AddInst2("mov", DstReg(dst, 8), t);
+  if (d < 0) AddInst1("neg", DstReg(dst, 8));
 }
 
-static void EmitAddToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 8) {
-    printf("add qword ptr [%s], %s\n", reg_names_64[dst], reg_names_64[src]);
+static void LowerDivByConst(enum IROp op, int dst, int n, long d) {
+  // The quotient is the high half of n * magic, adjusted and rounded
+  // toward zero. The remainder is n - quotient * d.
+  if (d == 1 || d == -1) {
+    if (op == kIRMod) {
+      AddInst2("mov", DstReg(dst, 8), Imm(0));
+      return;
+    }
+    AddInst2("mov", DstReg(dst, 8), SrcReg(n, 8));
+    if (d < 0) AddInst1("neg", DstReg(dst, 8));
     return;
   }
-  if (size == 4) {
-    printf("add dword ptr [%s], %s\n", reg_names_64[dst], reg_names_32[src]);
+  if (GetLog2(d < 0 ? -d : d) >= 0) {
+    LowerDivByPowerOf2(op, dst, n, d);
     return;
   }
-  if (size == 1) {
-    printf("add byte ptr [%s], %s\n", reg_names_64[dst], reg_names_8[src]);
+  long magic;
+  int shift;
+  GetMagicForSignedDiv(d, &magic, &shift);
+  // rdx:rax <- rax * r/m
+  AddInst2("mov", Reg64(kRegRAX), Imm(magic));
+  AddInst1("imul", SrcReg(n, 8));
+  struct Operand q = NewTempReg();
+  AddInst2("mov", q, Reg64(kRegRDX));
+  if (d > 0 && magic < 0) AddInst2("add", q, SrcReg(n, 8));
+  if (d < 0 && magic > 0) AddInst2("sub", q, SrcReg(n, 8));
+  if (shift) AddInst2("sar", q, Imm(shift));
+  struct Operand t = NewTempReg();
+  AddInst2("mov", t, q);
+  AddInst2("shr", t, Imm(63));
+  AddInst2("add", q, t);
+  if (op == kIRDiv) {
+    AddInst2("mov", DstReg(dst, 8), q);
     return;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  AddInst3("imul", q, q, Imm(d));
+  AddInst2("mov", DstReg(dst, 8), SrcReg(n, 8));
+  AddInst2("sub", DstReg(dst, 8), q);
 }
 
-static void EmitSubFromMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 8) {
-    printf("sub qword ptr [%s], %s\n", reg_names_64[dst], reg_names_64[src]);
+static void LowerDiv(enum IROp op, int dst, int n, int d) {
+  if (IsImm32IRReg(d) && ir_defs[d]->imm) {
+    LowerDivByConst(op, dst, n, ir_defs[d]->imm);
     return;
   }
-  if (size == 4) {
-    printf("sub dword ptr [%s], %s\n", reg_names_64[dst], reg_names_32[src]);
-    return;
+  // rax <- rdx:rax / r/m, rdx <- rdx:rax % r/m
+  AddInst2("mov", Reg64(kRegRAX), Src64(n));
+  AddInst("cqo");
+  AddInst1("idiv", SrcReg(d, 8));
+  AddInst2("mov", DstReg(dst, 8), Reg64(op == kIRDiv ? kRegRAX : kRegRDX));
+}
+
+static void LowerBinaryOp(enum IROp op, int dst, int l, int r) {
+  if (IsConstIRReg(l) && !IsConstIRReg(r) && IsCommutativeIROp(op)) {
+    int t = l;
+    l = r;
+    r = t;
   }
-  if (size == 1) {
-    printf("sub byte ptr [%s], %s\n", reg_names_64[dst], reg_names_8[src]);
+  if (op == kIRMul && IsImm32IRReg(r)) {
+    LowerMulByConst(dst, l, ir_defs[r]->imm);
     return;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  assert(dst != r);
+  AddInst2("mov", DstReg(dst, 8), Src64(l));
+  AddInst2(GetMnemonicOfIROp(op), DstReg(dst, 8), op == kIRMul
+                                                      ? SrcReg(r, 8)
+                                                      : Src32(r));
 }
 
-static void EmitDecMemory(struct Node *op, int dst, int size) {
-  if (size == 8) {
-    printf("dec qword ptr [%s]\n", reg_names_64[dst]);
+static void LowerShift(enum IROp op, int dst, int l, int r) {
+  if (IsConstIRReg(r)) {
+    AddInst2("mov", DstReg(dst, 8), Src64(l));
+    AddInst2(GetMnemonicOfIROp(op), DstReg(dst, 8),
+             Imm(ir_defs[r]->imm & 63));
     return;
   }
-  if (size == 4) {
-    printf("dec dword ptr [%s]\n", reg_names_64[dst]);
-    return;
+  // r/m <<= CL, r/m >>= CL
+  AddInst2("mov", Reg64(kRegRCX), SrcReg(r, 8));
+  AddInst2("mov", DstReg(dst, 8), Src64(l));
+  AddInst2(GetMnemonicOfIROp(op), DstReg(dst, 8), Reg8(kRegRCX));
+}
+
+static const char *GetJccOfIROp(enum IROp op, bool is_negated) {
+  if (op == kIREq) return is_negated ? "jne" : "je";
+  if (op == kIRNe) return is_negated ? "je" : "jne";
+  if (op == kIRLt) return is_negated ? "jge" : "jl";
+  if (op == kIRLe) return is_negated ? "jg" : "jle";
+  if (op == kIRGt) return is_negated ? "jle" : "jg";
+  if (op == kIRGe) return is_negated ? "jl" : "jge";
+  assert(false);
+}
+
+static enum IROp LowerFlagsOfCompare(enum IROp op, int l, int r) {
+  // Sets flags to compare l with r, and returns the compare op which
+  // should be tested on the flags.
+  if (IsConstIRReg(l) && !IsConstIRReg(r)) {
+    op = GetSwappedCompareIROp(op);
+    int t = l;
+    l = r;
+    r = t;
   }
-  if (size == 1) {
-    printf("dec byte ptr [%s]\n", reg_names_64[dst]);
+  if ((op == kIREq || op == kIRNe) && IsConstIRReg(r) && !ir_defs[r]->imm) {
+    AddInst2("test", SrcReg(l, 8), SrcReg(l, 8));
+  } else {
+    AddInst2("cmp", SrcReg(l, 8), Src32(r));
+  }
+  return op;
+}
+
+static enum IROp LowerFlagsOfCondition(int cond) {
+  // Compares are fused into the branches on them, and recomputed there if
+  // their values are also used elsewhere.
+  struct IRInst *def = ir_defs[cond];
+  if (def && kIREq <= def->op && def->op <= kIRGe &&
+      GetDefOfIROp(cond, def->op)) {
+    return LowerFlagsOfCompare(def->op, def->srcs[0], def->srcs[1]);
+  }
+  AddInst2("test", SrcReg(cond, 8), SrcReg(cond, 8));
+  return kIRNe;
+}
+
+static void LowerCompare(enum IROp op, int dst, int l, int r) {
+  op = LowerFlagsOfCompare(op, l, r);
+  AddInst1(GetMnemonicOfIROp(op), DstReg(dst, 1));
+  AddInst2("movzx", DstReg(dst, 8), DstReg(dst, 1));
+}
+
+static void LowerCall(struct IRInst *inst, bool is_tail_call) {
+  // Arguments are moved to the parameter registers right before the call,
+  // so no value has to be pushed around it. Values live across the call
+  // are placed in callee-saved registers or spilled by the allocator.
+  int first_arg = inst->symbol ? 0 : 1;
+  int num_of_args = inst->num_of_srcs - first_arg;
+  // Args after the sixth are stored to the bottom of the frame
+  for (int i = NUM_OF_PARAM_REGISTERS; i < num_of_args; i++) {
+    AddInst2("mov", Mem(8, kRegRSP, 8 * (i - NUM_OF_PARAM_REGISTERS)),
+             Src32(inst->srcs[first_arg + i]));
+  }
+  if (num_of_args > NUM_OF_PARAM_REGISTERS) {
+    int n = num_of_args - NUM_OF_PARAM_REGISTERS;
+    if (mf->num_of_stack_args < n) mf->num_of_stack_args = n;
+    num_of_args = NUM_OF_PARAM_REGISTERS;
+  }
+  for (int i = 0; i < num_of_args; i++) {
+    AddInst2("mov", Reg64(param_regs[i]), Src64(inst->srcs[first_arg + i]));
+  }
+  if (is_tail_call) {
+    // The frame is released right before the jump when emitted
+    AddInst1("jmp", FuncSymbol(inst->symbol, inst->is_external))
+        ->num_of_call_args = num_of_args;
     return;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  if (is_vzeroupper_needed) AddInst("vzeroupper");
+  struct Inst *call;
+  if (inst->symbol) {
+    call = AddInst1("call", FuncSymbol(inst->symbol, inst->is_external));
+  } else {
+    call = AddInst1("call", SrcReg(inst->srcs[0], 8));
+  }
+  call->num_of_call_args = num_of_args;
+  mf->has_call = true;
+  if (inst->size == 4) {
+    AddInst2("movsxd", DstReg(inst->dst, 8), Reg32(kRegRAX));
+  } else if (inst->size == 8) {
+    AddInst2("mov", DstReg(inst->dst, 8), Reg64(kRegRAX));
+  }
 }
 
-static void EmitIncMemory(struct Node *op, int dst, int size) {
-  if (size == 8) {
-    printf("inc qword ptr [%s]\n", reg_names_64[dst]);
+// Vector registers are numbered by the vectorizer and kept in imm of the
+// defs. SSE2 ops overwrite their first operand, while AVX2 ones (with
+// 32 bytes of vector_size) take a separate destination.
+
+static bool IsAVX2(void) { return vector_size == 32; }
+
+static struct Operand VecDst(struct IRInst *inst) {
+  return VecReg(inst->imm, vector_size);
+}
+
+static struct Operand VecSrc(int ir_reg) {
+  UseIRReg(ir_reg);
+  return VecReg(ir_defs[ir_reg]->imm, vector_size);
+}
+
+static const char *GetMnemonicOfVecIROp(enum IROp op, int lane_size) {
+  static const char *mnemonics[][3] = {
+      {"paddb", "paddd", "paddq"}, {"vpaddb", "vpaddd", "vpaddq"},
+      {"psubb", "psubd", "psubq"}, {"vpsubb", "vpsubd", "vpsubq"},
+      {"pand", "pand", "pand"},    {"vpand", "vpand", "vpand"},
+      {"por", "por", "por"},       {"vpor", "vpor", "vpor"},
+      {"pxor", "pxor", "pxor"},    {"vpxor", "vpxor", "vpxor"}};
+  assert(lane_size == 1 || lane_size == 4 || lane_size == 8);
+  int row = (op - kIRVecAdd) * 2 + (IsAVX2() ? 1 : 0);
+  return mnemonics[row][lane_size == 1 ? 0 : lane_size == 4 ? 1 : 2];
+}
+
+static void LowerVecSplat(struct IRInst *inst) {
+  struct Operand dst = VecDst(inst);
+  int src = inst->srcs[0];
+  if (IsConstIRReg(src) && ir_defs[src]->imm == 0) {
+    if (IsAVX2()) {
+      AddInst3("vpxor", dst, dst, dst);
+    } else {
+      AddInst2("pxor", dst, dst);
+    }
     return;
   }
-  if (size == 4) {
-    printf("inc dword ptr [%s]\n", reg_names_64[dst]);
+  // The value is moved to the lowest lane and copied to the others
+  struct Operand low = VecReg(dst.reg, 16);
+  struct Operand value = SrcReg(src, inst->size == 8 ? 8 : 4);
+  if (IsAVX2()) {
+    AddInst2(inst->size == 8 ? "vmovq" : "vmovd", low, value);
+    AddInst2(inst->size == 1   ? "vpbroadcastb"
+             : inst->size == 4 ? "vpbroadcastd"
+                               : "vpbroadcastq",
+             dst, low);
     return;
   }
-  if (size == 1) {
-    printf("inc byte ptr [%s]\n", reg_names_64[dst]);
+  AddInst2(inst->size == 8 ? "movq" : "movd", low, value);
+  if (inst->size == 8) {
+    AddInst2("punpcklqdq", dst, dst);
     return;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  if (inst->size == 1) {
+    AddInst2("punpcklbw", dst, dst);
+    AddInst2("punpcklwd", dst, dst);
+  }
+  AddInst3("pshufd", dst, dst, Imm(0));
 }
 
-static void EmitMulToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
-    // rdx:rax <- rax * r/m
-    printf("xor rdx, rdx\n");
-    printf("mov rax, %s\n", reg_names_64[dst]);
-    printf("mov eax, [rax]\n");
-    printf("imul %s\n", reg_names_64[src]);
-    printf("mov [%s], eax\n", reg_names_64[dst]);
-    return;
+static void LowerVecIRInst(struct IRInst *inst) {
+  const char *vmovdqu = IsAVX2() ? "vmovdqu" : "movdqu";
+  if (inst->op == kIRVecSplat) {
+    LowerVecSplat(inst);
+  } else if (inst->op == kIRVecLoad) {
+    AddInst2(vmovdqu, VecDst(inst), MemOfIRReg(0, inst->srcs[0]));
+  } else if (inst->op == kIRVecStore) {
+    AddInst2(vmovdqu, MemOfIRReg(0, inst->srcs[0]), VecSrc(inst->srcs[1]));
+  } else {
+    const char *mnemonic = GetMnemonicOfVecIROp(inst->op, inst->size);
+    struct Operand dst = VecDst(inst);
+    struct Operand l = VecSrc(inst->srcs[0]);
+    struct Operand r = VecSrc(inst->srcs[1]);
+    if (IsAVX2()) {
+      AddInst3(mnemonic, dst, l, r);
+      return;
+    }
+    // The vectorizer gives each value its own register
+    assert(dst.reg != r.reg);
+    if (dst.reg != l.reg) AddInst2("movdqa", dst, l);
+    AddInst2(mnemonic, dst, r);
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
 }
 
-static void EmitDivToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
-    // rax <- rdx:rax / r/m
-    printf("xor rdx, rdx\n");
-    printf("mov eax, [%s]\n", reg_names_64[dst]);
-    printf("idiv %s\n", reg_names_64[src]);
-    printf("mov [%s], eax\n", reg_names_64[dst]);
-    return;
+// kIRMemset and kIRMemcpy of small constant sizes are unrolled into moves
+// of 16 bytes through XMM15, the last one of which may overlap the previous
+// one. Others use rep stosb / rep movsb, which are fast for large sizes.
+
+static struct Operand MemOfIRRegAt(int size, int ir_reg, long ofs) {
+  struct Operand op = MemOfIRReg(size, ir_reg);
+  // Local vars are addressed by their offsets below the frame
+  op.imm += op.type == kOperandLocalVar ? -ofs : ofs;
+  return op;
+}
+
+static void AddVecInst2(const char *sse, const char *avx, struct Operand dst,
+                        struct Operand src) {
+  // AVX2 code keeps VEX encoded ops to avoid SSE/AVX transitions
+  if (IsAVX2()) {
+    AddInst3(avx, dst, dst, src);
+  } else {
+    AddInst2(sse, dst, src);
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
 }
 
-static void EmitModToMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
-    // rdx <- rdx:rax % r/m
-    printf("xor rdx, rdx\n");
-    printf("mov eax, [%s]\n", reg_names_64[dst]);
-    printf("idiv %s\n", reg_names_64[src]);
-    printf("mov [%s], edx\n", reg_names_64[dst]);
+static struct Operand PatternOfSize(struct Operand pattern, int size) {
+  // Returns the low size bytes of the pattern of memset
+  if (pattern.type == kOperandReg) return Reg(pattern.reg, size);
+  if (size == 4) return Imm((int)pattern.imm);
+  if (size == 1) return Imm((signed char)pattern.imm);
+  return pattern;
+}
+
+static void LowerUnrolledMemset(int addr, int value, long n) {
+  // The byte is copied to every byte of the pattern
+  struct Operand pattern;
+  if (IsConstIRReg(value)) {
+    unsigned long byte = ir_defs[value]->imm & 0xff;
+    pattern = Imm((long)(byte * 0x0101010101010101UL));
+    if (!IsInt32(pattern.imm) || (n >= 16 && pattern.imm)) {
+      struct Operand reg = NewTempReg();
+      AddInst2("mov", reg, pattern);
+      pattern = reg;
+    }
+  } else {
+    pattern = NewTempReg();
+    AddInst2("movzx", pattern, SrcReg(value, 1));
+    AddInst2("mov", Reg64(kRegRAX), Imm(0x0101010101010101L));
+    AddInst2("imul", pattern, Reg64(kRegRAX));
+  }
+  if (n >= 16) {
+    struct Operand xmm = VecReg(kNumOfPhysicalRegs - 1, 16);
+    if (pattern.type == kOperandImm) {
+      AddVecInst2("pxor", "vpxor", xmm, xmm);
+    } else {
+      AddInst2(IsAVX2() ? "vmovq" : "movq", xmm, pattern);
+      AddVecInst2("punpcklqdq", "vpunpcklqdq", xmm, xmm);
+    }
+    const char *movdqu = IsAVX2() ? "vmovdqu" : "movdqu";
+    for (long ofs = 0; ofs + 16 <= n; ofs += 16) {
+      AddInst2(movdqu, MemOfIRRegAt(0, addr, ofs), xmm);
+    }
+    if (n % 16) AddInst2(movdqu, MemOfIRRegAt(0, addr, n - 16), xmm);
     return;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  int size = n >= 8 ? 8 : n >= 4 ? 4 : 1;
+  for (long ofs = 0; ofs < n; ofs += size) {
+    if (ofs + size > n) ofs = n - size;
+    AddInst2("mov", MemOfIRRegAt(size, addr, ofs),
+             PatternOfSize(pattern, size));
+  }
 }
 
-static void EmitLShiftMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
-    printf("mov ecx, %s\n", reg_names_32[src]);
-    printf("shl dword ptr [%s], cl\n", reg_names_64[dst]);
+static void LowerUnrolledMemcpy(int dst, int src, long n) {
+  if (n >= 16) {
+    struct Operand xmm = VecReg(kNumOfPhysicalRegs - 1, 16);
+    const char *movdqu = IsAVX2() ? "vmovdqu" : "movdqu";
+    for (long ofs = 0; ofs < n; ofs += 16) {
+      if (ofs + 16 > n) ofs = n - 16;
+      AddInst2(movdqu, xmm, MemOfIRRegAt(0, src, ofs));
+      AddInst2(movdqu, MemOfIRRegAt(0, dst, ofs), xmm);
+    }
     return;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  struct Operand tmp = NewTempReg();
+  int size = n >= 8 ? 8 : n >= 4 ? 4 : 1;
+  for (long ofs = 0; ofs < n; ofs += size) {
+    if (ofs + size > n) ofs = n - size;
+    if (size == 1) {
+      AddInst2("movzx", tmp, MemOfIRRegAt(1, src, ofs));
+    } else {
+      AddInst2("mov", Reg(tmp.reg, size), MemOfIRRegAt(0, src, ofs));
+    }
+    AddInst2("mov", MemOfIRRegAt(0, dst, ofs), Reg(tmp.reg, size));
+  }
 }
 
-static void EmitRShiftMemory(struct Node *op, int dst, int src, int size) {
-  if (size == 4) {
-    printf("mov ecx, %s\n", reg_names_32[src]);
-    printf("shr dword ptr [%s], cl\n", reg_names_64[dst]);
+static void LowerMemOp(struct IRInst *inst) {
+  int dst = inst->srcs[0];
+  int src = inst->srcs[1];
+  int n = inst->srcs[2];
+  if (IsConstIRReg(n) && ir_defs[n]->imm <= MAX_UNROLLED_MEM_OP_SIZE) {
+    if (ir_defs[n]->imm <= 0) return;
+    if (inst->op == kIRMemset) {
+      LowerUnrolledMemset(dst, src, ir_defs[n]->imm);
+    } else {
+      LowerUnrolledMemcpy(dst, src, ir_defs[n]->imm);
+    }
     return;
   }
-  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+  AddInst2("mov", Reg64(kRegRDI), SrcReg(dst, 8));
+  if (inst->op == kIRMemset) {
+    AddInst2("mov", Reg64(kRegRAX), Src64(src));
+  } else {
+    AddInst2("mov", Reg64(kRegRSI), SrcReg(src, 8));
+  }
+  AddInst2("mov", Reg64(kRegRCX), Src64(n));
+  AddInst(inst->op == kIRMemset ? "rep stosb" : "rep movsb");
 }
 
-const char *GetParamRegName(struct Node *type, int idx) {
-  assert(0 <= idx && idx < NUM_OF_PARAM_REGISTERS);
-  int size = GetSizeOfType(type);
-  if (size == 8) return param_reg_names_64[idx];
-  if (size == 4) return param_reg_names_32[idx];
-  if (size == 1) return param_reg_names_8[idx];
-  ErrorWithToken(GetIdentifierTokenFromTypeAttr(type),
-                 "Assigning %d bytes is not implemented.", size);
+static void LowerBranch(struct IRInst *inst, struct IRBlock *next) {
+  struct IRBlock *if_true = inst->targets[0];
+  struct IRBlock *if_false = inst->targets[1];
+  enum IROp op = LowerFlagsOfCondition(inst->srcs[0]);
+  if (if_true == next) {
+    AddInst1(GetJccOfIROp(op, true), Label(block_labels[if_false->id]));
+    return;
+  }
+  AddInst1(GetJccOfIROp(op, false), Label(block_labels[if_true->id]));
+  if (if_false != next) AddInst1("jmp", Label(block_labels[if_false->id]));
 }
 
-static void GenerateForNode(struct Node *node) {
-  if (node->type == kASTList && !node->op) {
-    for (int i = 0; i < GetSizeOfList(node); i++) {
-      GenerateForNode(GetNodeAt(node, i));
+static void LowerIRInst(struct IRInst *inst, struct IRBlock *next) {
+  // next is the block placed after the block of inst, or NULL
+  enum IROp op = inst->op;
+  int dst = inst->dst;
+  int src0 = inst->num_of_srcs > 0 ? inst->srcs[0] : 0;
+  int src1 = inst->num_of_srcs > 1 ? inst->srcs[1] : 0;
+  if (op == kIRParam && inst->imm >= NUM_OF_PARAM_REGISTERS) {
+    // Placed by the caller above the return address
+    AddInst2("mov", DstReg(dst, 8),
+             Mem(8, kRegRBP, 16 + 8 * (inst->imm - NUM_OF_PARAM_REGISTERS)));
+    mf->has_stack_param = true;
+  } else if (op == kIRParam) {
+    AddInst2("mov", DstReg(dst, 8), Reg64(param_regs[inst->imm]));
+  } else if (op == kIRConst) {
+    AddInst2("mov", DstReg(dst, 8), Imm(inst->imm));
+  } else if (op == kIRCopy) {
+    AddInst2("mov", DstReg(dst, 8), Src64(src0));
+  } else if (op == kIRSext) {
+    if (inst->size == 4) {
+      AddInst2("movsxd", DstReg(dst, 8), SrcReg(src0, 4));
+    } else {
+      assert(inst->size == 1);
+      AddInst2("movsx", DstReg(dst, 8), SrcReg(src0, 1));
     }
-    return;
-  }
-  if (node->type == kASTExprFuncCall) {
-    printf("sub rsp, %d # alloc stack frame\n", node->stack_size_needed);
-    int i;
-    for (i = 1; i <= NUM_OF_SCRATCH_REGS; i++) {
-      printf("push %s # save scratch regs\n", reg_names_64[i]);
-    }
-    GenerateForNodeRValue(node->func_expr);
-    printf("push %s\n", reg_names_64[node->func_expr->reg]);
-    assert(GetSizeOfList(node->arg_expr_list) <= NUM_OF_PARAM_REGISTERS);
-    for (i = 0; i < GetSizeOfList(node->arg_expr_list); i++) {
-      struct Node *n = GetNodeAt(node->arg_expr_list, i);
-      GenerateForNodeRValue(n);
-      printf("push %s\n", reg_names_64[n->reg]);
-    }
-    for (i--; i >= 0; i--) {
-      printf("pop %s\n", param_reg_names_64[i]);
-    }
-    printf("pop rax\n");
-    printf("call rax\n");
-    for (i = NUM_OF_SCRATCH_REGS; i >= 1; i--) {
-      printf("pop %s # restore scratch regs\n", reg_names_64[i]);
-    }
-    int ret_type_size = GetSizeOfType(node->expr_type);
-    if (ret_type_size == 4) {
-      printf("movsxd %s, eax\n", reg_names_64[node->reg]);
-    } else if (ret_type_size == 8) {
-      printf("mov %s, rax\n", reg_names_64[node->reg]);
-    } else if (ret_type_size == 0) {
-      // Return type is "void". Do nothing.
+  } else if (op == kIRLocalAddr) {
+    AddInst2("lea", DstReg(dst, 8), LocalVar(0, inst->imm));
+  } else if (op == kIRGlobalAddr) {
+    // Symbols defined in this unit are addressed directly
+    if (inst->is_external) {
+      AddInst2("mov", DstReg(dst, 8), GOTEntry(inst->symbol));
     } else {
-      assert(false);
+      AddInst2("lea", DstReg(dst, 8), RipSymbol(0, inst->symbol, 0));
     }
-    printf("add rsp, %d # restore stack frame\n", node->stack_size_needed);
-    return;
-  } else if (node->type == kASTFuncDef) {
-    const char *func_name = CreateTokenStr(node->func_name_token);
-    printf(".global %s%s\n", symbol_prefix, func_name);
-    printf("%s%s:\n", symbol_prefix, func_name);
-    printf("push rbp\n");
-    printf("mov rbp, rsp\n");
-    printf("push r12\n");
-    printf("push r13\n");
-    printf("push r14\n");
-    printf("push r15\n");
-    struct Node *arg_var_list = node->arg_var_list;
-    assert(arg_var_list);
-    assert(GetSizeOfList(arg_var_list) <= NUM_OF_PARAM_REGISTERS);
-    for (int i = 0; i < GetSizeOfList(arg_var_list); i++) {
-      struct Node *arg_var = GetNodeAt(arg_var_list, i);
-      if (!arg_var) continue;
-      const char *param_reg_name = GetParamRegName(arg_var->expr_type, i);
-      printf("mov [rbp - %d], %s // arg[%d]\n", arg_var->byte_offset,
-             param_reg_name, i);
-    }
-    GenerateForNode(node->func_body);
-    printf("pop r15\n");
-    printf("pop r14\n");
-    printf("pop r13\n");
-    printf("pop r12\n");
-    printf("mov rsp, rbp\n");
-    printf("pop rbp\n");
-    printf("ret\n");
-    return;
+  } else if (op == kIRStringAddr) {
+    AddInst2("lea", DstReg(dst, 8),
+             RipLabel(GetStringLiteralLabel(inst->node)));
+  } else if (op == kIRLoad) {
+    LowerLoad(dst, src0, inst->size);
+  } else if (op == kIRStore) {
+    LowerStore(src0, src1, inst->size);
+  } else if (op == kIRMemset || op == kIRMemcpy) {
+    LowerMemOp(inst);
+  } else if (op == kIRNeg || op == kIRNot) {
+    AddInst2("mov", DstReg(dst, 8), Src64(src0));
+    AddInst1(GetMnemonicOfIROp(op), DstReg(dst, 8));
+  } else if (op == kIRAdd || op == kIRSub || op == kIRMul || op == kIRAnd ||
+             op == kIROr || op == kIRXor) {
+    LowerBinaryOp(op, dst, src0, src1);
+  } else if (op == kIRDiv || op == kIRMod) {
+    LowerDiv(op, dst, src0, src1);
+  } else if (op == kIRShl || op == kIRSar) {
+    LowerShift(op, dst, src0, src1);
+  } else if (kIREq <= op && op <= kIRGe) {
+    LowerCompare(op, dst, src0, src1);
+  } else if (op == kIRCall) {
+    LowerCall(inst, false);
+  } else if (op == kIRJump) {
+    if (inst->targets[0] != next) {
+      AddInst1("jmp", Label(block_labels[inst->targets[0]->id]));
+    }
+  } else if (op == kIRBranch) {
+    LowerBranch(inst, next);
+  } else if (op == kIRReturn) {
+    if (inst->num_of_srcs) AddInst2("mov", Reg64(kRegRAX), Src64(src0));
+    // The epilogue follows the last block directly
+    if (next) AddInst1("jmp", Label(func_exit_label));
+  } else if (op >= kIRVecSplat) {
+    LowerVecIRInst(inst);
+  } else {
+    assert(false);
   }
-  assert(node && node->op);
-  if (node->type == kASTExpr) {
-    if (IsTokenWithType(node->op, kTokenIntegerConstant)) {
-      printf("mov %s, %ld\n", reg_names_64[node->reg],
-             strtol(node->op->begin, NULL, 0));
-      return;
-    } else if (IsTokenWithType(node->op, kTokenCharLiteral)) {
-      if (node->op->length == (1 + 1 + 1)) {
-        printf("mov %s, %d\n", reg_names_64[node->reg], node->op->begin[1]);
-        return;
-      }
-      if (node->op->length == (1 + 2 + 1) && node->op->begin[1] == '\\') {
-        if (node->op->begin[2] == 'n') {
-          printf("mov %s, %d\n", reg_names_64[node->reg], '\n');
-          return;
-        }
-        if (node->op->begin[2] == '\\') {
-          printf("mov %s, %d\n", reg_names_64[node->reg], '\\');
-          return;
-        }
-      }
-      ErrorWithToken(node->op, "Not implemented char literal");
-    } else if (IsEqualTokenWithCStr(node->op, "(")) {
-      GenerateForNode(node->right);
-      return;
-    } else if (IsEqualTokenWithCStr(node->op, ".")) {
-      GenerateForNodeRValue(node->left);
-      printf("add %s, %d # struct member ofs\n", reg_names_64[node->reg],
-             node->byte_offset);
-      return;
-    } else if (IsEqualTokenWithCStr(node->op, "->")) {
-      GenerateForNodeRValue(node->left);
-      printf("add %s, %d # struct member ofs\n", reg_names_64[node->reg],
-             node->byte_offset);
-      return;
-    } else if (IsEqualTokenWithCStr(node->op, "[")) {
-      GenerateForNodeRValue(node->left);
-      GenerateForNodeRValue(node->right);
-      int elem_size = GetSizeOfType(node->expr_type);
-      printf("imul %s, %s, %d\n", reg_names_64[node->right->reg],
-             reg_names_64[node->right->reg], elem_size);
-      printf("add %s, %s\n", reg_names_64[node->left->reg],
-             reg_names_64[node->right->reg]);
-      return;
-    } else if (IsTokenWithType(node->op, kTokenIdent)) {
-      if (node->expr_type->type == kTypeFunction) {
-        const char *label_name = CreateTokenStr(node->op);
-        printf(".global %s%s\n", symbol_prefix, label_name);
-        printf("mov %s, [rip + %s%s@GOTPCREL]\n", reg_names_64[node->reg],
-               symbol_prefix, label_name);
-        return;
-      }
-      if (!node->byte_offset) {
-        // global var
-        const char *label_name = CreateTokenStr(node->op);
-        printf(".global %s%s\n", symbol_prefix, label_name);
-        printf("mov %s, [rip + %s%s@GOTPCREL]\n", reg_names_64[node->reg],
-               symbol_prefix, label_name);
-        return;
-      }
-      printf("lea %s, [rbp - %d]\n", reg_names_64[node->reg],
-             node->byte_offset);
-      return;
-    } else if (IsTokenWithType(node->op, kTokenStringLiteral)) {
-      int str_label = GetLabelNumber();
-      printf("lea %s, [rip + L%d]\n", reg_names_64[node->reg], str_label);
-      node->label_number = str_label;
-      PushToList(str_list, node);
-      return;
-    } else if (node->cond) {
-      GenerateForNodeRValue(node->cond);
-      int false_label = GetLabelNumber();
-      int end_label = GetLabelNumber();
-      EmitConvertToBool(node->cond->reg, node->cond->reg);
-      printf("jz L%d\n", false_label);
-      GenerateForNodeRValue(node->left);
-      printf("mov %s, %s\n", reg_names_64[node->reg],
-             reg_names_64[node->left->reg]);
-      printf("jmp L%d\n", end_label);
-      printf("L%d:\n", false_label);
-      GenerateForNodeRValue(node->right);
-      printf("mov %s, %s\n", reg_names_64[node->reg],
-             reg_names_64[node->right->reg]);
-      printf("L%d:\n", end_label);
-      return;
-    } else if (!node->left && node->right) {
-      if (IsEqualTokenWithCStr(node->op, "--")) {
-        // Prefix --
-        int size = GetSizeOfType(node->expr_type);
-        GenerateForNode(node->right);
-        EmitDecMemory(node->op, node->reg, GetSizeOfType(node->expr_type));
-        EmitMoveFromMemory(node->op, node->reg, node->reg, size);
-        return;
-      }
-      if (IsEqualTokenWithCStr(node->op, "++")) {
-        // Prefix ++
-        int size = GetSizeOfType(node->expr_type);
-        GenerateForNode(node->right);
-        EmitIncMemory(node->op, node->reg, GetSizeOfType(node->expr_type));
-        EmitMoveFromMemory(node->op, node->reg, node->reg, size);
-        return;
-      }
-      if (IsTokenWithType(node->op, kTokenKwSizeof)) {
-        printf("mov %s, %d\n", reg_names_64[node->reg],
-               GetSizeOfType(node->right->expr_type));
-        return;
-      }
-      if (IsEqualTokenWithCStr(node->op, "&")) {
-        GenerateForNode(node->right);
-        return;
-      }
-      GenerateForNodeRValue(node->right);
-      if (IsEqualTokenWithCStr(node->op, "+")) {
-        return;
-      }
-      if (IsEqualTokenWithCStr(node->op, "-")) {
-        printf("neg %s\n", reg_names_64[node->reg]);
-        return;
-      }
-      if (IsEqualTokenWithCStr(node->op, "~")) {
-        printf("not %s\n", reg_names_64[node->reg]);
-        return;
-      }
-      if (IsEqualTokenWithCStr(node->op, "!")) {
-        EmitConvertToBool(node->reg, node->reg);
-        printf("setz %s\n", reg_names_8[node->reg]);
-        return;
-      }
-      if (IsEqualTokenWithCStr(node->op, "*")) {
-        return;
-      }
-      ErrorWithToken(node->op,
-                     "GenerateForNode: Not implemented unary prefix op");
-    } else if (node->left && !node->right) {
-      if (IsEqualTokenWithCStr(node->op, "++")) {
-        // Postfix ++
-        int size = GetSizeOfType(node->expr_type);
-        GenerateForNode(node->left);
-        EmitIncMemory(node->op, node->reg, size);
-        EmitMoveFromMemory(node->op, node->reg, node->reg, size);
-        printf("sub %s, 1\n", reg_names_64[node->reg]);
-        return;
-      }
-      if (IsEqualTokenWithCStr(node->op, "--")) {
-        // Postfix --
-        int size = GetSizeOfType(node->expr_type);
-        GenerateForNode(node->left);
-        EmitDecMemory(node->op, node->reg, GetSizeOfType(node->expr_type));
-        EmitMoveFromMemory(node->op, node->reg, node->reg, size);
-        printf("add %s, 1\n", reg_names_64[node->reg]);
-        return;
+}
+
+static bool IsTailCall(struct IRFunc *f, struct IRBlock *b, int k) {
+  // A direct call whose result is returned as is jumps to the callee, which
+  // returns to the caller of f then. The callee cannot refer to the frame
+  // of f, since no local var of f stays in memory.
+  struct IRInst *call = &b->insts[k];
+  if (call->op != kIRCall || !call->symbol || k + 1 >= b->num_of_insts ||
+      call->num_of_srcs > NUM_OF_PARAM_REGISTERS || f->stack_size ||
+      is_debug_requested) {
+    return false;
+  }
+  struct IRInst *ret = &b->insts[k + 1];
+  if (ret->op != kIRReturn) return false;
+  if (!ret->num_of_srcs) return true;
+  struct Node *ret_type = GetReturnTypeOfFunction(f->func_def->func_type);
+  return ret->srcs[0] == call->dst && call->size == GetSizeOfType(ret_type);
+}
+
+static bool IsIRInstLowered(struct IRInst *inst) {
+  if (inst->op == kIRStore || inst->op == kIRMemset ||
+      inst->op == kIRMemcpy || inst->op == kIRVecStore ||
+      inst->op == kIRCall || inst->op == kIRJump || inst->op == kIRBranch ||
+      inst->op == kIRReturn) {
+    return true;
+  }
+  // Copies for phi nodes define registers more than once
+  return !ir_defs[inst->dst] || is_reg_needed[inst->dst];
+}
+
+static void PlanIRFunc(struct IRFunc *f) {
+  // Lowers insts into a scratch function to find registers read by the
+  // lowered insts, starting from the insts which are always lowered.
+  struct MachineFunc *saved_mf = mf;
+  mf = calloc(1, sizeof(struct MachineFunc));
+  is_planning = true;
+  is_reg_needed = calloc(f->num_of_vregs, sizeof(bool));
+  reg_worklist = malloc(f->num_of_vregs * sizeof(int));
+  num_of_reg_work = 0;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      if (!IsIRInstLowered(&b->insts[k])) continue;
+      mf->num_of_insts = 0;
+      LowerIRInst(&b->insts[k], NULL);
+    }
+  }
+  while (num_of_reg_work) {
+    struct IRInst *def = ir_defs[reg_worklist[--num_of_reg_work]];
+    if (!def) continue;
+    mf->num_of_insts = 0;
+    LowerIRInst(def, NULL);
+  }
+  is_planning = false;
+  mf = saved_mf;
+}
+
+static void LowerIRFunc(struct IRFunc *f) {
+  ir_defs = calloc(f->num_of_vregs, sizeof(struct IRInst *));
+  bool *is_defined = calloc(f->num_of_vregs, sizeof(bool));
+  is_vzeroupper_needed = false;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      if (b->insts[k].op >= kIRVecSplat && IsAVX2()) {
+        is_vzeroupper_needed = true;
       }
-      ErrorWithToken(node->op,
-                     "GenerateForNode: Not implemented unary postfix op");
-    } else if (node->left && node->right) {
-      if (IsEqualTokenWithCStr(node->op, "&&")) {
-        GenerateForNodeRValue(node->left);
-        int skip_label = GetLabelNumber();
-        EmitConvertToBool(node->reg, node->left->reg);
-        printf("jz L%d\n", skip_label);
-        GenerateForNodeRValue(node->right);
-        EmitConvertToBool(node->reg, node->right->reg);
-        printf("L%d:\n", skip_label);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "||")) {
-        GenerateForNodeRValue(node->left);
-        int skip_label = GetLabelNumber();
-        EmitConvertToBool(node->reg, node->left->reg);
-        printf("jnz L%d\n", skip_label);
-        GenerateForNodeRValue(node->right);
-        EmitConvertToBool(node->reg, node->right->reg);
-        printf("L%d:\n", skip_label);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, ",")) {
-        GenerateForNode(node->left);
-        GenerateForNodeRValue(node->right);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "=") ||
-                 IsEqualTokenWithCStr(node->op, "+=") ||
-                 IsEqualTokenWithCStr(node->op, "-=") ||
-                 IsEqualTokenWithCStr(node->op, "*=") ||
-                 IsEqualTokenWithCStr(node->op, "/=") ||
-                 IsEqualTokenWithCStr(node->op, "%=") ||
-                 IsEqualTokenWithCStr(node->op, "<<=") ||
-                 IsEqualTokenWithCStr(node->op, ">>=")) {
-        GenerateForNode(node->left);
-        GenerateForNodeRValue(node->right);
-        int size = GetSizeOfType(node->left->expr_type);
-        if (IsEqualTokenWithCStr(node->op, "=")) {
-          EmitMoveToMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, "+=")) {
-          EmitAddToMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, "-=")) {
-          EmitSubFromMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, "*=")) {
-          EmitMulToMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, "/=")) {
-          EmitDivToMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, "%=")) {
-          EmitModToMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, "<<=")) {
-          EmitLShiftMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        if (IsEqualTokenWithCStr(node->op, ">>=")) {
-          EmitRShiftMemory(node->op, node->left->reg, node->right->reg, size);
-          return;
-        }
-        assert(false);
+      int dst = b->insts[k].dst;
+      if (!dst) continue;
+      ir_defs[dst] = is_defined[dst] ? NULL : &b->insts[k];
+      is_defined[dst] = true;
+    }
+  }
+  func_exit_label = GetLabelNumber();
+  block_labels = malloc(f->num_of_blocks * sizeof(int));
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    block_labels[i] = GetLabelNumber();
+  }
+  PlanIRFunc(f);
+  mf = calloc(1, sizeof(struct MachineFunc));
+  mf->num_of_vregs = f->num_of_vregs;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    struct IRBlock *next = i + 1 < f->num_of_blocks ? f->blocks[i + 1] : NULL;
+    if (b->num_of_preds) {
+      AddLabel(block_labels[i])->is_aligned = b->is_loop_header;
+    }
+    for (int k = 0; k < b->num_of_insts; k++) {
+      if (IsTailCall(f, b, k)) {
+        LowerCall(&b->insts[k], true);
+        break;
       }
-      GenerateForNodeRValue(node->left);
-      GenerateForNodeRValue(node->right);
-      if (IsEqualTokenWithCStr(node->op, "+")) {
-        printf("add %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "-")) {
-        printf("sub %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "*")) {
-        // rdx:rax <- rax * r/m
-        printf("xor rdx, rdx\n");
-        printf("mov rax, %s\n", reg_names_64[node->reg]);
-        printf("imul %s\n", reg_names_64[node->right->reg]);
-        printf("mov %s, rax\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "/")) {
-        // rax <- rdx:rax / r/m
-        printf("xor rdx, rdx\n");
-        printf("mov rax, %s\n", reg_names_64[node->reg]);
-        printf("idiv %s\n", reg_names_64[node->right->reg]);
-        printf("mov %s, rax\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "%")) {
-        // rdx <- rdx:rax % r/m
-        printf("xor rdx, rdx\n");
-        printf("mov rax, %s\n", reg_names_64[node->reg]);
-        printf("idiv %s\n", reg_names_64[node->right->reg]);
-        printf("mov %s, rdx\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "<<")) {
-        // r/m <<= CL
-        printf("mov rcx, %s\n", reg_names_64[node->right->reg]);
-        printf("sal %s, cl\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, ">>")) {
-        // r/m >>= CL
-        printf("mov rcx, %s\n", reg_names_64[node->right->reg]);
-        printf("sar %s, cl\n", reg_names_64[node->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "<")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "l");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, ">")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "g");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "<=")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "le");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, ">=")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "ge");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "==")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "e");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "!=")) {
-        EmitCompareIntegers(node->reg, node->left->reg, node->right->reg, "ne");
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "&")) {
-        printf("and %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "^")) {
-        printf("xor %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
-        return;
-      } else if (IsEqualTokenWithCStr(node->op, "|")) {
-        printf("or %s, %s\n", reg_names_64[node->reg],
-               reg_names_64[node->right->reg]);
-        return;
+      if (IsIRInstLowered(&b->insts[k])) LowerIRInst(&b->insts[k], next);
+    }
+  }
+  AddLabel(func_exit_label);
+}
+
+// Jumps are simplified after registers are allocated, since copies for phi
+// nodes often become empty then and leave blocks which only jump elsewhere.
+static bool IsRedundantInst(struct Inst *inst) {
+  // Copies between the same register
+  struct Operand *ops = inst->operands;
+  return inst->mnemonic && strcmp(inst->mnemonic, "mov") == 0 &&
+         ops[0].type == kOperandReg && ops[1].type == kOperandReg &&
+         ops[0].size == 8 && ops[1].size == 8 && ops[0].reg == ops[1].reg;
+}
+
+static bool IsJumpToLabel(struct Inst *inst) {
+  return inst->mnemonic && inst->mnemonic[0] == 'j' &&
+         inst->operands[0].type == kOperandLabel;
+}
+
+static bool IsJmpInst(struct Inst *inst) {
+  return inst->mnemonic && strcmp(inst->mnemonic, "jmp") == 0;
+}
+
+static bool IsTailJump(struct Inst *inst) {
+  return IsJmpInst(inst) && inst->operands[0].type == kOperandFuncSymbol;
+}
+
+static const char *GetInvertedJcc(const char *jcc) {
+  static const char *pairs[][2] = {{"je", "jne"}, {"jl", "jge"},
+                                   {"jle", "jg"}};
+  for (int i = 0; i < (int)(sizeof(pairs) / sizeof(pairs[0])); i++) {
+    if (strcmp(jcc, pairs[i][0]) == 0) return pairs[i][1];
+    if (strcmp(jcc, pairs[i][1]) == 0) return pairs[i][0];
+  }
+  assert(false);
+}
+
+static int FindNextInst(int i) {
+  // Returns the index of the first inst which is not a label from i
+  while (i < mf->num_of_insts && !mf->insts[i].mnemonic) i++;
+  return i;
+}
+
+static bool IsLabelDefinedIn(int label, int begin, int end) {
+  for (int i = begin; i < end; i++) {
+    if (!mf->insts[i].mnemonic && mf->insts[i].label == label) return true;
+  }
+  return false;
+}
+
+static int FindLabelDef(int label) {
+  for (int i = 0; i < mf->num_of_insts; i++) {
+    if (!mf->insts[i].mnemonic && mf->insts[i].label == label) return i;
+  }
+  assert(false);
+}
+
+static void RemoveMarkedInsts(bool *is_removed) {
+  int n = 0;
+  for (int i = 0; i < mf->num_of_insts; i++) {
+    if (!is_removed[i]) mf->insts[n++] = mf->insts[i];
+  }
+  mf->num_of_insts = n;
+}
+
+static void SimplifyJumps(void) {
+  bool *is_removed = calloc(mf->num_of_insts + 1, sizeof(bool));
+  for (int i = 0; i < mf->num_of_insts; i++) {
+    is_removed[i] = IsRedundantInst(&mf->insts[i]);
+  }
+  RemoveMarkedInsts(is_removed);
+  // Jumps to a jmp go to its target directly
+  for (int i = 0; i < mf->num_of_insts; i++) {
+    struct Inst *inst = &mf->insts[i];
+    if (!IsJumpToLabel(inst)) continue;
+    for (int hops = 0; hops < 8; hops++) {
+      int k = FindNextInst(FindLabelDef(inst->operands[0].imm));
+      if (k == mf->num_of_insts || !IsJmpInst(&mf->insts[k]) ||
+          !IsJumpToLabel(&mf->insts[k]) || k == i) {
+        break;
       }
+      inst->operands[0].imm = mf->insts[k].operands[0].imm;
     }
   }
-  if (node->type == kASTExprStmt) {
-    if (node->left) GenerateForNode(node->left);
-    return;
-  } else if (node->type == kASTList) {
-    for (int i = 0; i < GetSizeOfList(node); i++) {
-      GenerateForNode(GetNodeAt(node, i));
+  // Labels which are not jumped to any more are removed
+  for (int i = 0; i < mf->num_of_insts; i++) {
+    struct Inst *inst = &mf->insts[i];
+    is_removed[i] = !inst->mnemonic;
+  }
+  for (int i = 0; i < mf->num_of_insts; i++) {
+    struct Inst *inst = &mf->insts[i];
+    if (!IsJumpToLabel(inst)) continue;
+    is_removed[FindLabelDef(inst->operands[0].imm)] = false;
+  }
+  // The exit label is kept for the epilogue
+  is_removed[mf->num_of_insts - 1] = false;
+  RemoveMarkedInsts(is_removed);
+  // Insts after a jmp are not reached until the next label
+  for (int i = 0; i < mf->num_of_insts; i++) {
+    is_removed[i] = i > 0 && mf->insts[i].mnemonic &&
+                    (is_removed[i - 1] || IsJmpInst(&mf->insts[i - 1]));
+  }
+  RemoveMarkedInsts(is_removed);
+  for (int i = 0; i < mf->num_of_insts; i++) is_removed[i] = false;
+  for (int i = 0; i < mf->num_of_insts; i++) {
+    struct Inst *inst = &mf->insts[i];
+    if (is_removed[i] || !IsJumpToLabel(inst)) continue;
+    int next = FindNextInst(i + 1);
+    if (IsLabelDefinedIn(inst->operands[0].imm, i + 1, next)) {
+      // Jumps to the next inst
+      is_removed[i] = true;
+      continue;
     }
-    return;
-  } else if (node->type == kASTDecl) {
-    if (IsASTDeclOfTypedef(node)) {
-      return;
+    if (IsJmpInst(inst) || next != i + 1 || !IsJumpToLabel(&mf->insts[next]) ||
+        !IsJmpInst(&mf->insts[next])) {
+      continue;
+    }
+    // jcc L1; jmp L2; L1: -> jncc L2; L1:
+    int after_jmp = FindNextInst(next + 1);
+    if (!IsLabelDefinedIn(inst->operands[0].imm, next + 1, after_jmp)) {
+      continue;
+    }
+    inst->mnemonic = GetInvertedJcc(inst->mnemonic);
+    inst->operands[0].imm = mf->insts[next].operands[0].imm;
+    is_removed[next] = true;
+  }
+  RemoveMarkedInsts(is_removed);
+  // The exit label is removed as well if no path reaches it, e.g. when
+  // every return has become a tail jump
+  int exit_idx = mf->num_of_insts - 1;
+  bool is_exit_reached =
+      exit_idx == 0 || !IsJmpInst(&mf->insts[exit_idx - 1]);
+  for (int i = 0; i < exit_idx; i++) {
+    struct Inst *inst = &mf->insts[i];
+    if (IsJumpToLabel(inst) &&
+        inst->operands[0].imm == mf->insts[exit_idx].label) {
+      is_exit_reached = true;
+    }
+  }
+  if (!is_exit_reached) mf->num_of_insts--;
+}
+
+// Shrink-wrapping: if one side of the first branch of a function reaches
+// the exit without touching the frame, the path from the entry through that
+// side is copied before the prologue and returns with a bare ret. The other
+// side sets up the frame and resumes the original code after the branch, so
+// fast paths like "if (n <= 1) return n;" never push anything.
+// Callee-saved registers are not saved yet on the copied path. They are
+// renamed to caller-saved registers which are free there, and moved back
+// after the prologue.
+#define MAX_SHRINK_WRAP_PATH_LEN 16
+static const int shrink_wrap_temp_regs[] = {
+    kRegR11, kRegR10, kRegR9, kRegR8, kRegRCX, kRegRDX, kRegRSI, kRegRDI};
+#define NUM_OF_SHRINK_WRAP_TEMP_REGS 8
+static struct Inst early_exit_insts[2 * MAX_SHRINK_WRAP_PATH_LEN + 2];
+static int num_of_early_exit_insts;
+static int early_exit_regs[kNumOfPhysicalRegs];  // renamed to, or -1
+static bool is_restored_after_prologue[kNumOfPhysicalRegs];
+static int prologue_label;
+
+static bool IsFrameReg(int reg) { return reg == kRegRSP || reg == kRegRBP; }
+
+static bool CanRunBeforePrologue(struct Inst *inst) {
+  // Insts which refer registers only through their operands and do not
+  // touch the frame
+  static const char *mnemonics[] = {
+      "mov", "movsx", "movsxd", "movzx", "lea",   "add",    "sub",
+      "imul", "and", "or",     "xor",   "neg",   "not",    "sal",
+      "sar", "shr",  "cmp",    "test",  "sete",  "setne",  "setl",
+      "setle", "setg", "setge"};
+  bool is_listed = false;
+  for (int i = 0; i < (int)(sizeof(mnemonics) / sizeof(mnemonics[0])); i++) {
+    if (strcmp(inst->mnemonic, mnemonics[i]) == 0) is_listed = true;
+  }
+  // imul with one operand multiplies rax implicitly
+  if (!is_listed || inst->num_of_operands < 2) return false;
+  for (int i = 0; i < inst->num_of_operands; i++) {
+    struct Operand *op = &inst->operands[i];
+    if (op->type == kOperandReg && !IsFrameReg(op->reg)) continue;
+    if (op->type == kOperandMem && !IsFrameReg(op->reg) &&
+        (!op->scale || !IsFrameReg(op->index))) {
+      continue;
+    }
+    if (op->type == kOperandImm || op->type == kOperandRipLabel ||
+        op->type == kOperandRipSymbol || op->type == kOperandGOTEntry) {
+      continue;
+    }
+    return false;
+  }
+  return true;
+}
+
+static int TracePathBeforePrologue(int i, int *path, int *branch_idx) {
+  // Collects the insts on the path from inst i, following jmps, into path
+  // until a conditional jump or the exit. Returns the number of them, or -1
+  // if the path needs the frame. *branch_idx is set to the index of the
+  // conditional jump, or -1 if the path reaches the exit.
+  int len = 0;
+  *branch_idx = -1;
+  for (int steps = 0; steps < 4 * MAX_SHRINK_WRAP_PATH_LEN; steps++) {
+    if (i >= mf->num_of_insts) return -1;
+    struct Inst *inst = &mf->insts[i];
+    if (!inst->mnemonic) {
+      if (inst->label == func_exit_label) return len;
+      i++;
+      continue;
+    }
+    if (IsJmpInst(inst) && IsJumpToLabel(inst)) {
+      if (inst->operands[0].imm == func_exit_label) return len;
+      i = FindLabelDef(inst->operands[0].imm);
+      continue;
+    }
+    if (IsJumpToLabel(inst)) {
+      *branch_idx = i;
+      return len;
+    }
+    if (len == MAX_SHRINK_WRAP_PATH_LEN || !CanRunBeforePrologue(inst)) {
+      return -1;
+    }
+    path[len++] = i++;
+  }
+  return -1;
+}
+
+static void AddEarlyExitInst(struct Inst *inst, bool is_on_entry_path) {
+  // Copies inst with callee-saved registers renamed
+  struct Inst *copy = &early_exit_insts[num_of_early_exit_insts++];
+  *copy = *inst;
+  for (int i = 0; i < copy->num_of_operands; i++) {
+    struct Operand *op = &copy->operands[i];
+    if (op->type != kOperandReg && op->type != kOperandMem) continue;
+    int regs_to_rename = op->type == kOperandMem && op->scale ? 2 : 1;
+    for (int k = 0; k < regs_to_rename; k++) {
+      int *reg = k ? &op->index : &op->reg;
+      if (early_exit_regs[*reg] < 0) continue;
+      if (is_on_entry_path) is_restored_after_prologue[*reg] = true;
+      *reg = early_exit_regs[*reg];
+    }
+  }
+}
+
+static void MarkRegsOfInst(struct Inst *inst, bool *is_referred) {
+  for (int i = 0; i < inst->num_of_operands; i++) {
+    struct Operand *op = &inst->operands[i];
+    if (op->type != kOperandReg && op->type != kOperandMem) continue;
+    is_referred[op->reg] = true;
+    if (op->type == kOperandMem && op->scale) is_referred[op->index] = true;
+  }
+}
+
+static void ShrinkWrap(void) {
+  num_of_early_exit_insts = 0;
+  for (int i = 0; i < kNumOfPhysicalRegs; i++) {
+    early_exit_regs[i] = -1;
+    is_restored_after_prologue[i] = false;
+  }
+  if (!has_frame) return;
+  int entry_path[MAX_SHRINK_WRAP_PATH_LEN];
+  int exit_path[MAX_SHRINK_WRAP_PATH_LEN];
+  int branch_idx;
+  int exit_branch_idx;
+  int entry_len = TracePathBeforePrologue(0, entry_path, &branch_idx);
+  if (entry_len < 0 || branch_idx < 0) return;
+  struct Inst *branch = &mf->insts[branch_idx];
+  int branch_target_idx = FindLabelDef(branch->operands[0].imm);
+  // The exit is tried on the fall-through side first, as if statements
+  // lay out their then-clauses there
+  bool is_exit_taken = false;
+  int exit_len =
+      TracePathBeforePrologue(branch_idx + 1, exit_path, &exit_branch_idx);
+  if (exit_len < 0 || exit_branch_idx >= 0) {
+    is_exit_taken = true;
+    exit_len = TracePathBeforePrologue(branch_target_idx, exit_path,
+                                       &exit_branch_idx);
+    if (exit_len < 0 || exit_branch_idx >= 0) return;
+  }
+  // Callee-saved registers get temporaries which are not referred on the
+  // paths nor hold parameters
+  bool is_referred[kNumOfPhysicalRegs] = {false};
+  for (int i = 0; i < entry_len; i++) {
+    MarkRegsOfInst(&mf->insts[entry_path[i]], is_referred);
+  }
+  for (int i = 0; i < exit_len; i++) {
+    MarkRegsOfInst(&mf->insts[exit_path[i]], is_referred);
+  }
+  int num_of_params = GetSizeOfList(func_being_generated->arg_var_list);
+  for (int i = 0; i < num_of_params && i < NUM_OF_PARAM_REGISTERS; i++) {
+    is_referred[param_regs[i]] = true;
+  }
+  int num_of_temps_used = 0;
+  for (int reg = 0; reg < kNumOfPhysicalRegs; reg++) {
+    if (!IsCalleeSavedRegUsed(reg) || !is_referred[reg]) continue;
+    int temp = -1;
+    while (num_of_temps_used < NUM_OF_SHRINK_WRAP_TEMP_REGS && temp < 0) {
+      int candidate = shrink_wrap_temp_regs[num_of_temps_used++];
+      if (!is_referred[candidate]) temp = candidate;
+    }
+    if (temp < 0) return;
+    early_exit_regs[reg] = temp;
+  }
+  for (int i = 0; i < entry_len; i++) {
+    AddEarlyExitInst(&mf->insts[entry_path[i]], true);
+  }
+  prologue_label = GetLabelNumber();
+  struct Inst *branch_copy = &early_exit_insts[num_of_early_exit_insts++];
+  *branch_copy = *branch;
+  branch_copy->operands[0].imm = prologue_label;
+  // The other side resumes at the target of the branch, or after it
+  int resume_label = branch->operands[0].imm;
+  int resume_idx = -1;
+  if (is_exit_taken) {
+    branch_copy->mnemonic = GetInvertedJcc(branch->mnemonic);
+    resume_label = GetLabelNumber();
+    resume_idx = branch_idx + 1;
+  }
+  for (int i = 0; i < exit_len; i++) {
+    AddEarlyExitInst(&mf->insts[exit_path[i]], false);
+  }
+  struct Inst *ret = &early_exit_insts[num_of_early_exit_insts++];
+  memset(ret, 0, sizeof(*ret));
+  ret->mnemonic = "ret";
+  // After the prologue, the renamed registers are moved back before the
+  // original code resumes. Insts before the first label are reached only
+  // through the entry path, and SimplifyJumps() cleans up the rest.
+  struct Inst *insts = mf->insts;
+  int num_of_insts = mf->num_of_insts;
+  mf->insts = NULL;
+  mf->num_of_insts = 0;
+  mf->capacity = 0;
+  for (int reg = 0; reg < kNumOfPhysicalRegs; reg++) {
+    if (!is_restored_after_prologue[reg]) continue;
+    AddInst2("mov", Reg64(reg), Reg64(early_exit_regs[reg]));
+  }
+  AddInst1("jmp", Label(resume_label));
+  int first_reached_idx = 0;
+  while (insts[first_reached_idx].mnemonic && first_reached_idx != resume_idx) {
+    first_reached_idx++;
+  }
+  for (int i = first_reached_idx; i < num_of_insts; i++) {
+    if (i == resume_idx) AddLabel(resume_label);
+    *AddInst(NULL) = insts[i];
+  }
+  SimplifyJumps();
+}
+
+static void GenerateForFuncDef(struct Node *node, struct IRFunc *ir) {
+  const char *func_name = CreateTokenStr(node->func_name_token);
+  if (!node->is_static) EmitGlobalSymbol(func_name);
+  EmitDirective(".p2align 4");
+  EmitSymbolDef(func_name);
+  OptimizeIR(ir);
+  if (is_ir_dump_requested) PrintIRFunc(ir);
+  DestructSSA(ir);
+  LowerIRFunc(ir);
+  AllocateRegisters(mf);
+  SimplifyJumps();
+  PlanFrame(node, ir->stack_size);
+  ShrinkWrap();
+  for (int i = 0; i < num_of_early_exit_insts; i++) {
+    EmitInst(&early_exit_insts[i]);
+  }
+  if (num_of_early_exit_insts) EmitLabelDef(prologue_label);
+  EmitPrologue();
+  // The epilogue follows the exit label, which is the last instruction if
+  // SimplifyJumps() has kept it
+  for (int i = 0; i < mf->num_of_insts; i++) {
+    if (IsTailJump(&mf->insts[i])) EmitFrameRelease();
+    EmitInst(&mf->insts[i]);
+  }
+  if (!mf->insts[mf->num_of_insts - 1].mnemonic) EmitEpilogue();
+}
+
+// The IR of all functions is built before any of them is generated, so
+// that calls can be inlined. Static functions are generated only if they
+// are still called or referred by address after that.
+static struct Node *func_defs;
+static struct IRFunc **func_irs;
+static bool *is_func_used;
+static int *func_worklist;
+static int num_of_func_work;
+
+static void MarkFuncUsed(const char *name) {
+  for (int i = 0; i < GetSizeOfList(func_defs); i++) {
+    struct Node *func_def = GetNodeAt(func_defs, i);
+    if (is_func_used[i] ||
+        !IsEqualTokenWithCStr(func_def->func_name_token, name)) {
+      continue;
+    }
+    is_func_used[i] = true;
+    func_worklist[num_of_func_work++] = i;
+  }
+}
+
+static void MarkFuncsReferredInInitializer(struct Node *n) {
+  if (!n) return;
+  if (IsASTList(n)) {
+    for (int i = 0; i < GetSizeOfList(n); i++) {
+      MarkFuncsReferredInInitializer(GetNodeAt(n, i));
     }
-    assert(node->right && node->right->type == kASTDecltor);
-    if (!node->right->decltor_init_expr) return;
-    GenerateForNode(node->right->decltor_init_expr);
     return;
-  } else if (node->type == kASTJumpStmt) {
-    if (IsTokenWithType(node->op, kTokenKwBreak)) {
-      if (!label_to_break) {
-        ErrorWithToken(node->op, "break is not allowed here");
+  }
+  if (n->type != kASTExpr) return;
+  if (IsTokenWithType(n->op, kTokenIdent)) MarkFuncUsed(CreateTokenStr(n->op));
+  MarkFuncsReferredInInitializer(n->cond);
+  MarkFuncsReferredInInitializer(n->left);
+  MarkFuncsReferredInInitializer(n->right);
+}
+
+static void MarkUsedFuncs(void) {
+  int num_of_funcs = GetSizeOfList(func_defs);
+  is_func_used = calloc(num_of_funcs, sizeof(bool));
+  func_worklist = malloc(num_of_funcs * sizeof(int));
+  num_of_func_work = 0;
+  for (int i = 0; i < num_of_funcs; i++) {
+    if (GetNodeAt(func_defs, i)->is_static) continue;
+    is_func_used[i] = true;
+    func_worklist[num_of_func_work++] = i;
+  }
+  for (struct SymbolEntry *e = toplevel_ctx; e; e = e->prev) {
+    if (e->type != kSymbolGlobalVar) continue;
+    MarkFuncsReferredInInitializer(e->value->decltor_init_expr);
+  }
+  while (num_of_func_work) {
+    struct IRFunc *f = func_irs[func_worklist[--num_of_func_work]];
+    for (int i = 0; i < f->num_of_blocks; i++) {
+      struct IRBlock *b = f->blocks[i];
+      for (int k = 0; k < b->num_of_insts; k++) {
+        struct IRInst *inst = &b->insts[k];
+        if ((inst->op == kIRCall || inst->op == kIRGlobalAddr) &&
+            inst->symbol && !inst->is_external) {
+          MarkFuncUsed(inst->symbol);
+        }
       }
-      printf("jmp L%d\n", label_to_break);
-      return;
     }
-    if (IsTokenWithType(node->op, kTokenKwContinue)) {
-      if (!label_to_continue) {
-        ErrorWithToken(node->op, "continue is not allowed here");
-      }
-      printf("jmp L%d\n", label_to_continue);
-      return;
+  }
+}
+
+static void BuildIRForFuncDefs(void) {
+  int num_of_funcs = GetSizeOfList(func_defs);
+  // Whole bodies, from which calls are inlined
+  struct IRFunc **bodies = malloc(num_of_funcs * sizeof(struct IRFunc *));
+  bool *is_tail_recursive = malloc(num_of_funcs * sizeof(bool));
+  for (int i = 0; i < num_of_funcs; i++) {
+    bodies[i] = BuildIR(GetNodeAt(func_defs, i), toplevel_ctx);
+    ConvertToSSA(bodies[i]);
+    is_tail_recursive[i] = EliminateTailRecursion(bodies[i]);
+  }
+  func_irs = malloc(num_of_funcs * sizeof(struct IRFunc *));
+  for (int i = 0; i < num_of_funcs; i++) {
+    func_irs[i] = BuildIR(GetNodeAt(func_defs, i), toplevel_ctx);
+    ConvertToSSA(func_irs[i]);
+    if (is_tail_recursive[i]) EliminateTailRecursion(func_irs[i]);
+    InlineIRCalls(func_irs[i], bodies, num_of_funcs);
+  }
+}
+
+static int GetLog2OfAlign(int align) {
+  int log2 = 0;
+  while ((1 << log2) < align) log2++;
+  assert((1 << log2) == align);
+  return log2;
+}
+
+static long EvalStaticInitializer(struct Node *n, struct Node **base);
+
+static long EvalStaticArithmetic(struct Node *n) {
+  struct Node *base;
+  long v = EvalStaticInitializer(n, &base);
+  if (base) {
+    ErrorWithToken(n->op, "Address is not allowed in this constant expression");
+  }
+  return v;
+}
+
+static long EvalStaticBinOp(struct Node *op, long l, long r) {
+  if (IsEqualTokenWithCStr(op, "+")) return l + r;
+  if (IsEqualTokenWithCStr(op, "-")) return l - r;
+  if (IsEqualTokenWithCStr(op, "*")) return l * r;
+  if (IsEqualTokenWithCStr(op, "/") || IsEqualTokenWithCStr(op, "%")) {
+    if (!r) ErrorWithToken(op, "Division by zero in constant expression");
+    return IsEqualTokenWithCStr(op, "/") ? l / r : l % r;
+  }
+  if (IsEqualTokenWithCStr(op, "<<")) return l << r;
+  if (IsEqualTokenWithCStr(op, ">>")) return l >> r;
+  if (IsEqualTokenWithCStr(op, "<")) return l < r;
+  if (IsEqualTokenWithCStr(op, ">")) return l > r;
+  if (IsEqualTokenWithCStr(op, "<=")) return l <= r;
+  if (IsEqualTokenWithCStr(op, ">=")) return l >= r;
+  if (IsEqualTokenWithCStr(op, "==")) return l == r;
+  if (IsEqualTokenWithCStr(op, "!=")) return l != r;
+  if (IsEqualTokenWithCStr(op, "&")) return l & r;
+  if (IsEqualTokenWithCStr(op, "^")) return l ^ r;
+  if (IsEqualTokenWithCStr(op, "|")) return l | r;
+  if (IsEqualTokenWithCStr(op, "&&")) return l && r;
+  if (IsEqualTokenWithCStr(op, "||")) return l || r;
+  if (IsEqualTokenWithCStr(op, ",")) return r;
+  ErrorWithToken(op, "Not a constant expression");
+}
+
+static int GetSizeOfPointeeForAddress(struct Node *expr_type) {
+  // Returns the scale for "address +/- integer" in constant expressions
+  struct Node *t = GetTypeWithoutAttr(expr_type);
+  if (t->type == kTypeArray) return GetSizeOfType(t->type_array_type_of);
+  if (t->type == kTypePointer) return GetSizeOfType(t->right);
+  return 1;
+}
+
+static long EvalStaticAddressOf(struct Node *n, struct Node **base) {
+  if (IsEqualTokenWithCStr(n->op, "(")) {
+    return EvalStaticAddressOf(n->right, base);
+  }
+  if (IsTokenWithType(n->op, kTokenIdent) && !n->byte_offset) {
+    *base = n;
+    return 0;
+  }
+  if (IsEqualTokenWithCStr(n->op, "[")) {
+    long ofs = EvalStaticInitializer(n->left, base);
+    if (!*base) ErrorWithToken(n->op, "Not a constant address");
+    return ofs + EvalStaticArithmetic(n->right) * GetSizeOfType(n->expr_type);
+  }
+  if (IsEqualTokenWithCStr(n->op, ".")) {
+    return EvalStaticAddressOf(n->left, base) + n->byte_offset;
+  }
+  ErrorWithToken(n->op, "Not a constant address");
+}
+
+static long EvalStaticInitializer(struct Node *n, struct Node **base) {
+  // Evaluates n as an arithmetic constant (*base == NULL) or
+  // an address constant (*base + returned offset) for static storage.
+  *base = NULL;
+  if (n->type == kASTExpr && !n->left && !n->right && !n->cond) {
+    if (IsTokenWithType(n->op, kTokenIntegerConstant)) {
+      return strtol(n->op->begin, NULL, 0);
     }
-    if (IsTokenWithType(node->op, kTokenKwReturn)) {
-      if (node->right) {
-        GenerateForNodeRValue(node->right);
-        printf("mov rax, %s\n", reg_names_64[node->right->reg]);
-      }
-      printf("mov rsp, rbp\n");
-      printf("pop rbp\n");
-      printf("ret\n");
-      return;
+    if (IsTokenWithType(n->op, kTokenCharLiteral)) {
+      return EvalCharLiteral(n->op);
+    }
+    if (IsTokenWithType(n->op, kTokenStringLiteral)) {
+      *base = n;
+      return 0;
     }
-    ErrorWithToken(node->op, "GenerateForNode: Not implemented jump stmt");
-  } else if (node->type == kASTSelectionStmt) {
-    if (IsTokenWithType(node->op, kTokenKwIf)) {
-      GenerateForNodeRValue(node->cond);
-      int false_label = GetLabelNumber();
-      int end_label = GetLabelNumber();
-      EmitConvertToBool(node->cond->reg, node->cond->reg);
-      printf("jz L%d\n", false_label);
-      GenerateForNodeRValue(node->if_true_stmt);
-      printf("jmp L%d\n", end_label);
-      printf("L%d:\n", false_label);
-      if (node->if_else_stmt) {
-        GenerateForNodeRValue(node->if_else_stmt);
+    if (IsTokenWithType(n->op, kTokenIdent)) {
+      // Only arrays and functions decay into address constants
+      int type = GetTypeWithoutAttr(n->expr_type)->type;
+      if (type == kTypeArray || type == kTypeFunction) {
+        *base = n;
+        return 0;
       }
-      printf("L%d:\n", end_label);
-      return;
     }
-    ErrorWithToken(node->op, "GenerateForNode: Not implemented jump stmt");
-  } else if (node->type == kASTForStmt) {
-    int loop_label = GetLabelNumber();
-    int end_label = GetLabelNumber();
-    int old_label_to_break = label_to_break;
-    label_to_break = end_label;
-    int old_label_to_continue = label_to_break;
-    label_to_continue = loop_label;
-    if (node->init) {
-      GenerateForNode(node->init);
-    }
-    printf("L%d:\n", loop_label);
-    if (node->cond) {
-      GenerateForNodeRValue(node->cond);
-      EmitConvertToBool(node->cond->reg, node->cond->reg);
-      printf("jz L%d\n", end_label);
-    }
-    GenerateForNode(node->body);
-    if (node->updt) {
-      GenerateForNode(node->updt);
-    }
-    printf("jmp L%d\n", loop_label);
-    printf("L%d:\n", end_label);
-    label_to_continue = old_label_to_continue;
-    label_to_break = old_label_to_break;
-    return;
-  } else if (node->type == kASTWhileStmt) {
-    int loop_label = GetLabelNumber();
-    int end_label = GetLabelNumber();
-    int old_label_to_break = label_to_break;
-    label_to_break = end_label;
-    int old_label_to_continue = label_to_break;
-    label_to_continue = loop_label;
-    printf("L%d:\n", loop_label);
-    GenerateForNodeRValue(node->cond);
-    EmitConvertToBool(node->cond->reg, node->cond->reg);
-    printf("jz L%d\n", end_label);
-    GenerateForNode(node->body);
-    printf("jmp L%d\n", loop_label);
-    printf("L%d:\n", end_label);
-    label_to_continue = old_label_to_continue;
-    label_to_break = old_label_to_break;
-    return;
+  } else if (n->type == kASTExpr && n->cond) {
+    return EvalStaticArithmetic(n->cond)
+               ? EvalStaticInitializer(n->left, base)
+               : EvalStaticInitializer(n->right, base);
+  } else if (IsEqualTokenWithCStr(n->op, "(")) {
+    return EvalStaticInitializer(n->right, base);
+  } else if (n->type == kASTExpr && !n->left && n->right) {
+    if (IsTokenWithType(n->op, kTokenKwSizeof)) {
+      return GetSizeOfType(n->right->expr_type);
+    }
+    if (IsEqualTokenWithCStr(n->op, "&")) {
+      return EvalStaticAddressOf(n->right, base);
+    }
+    long v = EvalStaticArithmetic(n->right);
+    if (IsEqualTokenWithCStr(n->op, "+")) return v;
+    if (IsEqualTokenWithCStr(n->op, "-")) return -v;
+    if (IsEqualTokenWithCStr(n->op, "~")) return ~v;
+    if (IsEqualTokenWithCStr(n->op, "!")) return !v;
+  } else if ((IsEqualTokenWithCStr(n->op, "[") ||
+              IsEqualTokenWithCStr(n->op, ".")) &&
+             GetTypeWithoutAttr(n->expr_type)->type == kTypeArray) {
+    // m[1] and s.a decay into address constants as well as arrays
+    return EvalStaticAddressOf(n, base);
+  } else if (n->type == kASTExpr && n->left && n->right &&
+             !IsEqualTokenWithCStr(n->op, "[") &&
+             !IsEqualTokenWithCStr(n->op, ".") &&
+             !IsEqualTokenWithCStr(n->op, "->")) {
+    struct Node *left_base;
+    struct Node *right_base;
+    long l = EvalStaticInitializer(n->left, &left_base);
+    long r = EvalStaticInitializer(n->right, &right_base);
+    if (!left_base && !right_base) return EvalStaticBinOp(n->op, l, r);
+    if (IsEqualTokenWithCStr(n->op, "+") && !right_base) {
+      *base = left_base;
+      return l + r * GetSizeOfPointeeForAddress(n->left->expr_type);
+    }
+    if (IsEqualTokenWithCStr(n->op, "+") && !left_base) {
+      *base = right_base;
+      return r + l * GetSizeOfPointeeForAddress(n->right->expr_type);
+    }
+    if (IsEqualTokenWithCStr(n->op, "-") && !right_base) {
+      *base = left_base;
+      return l - r * GetSizeOfPointeeForAddress(n->left->expr_type);
+    }
   }
-  ErrorWithToken(node->op, "GenerateForNode: Not implemented");
+  ErrorWithToken(n->op, "Initializer element is not a compile-time constant");
 }
 
-static void GenerateForNodeRValue(struct Node *node) {
-  GenerateForNode(node);
-  if (!node->expr_type) return;
-  if (node->expr_type->type != kTypeLValue) return;
-  if (node->expr_type->type == kTypeLValue &&
-      node->expr_type->right->type == kTypeArray)
-    return;
-  int size = GetSizeOfType(GetRValueType(node->expr_type));
-  if (size == 8) {
-    printf("mov %s, [%s]\n", reg_names_64[node->reg], reg_names_64[node->reg]);
-    return;
+// Static data of a global var is emitted sequentially.
+// static_data_ofs is the number of bytes emitted for the current var.
+// In a dry run, nothing is emitted but static_data_has_reloc is updated.
+static int static_data_ofs;
+static bool is_static_data_dry_run;
+static bool static_data_has_reloc;
+
+static void EmitStaticDataPaddingTo(int ofs) {
+  assert(static_data_ofs <= ofs);
+  if (!is_static_data_dry_run && static_data_ofs < ofs) {
+    EmitDirectiveInt(".zero", ofs - static_data_ofs);
+  }
+  static_data_ofs = ofs;
+}
+
+static void EmitStaticScalar(struct Node *type, struct Node *init) {
+  int size = GetSizeOfType(type);
+  struct Node *base;
+  long value = EvalStaticInitializer(init, &base);
+  if (base) {
+    static_data_has_reloc = true;
+    if (size != 8) ErrorWithToken(init->op, "Address does not fit in here");
+  }
+  static_data_ofs += size;
+  if (is_static_data_dry_run) return;
+  if (size == 1) {
+    EmitStr(".byte ");
   } else if (size == 4) {
-    printf("movsxd %s, dword ptr[%s]\n", reg_names_64[node->reg],
-           reg_names_64[node->reg]);
+    EmitStr(".long ");
+  } else if (size == 8) {
+    EmitStr(".quad ");
+  } else {
+    ErrorWithToken(init->op, "Initializing %d bytes is not implemented", size);
+  }
+  if (!base) {
+    // Truncated to the size of the type as stores to local vars do
+    if (size == 1) value = (signed char)value;
+    if (size == 4) value = (int)value;
+    EmitInt(value);
+    EmitChar('\n');
     return;
-  } else if (size == 1) {
-    printf("movsx %s, byte ptr[%s]\n", reg_names_64[node->reg],
-           reg_names_64[node->reg]);
+  }
+  if (IsTokenWithType(base->op, kTokenStringLiteral)) {
+    EmitLabelRef(GetStringLiteralLabel(base));
+  } else {
+    EmitSymbol(CreateTokenStr(base->op));
+  }
+  if (value) {
+    EmitStr(value > 0 ? " + " : " - ");
+    EmitInt(value > 0 ? value : -value);
+  }
+  EmitChar('\n');
+}
+
+static void EmitStaticCharArray(struct Node *type, struct Node *init) {
+  int size = GetSizeOfType(type);
+  char *buf = malloc(init->op->length);
+  int length = DecodeStringLiteral(init->op, buf);
+  // The terminating null character is dropped if there is no room for it
+  if (length > size) ErrorWithToken(init->op, "Too long string initializer");
+  if (!is_static_data_dry_run && length) {
+    EmitStr(".byte ");
+    for (int i = 0; i < length; i++) {
+      EmitInt(buf[i]);
+      EmitStr(i == length - 1 ? "\n" : ", ");
+    }
+  }
+  static_data_ofs += length;
+}
+
+static void EmitStaticDataForType(struct Node *type, struct Node *list,
+                                  int *pos);
+
+static void EmitStaticDataForMembers(struct Node *type, struct Node *list,
+                                     int *pos) {
+  // Consumes initializers in list from *pos for each member of type
+  int begin = static_data_ofs;
+  if (type->type == kTypeArray) {
+    struct Node *elem_type = type->type_array_type_of;
+    int elem_size = GetSizeOfType(elem_type);
+    int num_of_elems = GetSizeOfType(type) / (elem_size ? elem_size : 1);
+    for (int i = 0; i < num_of_elems && *pos < GetSizeOfList(list); i++) {
+      EmitStaticDataPaddingTo(begin + i * elem_size);
+      EmitStaticDataForType(elem_type, list, pos);
+    }
     return;
   }
-  ErrorWithToken(node->op, "Dereferencing %d bytes is not implemented.", size);
+  assert(type->type == kTypeStruct);
+  struct Node *dict = type->type_struct_spec->struct_member_dict;
+  for (int i = 0; i < GetSizeOfList(dict) && *pos < GetSizeOfList(list); i++) {
+    struct Node *member = GetNodeAt(dict, i)->value;
+    EmitStaticDataPaddingTo(begin + member->struct_member_ent_ofs);
+    EmitStaticDataForType(member->struct_member_ent_type, list, pos);
+  }
+}
+
+static void EmitStaticDataForType(struct Node *type, struct Node *list,
+                                  int *pos) {
+  // Emits one object of type with initializers in list from *pos.
+  // Braces of sub-aggregates can be omitted as C allows.
+  type = GetTypeWithoutAttr(type);
+  int end = static_data_ofs + GetSizeOfType(type);
+  if (*pos < GetSizeOfList(list)) {
+    struct Node *init = GetNodeAt(list, *pos);
+    bool is_aggregate = type->type == kTypeArray || type->type == kTypeStruct;
+    if (IsASTInitializerList(init)) {
+      (*pos)++;
+      int sub_pos = 0;
+      if (is_aggregate) {
+        EmitStaticDataForMembers(type, init, &sub_pos);
+      } else {
+        EmitStaticDataForType(type, init, &sub_pos);
+      }
+      if (sub_pos < GetSizeOfList(init)) {
+        ErrorWithToken(init->op, "Excess elements in initializer");
+      }
+    } else if (type->type == kTypeArray &&
+               IsTokenWithType(init->op, kTokenStringLiteral) &&
+               GetSizeOfType(type->type_array_type_of) == 1) {
+      (*pos)++;
+      EmitStaticCharArray(type, init);
+    } else if (is_aggregate) {
+      EmitStaticDataForMembers(type, list, pos);
+    } else {
+      (*pos)++;
+      EmitStaticScalar(type, init);
+    }
+  }
+  EmitStaticDataPaddingTo(end);
+}
+
+static void EmitStaticDataOfGlobalVar(struct Node *type, struct Node *init) {
+  struct Node *list = AllocList();
+  PushToList(list, init);
+  int pos = 0;
+  static_data_ofs = 0;
+  EmitStaticDataForType(type, list, &pos);
+}
+
+static const char *GetSectionDirectiveForGlobalVar(struct Node *global_var) {
+  if (!global_var->decltor_init_expr) {
+    // Zero-initialized vars occupy no space in the object
+    return ".bss";
+  }
+  if (!global_var->is_const) return ".data";
+  is_static_data_dry_run = true;
+  static_data_has_reloc = false;
+  EmitStaticDataOfGlobalVar(global_var->expr_type,
+                            global_var->decltor_init_expr);
+  is_static_data_dry_run = false;
+  // Addresses are fixed up by the dynamic loader so they can't be in .rodata
+  return static_data_has_reloc ? relro_section_directive
+                               : rodata_section_directive;
 }
 
-static void GenerateDataSection(struct SymbolEntry *toplevel_names) {
-  printf(".data\n");
+
+static void EmitStringLiterals(const char *section_directive,
+                               bool has_null_char_inside) {
+  bool is_section_emitted = false;
   for (int i = 0; i < GetSizeOfList(str_list); i++) {
-    struct Node *n = GetNodeAt(str_list, i);
-    printf("L%d: ", n->label_number);
-    printf(".asciz ");
-    PrintTokenStrToFile(n->op, stdout);
-    putchar('\n');
+    struct Node *kv = GetNodeAt(str_list, i);
+    // The decoded bytes are emitted since literals are pooled on them
+    int length = DecodeStringLiteral(kv->value->op, NULL);
+    if ((memchr(kv->key, 0, length) != NULL) != has_null_char_inside) {
+      continue;
+    }
+    if (!is_section_emitted) EmitDirective(section_directive);
+    is_section_emitted = true;
+    EmitLabelRef(kv->value->label_number);
+    EmitStr(": .asciz ");
+    EmitQuotedBytes(kv->key, length);
+    EmitChar('\n');
   }
-  struct SymbolEntry *e = toplevel_names;
+}
+
+static void GenerateDataSection(void) {
+  struct SymbolEntry *e = toplevel_ctx;
   for (; e; e = e->prev) {
     if (e->type != kSymbolGlobalVar) continue;
-    int size = GetSizeOfType(e->value);
+    struct Node *global_var = e->value;
+    struct Node *type = global_var->expr_type;
+    int size = GetSizeOfType(type);
     fprintf(stderr, "Global Var: %s = %d bytes\n", e->key, size);
-    printf(".global %s%s\n", symbol_prefix, e->key);
-    printf("%s%s:\n", symbol_prefix, e->key);
-    printf(".byte ");
-    for (int i = 0; i < size; i++) {
-      printf("0%s", i == (size - 1) ? "\n" : ", ");
+    EmitDirective(GetSectionDirectiveForGlobalVar(global_var));
+    EmitGlobalSymbol(e->key);
+    EmitDirectiveInt(".p2align", GetLog2OfAlign(GetAlignOfType(type)));
+    EmitSymbolDef(e->key);
+    if (!global_var->decltor_init_expr) {
+      EmitDirectiveInt(".zero", size);
+      continue;
     }
+    EmitStaticDataOfGlobalVar(type, global_var->decltor_init_expr);
   }
+  // The linker splits the cstring section at each null character to merge
+  // the strings, so literals with null characters inside are not pooled.
+  EmitStringLiterals(cstring_section_directive, false);
+  EmitStringLiterals(rodata_section_directive, true);
 }
 
-void Generate(struct Node *ast, struct SymbolEntry *toplevel_names) {
-  label_to_break = 0;
-  label_to_continue = 0;
+void Generate(struct Node *ast, struct SymbolEntry *ctx) {
+  toplevel_ctx = ctx;
   str_list = AllocList();
-  printf(".intel_syntax noprefix\n");
-  printf(".text\n");
-  GenerateForNode(ast);
-  GenerateDataSection(toplevel_names);
+  EmitDirective(".intel_syntax noprefix");
+  EmitDirective(".text");
+  func_defs = AllocList();
+  for (int i = 0; i < GetSizeOfList(ast); i++) {
+    struct Node *n = GetNodeAt(ast, i);
+    // Top-level declarations are emitted by GenerateDataSection()
+    if (n->type == kASTFuncDef) PushToList(func_defs, n);
+  }
+  BuildIRForFuncDefs();
+  MarkUsedFuncs();
+  for (int i = 0; i < GetSizeOfList(func_defs); i++) {
+    if (!is_func_used[i]) continue;
+    GenerateForFuncDef(GetNodeAt(func_defs, i), func_irs[i]);
+  }
+  GenerateDataSection();
+  EmitFlush();
 }
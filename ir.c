@@ -0,0 +1,836 @@
+#include "compilium.h"
+
+// Builds three-address code in basic blocks from the analyzed AST of a
+// function. Values live in virtual registers numbered from 1. Local
+// variables stay in memory and are accessed with kIRLoad / kIRStore.
+
+static struct IRFunc *func;
+static struct IRBlock *cur_block;
+static struct IRBlock *break_block;
+static struct IRBlock *continue_block;
+
+static struct IRBlock *AllocIRBlock(void) {
+  // The block is placed in the function by StartIRBlock()
+  struct IRBlock *b = calloc(1, sizeof(struct IRBlock));
+  b->id = -1;
+  return b;
+}
+
+static void AppendIRBlock(struct IRFunc *f, struct IRBlock *b) {
+  if (f->num_of_blocks == f->capacity) {
+    f->capacity = f->capacity * 2 + 16;
+    f->blocks = realloc(f->blocks, f->capacity * sizeof(struct IRBlock *));
+    assert(f->blocks);
+  }
+  b->id = f->num_of_blocks;
+  f->blocks[f->num_of_blocks++] = b;
+}
+
+static bool IsTerminatorOp(enum IROp op) {
+  return op == kIRJump || op == kIRBranch || op == kIRReturn;
+}
+
+bool IsIRBlockTerminated(struct IRBlock *b) {
+  return b->num_of_insts && IsTerminatorOp(b->insts[b->num_of_insts - 1].op);
+}
+
+struct IRInst *InsertIRInst(struct IRBlock *b, int index, enum IROp op,
+                            int dst, int num_of_srcs) {
+  // Inserts an inst before b->insts[index]. Pointers to the insts of b are
+  // invalidated.
+  assert(0 <= index && index <= b->num_of_insts);
+  if (b->num_of_insts == b->capacity) {
+    b->capacity = b->capacity * 2 + 8;
+    b->insts = realloc(b->insts, b->capacity * sizeof(struct IRInst));
+    assert(b->insts);
+  }
+  for (int i = b->num_of_insts; i > index; i--) b->insts[i] = b->insts[i - 1];
+  b->num_of_insts++;
+  struct IRInst *inst = &b->insts[index];
+  inst->op = op;
+  inst->dst = dst;
+  inst->num_of_srcs = num_of_srcs;
+  inst->srcs = num_of_srcs ? calloc(num_of_srcs, sizeof(int)) : NULL;
+  inst->size = 0;
+  inst->imm = 0;
+  inst->symbol = NULL;
+  inst->is_external = false;
+  inst->node = NULL;
+  inst->targets[0] = NULL;
+  inst->targets[1] = NULL;
+  inst->inline_depth = 0;
+  return inst;
+}
+
+static struct IRInst *AddIRInst(enum IROp op, int dst, int num_of_srcs) {
+  assert(!IsIRBlockTerminated(cur_block));
+  return InsertIRInst(cur_block, cur_block->num_of_insts, op, dst,
+                      num_of_srcs);
+}
+
+static void StartIRBlock(struct IRBlock *b) {
+  // Control falls through into b from the current block if it continues
+  if (cur_block && !IsIRBlockTerminated(cur_block)) {
+    AddIRInst(kIRJump, 0, 0)->targets[0] = b;
+  }
+  AppendIRBlock(func, b);
+  cur_block = b;
+}
+
+int NewIRVReg(struct IRFunc *f) { return f->num_of_vregs++; }
+
+static int NewVReg(void) { return NewIRVReg(func); }
+
+static int AddIRConst(long imm) {
+  int dst = NewVReg();
+  AddIRInst(kIRConst, dst, 0)->imm = imm;
+  return dst;
+}
+
+static int AddIRUnary(enum IROp op, int src) {
+  int dst = NewVReg();
+  AddIRInst(op, dst, 1)->srcs[0] = src;
+  return dst;
+}
+
+static int AddIRBinary(enum IROp op, int left, int right) {
+  int dst = NewVReg();
+  struct IRInst *inst = AddIRInst(op, dst, 2);
+  inst->srcs[0] = left;
+  inst->srcs[1] = right;
+  return dst;
+}
+
+static void AddIRCopy(int dst, int src) {
+  AddIRInst(kIRCopy, dst, 1)->srcs[0] = src;
+}
+
+static void CheckSizeOfAccess(struct Node *op, int size) {
+  if (size == 8 || size == 4 || size == 1) return;
+  ErrorWithToken(op, "Assigning %d bytes is not implemented.", size);
+}
+
+static int AddIRLoad(struct Node *op, int addr, int size) {
+  CheckSizeOfAccess(op, size);
+  int dst = AddIRUnary(kIRLoad, addr);
+  cur_block->insts[cur_block->num_of_insts - 1].size = size;
+  return dst;
+}
+
+static void AddIRStore(struct Node *op, int addr, int src, int size) {
+  CheckSizeOfAccess(op, size);
+  struct IRInst *inst = AddIRInst(kIRStore, 0, 2);
+  inst->srcs[0] = addr;
+  inst->srcs[1] = src;
+  inst->size = size;
+}
+
+static void AddIRJump(struct IRBlock *target) {
+  AddIRInst(kIRJump, 0, 0)->targets[0] = target;
+}
+
+static void AddIRBranch(int cond, struct IRBlock *if_true,
+                        struct IRBlock *if_false) {
+  struct IRInst *inst = AddIRInst(kIRBranch, 0, 1);
+  inst->srcs[0] = cond;
+  inst->targets[0] = if_true;
+  inst->targets[1] = if_false;
+}
+
+static void StartUnreachableIRBlock(void) {
+  // Code after jumps is placed in a new block removed by BuildIRCFG()
+  assert(IsIRBlockTerminated(cur_block));
+  StartIRBlock(AllocIRBlock());
+}
+
+static int BuildIRForNode(struct Node *node);
+static int BuildIRForNodeRValue(struct Node *node);
+
+static bool IsAssignOp(struct Node *op) {
+  return IsEqualTokenWithCStr(op, "=") || IsEqualTokenWithCStr(op, "+=") ||
+         IsEqualTokenWithCStr(op, "-=") || IsEqualTokenWithCStr(op, "*=") ||
+         IsEqualTokenWithCStr(op, "/=") || IsEqualTokenWithCStr(op, "%=") ||
+         IsEqualTokenWithCStr(op, "<<=") || IsEqualTokenWithCStr(op, ">>=");
+}
+
+static int GetNumOfRegsNeeded(struct Node *n) {
+  // Returns the Sethi-Ullman number of expression n, that is the number of
+  // registers needed to evaluate it without spills. n->has_side_effect is
+  // computed at the same time.
+  if (n->num_of_regs_needed) return n->num_of_regs_needed;
+  int need = 1;
+  bool has_side_effect = true;
+  if (n->type == kASTExpr && !IsTokenWithType(n->op, kTokenKwSizeof)) {
+    struct Node *children[3] = {n->cond, n->left, n->right};
+    if (IsEqualTokenWithCStr(n->op, ".") ||
+        IsEqualTokenWithCStr(n->op, "->")) {
+      // right is the name of the member
+      children[2] = NULL;
+    }
+    int child_needs[3] = {0};
+    has_side_effect = IsAssignOp(n->op) || IsEqualTokenWithCStr(n->op, "++") ||
+                      IsEqualTokenWithCStr(n->op, "--");
+    for (int i = 0; i < 3; i++) {
+      if (!children[i]) continue;
+      child_needs[i] = GetNumOfRegsNeeded(children[i]);
+      has_side_effect |= children[i]->has_side_effect;
+      if (child_needs[i] > need) need = child_needs[i];
+    }
+    if (!n->cond && child_needs[1] && child_needs[1] == child_needs[2]) {
+      // One more register holds the result of the side evaluated first
+      need = child_needs[1] + 1;
+    }
+  } else if (n->type == kASTExpr) {
+    // sizeof does not evaluate its operand
+    has_side_effect = false;
+  }
+  n->num_of_regs_needed = need;
+  n->has_side_effect = has_side_effect;
+  return need;
+}
+
+static bool IsRightEvaluatedFirst(struct Node *node) {
+  // The operands of binary operators other than &&, || and , are not
+  // sequenced in C. Evaluating the side which needs more registers first
+  // keeps fewer values live, unless side effects could observe the order.
+  int left_need = GetNumOfRegsNeeded(node->left);
+  int right_need = GetNumOfRegsNeeded(node->right);
+  if (node->left->has_side_effect || node->right->has_side_effect) {
+    return false;
+  }
+  return right_need > left_need;
+}
+
+static void BuildIRForBinaryOperands(struct Node *node) {
+  // Sets left->reg and right->reg.
+  // The left operand of assignments is evaluated as an address.
+  bool is_right_first = IsRightEvaluatedFirst(node);
+  if (is_right_first) BuildIRForNodeRValue(node->right);
+  if (IsAssignOp(node->op)) {
+    BuildIRForNode(node->left);
+  } else {
+    BuildIRForNodeRValue(node->left);
+  }
+  if (!is_right_first) BuildIRForNodeRValue(node->right);
+}
+
+static enum IROp GetIROpOfArithmetic(struct Node *op) {
+  // Returns kIRCopy if op is not an arithmetic operator.
+  // Compound assignments are mapped to the operation they apply.
+  if (IsEqualTokenWithCStr(op, "+") || IsEqualTokenWithCStr(op, "+=")) {
+    return kIRAdd;
+  }
+  if (IsEqualTokenWithCStr(op, "-") || IsEqualTokenWithCStr(op, "-=")) {
+    return kIRSub;
+  }
+  if (IsEqualTokenWithCStr(op, "*") || IsEqualTokenWithCStr(op, "*=")) {
+    return kIRMul;
+  }
+  if (IsEqualTokenWithCStr(op, "/") || IsEqualTokenWithCStr(op, "/=")) {
+    return kIRDiv;
+  }
+  if (IsEqualTokenWithCStr(op, "%") || IsEqualTokenWithCStr(op, "%=")) {
+    return kIRMod;
+  }
+  if (IsEqualTokenWithCStr(op, "<<") || IsEqualTokenWithCStr(op, "<<=")) {
+    return kIRShl;
+  }
+  if (IsEqualTokenWithCStr(op, ">>") || IsEqualTokenWithCStr(op, ">>=")) {
+    return kIRSar;
+  }
+  if (IsEqualTokenWithCStr(op, "&")) return kIRAnd;
+  if (IsEqualTokenWithCStr(op, "|")) return kIROr;
+  if (IsEqualTokenWithCStr(op, "^")) return kIRXor;
+  if (IsEqualTokenWithCStr(op, "==")) return kIREq;
+  if (IsEqualTokenWithCStr(op, "!=")) return kIRNe;
+  if (IsEqualTokenWithCStr(op, "<")) return kIRLt;
+  if (IsEqualTokenWithCStr(op, "<=")) return kIRLe;
+  if (IsEqualTokenWithCStr(op, ">")) return kIRGt;
+  if (IsEqualTokenWithCStr(op, ">=")) return kIRGe;
+  return kIRCopy;
+}
+
+static int BuildIRForFuncCall(struct Node *node) {
+  // Direct calls name the callee. Function pointers are passed in srcs[0].
+  struct Node *func_expr = node->func_expr;
+  bool is_direct_call = func_expr->type == kASTExpr &&
+                        IsTokenWithType(func_expr->op, kTokenIdent) &&
+                        GetTypeWithoutAttr(func_expr->expr_type)->type ==
+                            kTypeFunction;
+  int num_of_args = GetSizeOfList(node->arg_expr_list);
+  int callee = is_direct_call ? 0 : BuildIRForNodeRValue(func_expr);
+  int *args = malloc(num_of_args * sizeof(int));
+  for (int i = 0; i < num_of_args; i++) {
+    args[i] = BuildIRForNodeRValue(GetNodeAt(node->arg_expr_list, i));
+  }
+  int num_of_srcs = num_of_args + (is_direct_call ? 0 : 1);
+  struct IRInst *inst = AddIRInst(kIRCall, NewVReg(), num_of_srcs);
+  if (is_direct_call) {
+    inst->symbol = CreateTokenStr(func_expr->op);
+    inst->is_external = !FindFuncDef(func->toplevel_ctx, func_expr->op);
+  } else {
+    inst->srcs[0] = callee;
+  }
+  for (int i = 0; i < num_of_args; i++) {
+    inst->srcs[num_of_srcs - num_of_args + i] = args[i];
+  }
+  inst->size = GetSizeOfType(node->expr_type);
+  if (inst->size != 0 && inst->size != 4 && inst->size != 8) {
+    ErrorWithToken(func_expr->op,
+                   "Calls returning %d bytes are not implemented", inst->size);
+  }
+  return inst->dst;
+}
+
+static int BuildIRForPrimaryExpr(struct Node *node) {
+  if (IsTokenWithType(node->op, kTokenIntegerConstant)) {
+    return AddIRConst(strtol(node->op->begin, NULL, 0));
+  } else if (IsTokenWithType(node->op, kTokenCharLiteral)) {
+    return AddIRConst(EvalCharLiteral(node->op));
+  } else if (IsTokenWithType(node->op, kTokenIdent)) {
+    int dst = NewVReg();
+    if (node->expr_type->type == kTypeFunction || !node->byte_offset) {
+      // functions and global vars
+      struct IRInst *inst = AddIRInst(kIRGlobalAddr, dst, 0);
+      inst->symbol = CreateTokenStr(node->op);
+      inst->is_external = node->expr_type->type == kTypeFunction
+                              ? !FindFuncDef(func->toplevel_ctx, node->op)
+                              : !FindGlobalVar(func->toplevel_ctx, node->op);
+      return dst;
+    }
+    AddIRInst(kIRLocalAddr, dst, 0)->imm = node->byte_offset;
+    return dst;
+  } else if (IsTokenWithType(node->op, kTokenStringLiteral)) {
+    int dst = NewVReg();
+    AddIRInst(kIRStringAddr, dst, 0)->node = node;
+    return dst;
+  }
+  ErrorWithToken(node->op, "BuildIR: Not implemented");
+}
+
+static int BuildIRForIncDec(struct Node *node, int addr) {
+  // Prefix ones yield the updated value read back from the memory, so that
+  // it is truncated to the size of the variable.
+  int size = GetSizeOfType(node->expr_type);
+  int value = AddIRLoad(node->op, addr, size);
+  enum IROp op = IsEqualTokenWithCStr(node->op, "++") ? kIRAdd : kIRSub;
+  AddIRStore(node->op, addr, AddIRBinary(op, value, AddIRConst(1)), size);
+  if (node->left) return value;
+  return AddIRLoad(node->op, addr, size);
+}
+
+static int BuildIRForAssign(struct Node *node) {
+  // Yields the stored value read back from the memory, so that it is
+  // truncated to the size of the left operand. The load is removed as dead
+  // code if the value is not used.
+  int addr = node->left->reg;
+  int size = GetSizeOfType(node->left->expr_type);
+  int value = node->right->reg;
+  if (!IsEqualTokenWithCStr(node->op, "=")) {
+    value = AddIRBinary(GetIROpOfArithmetic(node->op),
+                        AddIRLoad(node->op, addr, size), value);
+  }
+  AddIRStore(node->op, addr, value, size);
+  return AddIRLoad(node->op, addr, size);
+}
+
+static bool IsExprWithOp(struct Node *node, const char *op) {
+  return node->type == kASTExpr && IsEqualTokenWithCStr(node->op, op);
+}
+
+static void BuildIRForCondBranch(struct Node *cond, struct IRBlock *if_true,
+                                 struct IRBlock *if_false) {
+  // Conditions branch directly on their comparisons. &&, || and ! become
+  // chains of branches instead of yielding 0 or 1.
+  if (IsExprWithOp(cond, "(") && !cond->left) {
+    BuildIRForCondBranch(cond->right, if_true, if_false);
+  } else if (IsExprWithOp(cond, "!") && !cond->left) {
+    BuildIRForCondBranch(cond->right, if_false, if_true);
+  } else if (IsExprWithOp(cond, "&&") || IsExprWithOp(cond, "||")) {
+    struct IRBlock *rhs_block = AllocIRBlock();
+    if (IsEqualTokenWithCStr(cond->op, "&&")) {
+      BuildIRForCondBranch(cond->left, rhs_block, if_false);
+    } else {
+      BuildIRForCondBranch(cond->left, if_true, rhs_block);
+    }
+    StartIRBlock(rhs_block);
+    BuildIRForCondBranch(cond->right, if_true, if_false);
+  } else {
+    AddIRBranch(BuildIRForNodeRValue(cond), if_true, if_false);
+  }
+}
+
+static int BuildIRForLogicalExpr(struct Node *node) {
+  // && and || yield 0 or 1 in dst from both paths
+  int dst = NewVReg();
+  struct IRBlock *true_block = AllocIRBlock();
+  struct IRBlock *false_block = AllocIRBlock();
+  struct IRBlock *end_block = AllocIRBlock();
+  BuildIRForCondBranch(node, true_block, false_block);
+  StartIRBlock(true_block);
+  AddIRCopy(dst, AddIRConst(1));
+  AddIRJump(end_block);
+  StartIRBlock(false_block);
+  AddIRCopy(dst, AddIRConst(0));
+  StartIRBlock(end_block);
+  return dst;
+}
+
+static int BuildIRForConditionalExpr(struct Node *node) {
+  int dst = NewVReg();
+  struct IRBlock *true_block = AllocIRBlock();
+  struct IRBlock *false_block = AllocIRBlock();
+  struct IRBlock *end_block = AllocIRBlock();
+  BuildIRForCondBranch(node->cond, true_block, false_block);
+  StartIRBlock(true_block);
+  AddIRCopy(dst, BuildIRForNodeRValue(node->left));
+  AddIRJump(end_block);
+  StartIRBlock(false_block);
+  AddIRCopy(dst, BuildIRForNodeRValue(node->right));
+  StartIRBlock(end_block);
+  return dst;
+}
+
+static int BuildIRForExpr(struct Node *node) {
+  if (!node->left && !node->right && !node->cond) {
+    return BuildIRForPrimaryExpr(node);
+  } else if (IsEqualTokenWithCStr(node->op, "(")) {
+    return BuildIRForNode(node->right);
+  } else if (IsEqualTokenWithCStr(node->op, ".") ||
+             IsEqualTokenWithCStr(node->op, "->")) {
+    int base = BuildIRForNodeRValue(node->left);
+    if (!node->byte_offset) return base;
+    return AddIRBinary(kIRAdd, base, AddIRConst(node->byte_offset));
+  } else if (node->cond) {
+    return BuildIRForConditionalExpr(node);
+  } else if (!node->left && node->right) {
+    if (IsTokenWithType(node->op, kTokenKwSizeof)) {
+      return AddIRConst(GetSizeOfType(node->right->expr_type));
+    }
+    if (IsEqualTokenWithCStr(node->op, "++") ||
+        IsEqualTokenWithCStr(node->op, "--")) {
+      return BuildIRForIncDec(node, BuildIRForNode(node->right));
+    }
+    if (IsEqualTokenWithCStr(node->op, "&")) {
+      return BuildIRForNode(node->right);
+    }
+    int operand = BuildIRForNodeRValue(node->right);
+    if (IsEqualTokenWithCStr(node->op, "+") ||
+        IsEqualTokenWithCStr(node->op, "*")) {
+      return operand;
+    }
+    if (IsEqualTokenWithCStr(node->op, "-")) {
+      return AddIRUnary(kIRNeg, operand);
+    }
+    if (IsEqualTokenWithCStr(node->op, "~")) {
+      return AddIRUnary(kIRNot, operand);
+    }
+    if (IsEqualTokenWithCStr(node->op, "!")) {
+      return AddIRBinary(kIREq, operand, AddIRConst(0));
+    }
+    ErrorWithToken(node->op, "BuildIR: Not implemented unary prefix op");
+  } else if (node->left && !node->right) {
+    if (IsEqualTokenWithCStr(node->op, "++") ||
+        IsEqualTokenWithCStr(node->op, "--")) {
+      // Postfix ++ and --
+      return BuildIRForIncDec(node, BuildIRForNode(node->left));
+    }
+    ErrorWithToken(node->op, "BuildIR: Not implemented unary postfix op");
+  }
+  if (IsEqualTokenWithCStr(node->op, "&&") ||
+      IsEqualTokenWithCStr(node->op, "||")) {
+    return BuildIRForLogicalExpr(node);
+  } else if (IsEqualTokenWithCStr(node->op, ",")) {
+    BuildIRForNode(node->left);
+    return BuildIRForNodeRValue(node->right);
+  }
+  BuildIRForBinaryOperands(node);
+  if (IsAssignOp(node->op)) return BuildIRForAssign(node);
+  if (IsEqualTokenWithCStr(node->op, "[")) {
+    int elem_size = GetSizeOfType(node->expr_type);
+    int ofs = AddIRBinary(kIRMul, node->right->reg, AddIRConst(elem_size));
+    return AddIRBinary(kIRAdd, node->left->reg, ofs);
+  }
+  enum IROp op = GetIROpOfArithmetic(node->op);
+  if (op == kIRCopy) ErrorWithToken(node->op, "BuildIR: Not implemented");
+  return AddIRBinary(op, node->left->reg, node->right->reg);
+}
+
+static void BuildIRForLoop(struct Node *node) {
+  // for and while are rotated to test cond at the bottom:
+  //   init; if (!cond) goto end; body: body; next: updt;
+  //   if (cond) goto body; end:
+  struct IRBlock *body_block = AllocIRBlock();
+  struct IRBlock *next_block = AllocIRBlock();
+  struct IRBlock *end_block = AllocIRBlock();
+  struct IRBlock *old_break_block = break_block;
+  struct IRBlock *old_continue_block = continue_block;
+  break_block = end_block;
+  continue_block = next_block;
+  body_block->is_loop_header = true;
+  if (node->init) BuildIRForNode(node->init);
+  if (node->cond) BuildIRForCondBranch(node->cond, body_block, end_block);
+  StartIRBlock(body_block);
+  BuildIRForNode(node->body);
+  StartIRBlock(next_block);
+  if (node->updt) BuildIRForNode(node->updt);
+  if (node->cond) {
+    BuildIRForCondBranch(node->cond, body_block, end_block);
+  } else {
+    AddIRJump(body_block);
+  }
+  StartIRBlock(end_block);
+  break_block = old_break_block;
+  continue_block = old_continue_block;
+}
+
+static int AddIRAddrAt(int addr, int ofs) {
+  if (!ofs) return addr;
+  return AddIRBinary(kIRAdd, addr, AddIRConst(ofs));
+}
+
+static int BuildIRForInitializerOfType(struct Node *type, int addr, int ofs,
+                                       struct Node *list, int *pos);
+
+static int BuildIRForInitializerOfMembers(struct Node *type, int addr,
+                                          int ofs, struct Node *list,
+                                          int *pos) {
+  // Consumes initializers in list from *pos for each member of type, and
+  // returns the number of bytes stored by them
+  int size = 0;
+  if (type->type == kTypeArray) {
+    struct Node *elem_type = type->type_array_type_of;
+    int elem_size = GetSizeOfType(elem_type);
+    int num_of_elems = GetSizeOfType(type) / (elem_size ? elem_size : 1);
+    for (int i = 0; i < num_of_elems && *pos < GetSizeOfList(list); i++) {
+      size += BuildIRForInitializerOfType(elem_type, addr, ofs + i * elem_size,
+                                          list, pos);
+    }
+    return size;
+  }
+  assert(type->type == kTypeStruct);
+  struct Node *dict = type->type_struct_spec->struct_member_dict;
+  for (int i = 0; i < GetSizeOfList(dict) && *pos < GetSizeOfList(list); i++) {
+    struct Node *member = GetNodeAt(dict, i)->value;
+    size += BuildIRForInitializerOfType(member->struct_member_ent_type, addr,
+                                        ofs + member->struct_member_ent_ofs,
+                                        list, pos);
+  }
+  return size;
+}
+
+static int BuildIRForInitializerOfType(struct Node *type, int addr, int ofs,
+                                       struct Node *list, int *pos) {
+  // Stores one object of type at addr + ofs with initializers in list from
+  // *pos, in the same way as EmitStaticDataForType() in generator.c.
+  type = GetTypeWithoutAttr(type);
+  if (*pos >= GetSizeOfList(list)) return 0;
+  struct Node *init = GetNodeAt(list, *pos);
+  bool is_aggregate = type->type == kTypeArray || type->type == kTypeStruct;
+  if (IsASTInitializerList(init)) {
+    (*pos)++;
+    int sub_pos = 0;
+    int size =
+        is_aggregate
+            ? BuildIRForInitializerOfMembers(type, addr, ofs, init, &sub_pos)
+            : BuildIRForInitializerOfType(type, addr, ofs, init, &sub_pos);
+    if (sub_pos < GetSizeOfList(init)) {
+      ErrorWithToken(init->op, "Excess elements in initializer");
+    }
+    return size;
+  }
+  if (type->type == kTypeArray &&
+      IsTokenWithType(init->op, kTokenStringLiteral) &&
+      GetSizeOfType(type->type_array_type_of) == 1) {
+    (*pos)++;
+    int length = DecodeStringLiteral(init->op, NULL);
+    if (length > GetSizeOfType(type)) {
+      ErrorWithToken(init->op, "Too long string initializer");
+    }
+    // The terminating null character is dropped if there is no room for it
+    if (length < GetSizeOfType(type)) length++;
+    int dst = AddIRAddrAt(addr, ofs);
+    int src = BuildIRForNodeRValue(init);
+    int size = AddIRConst(length);
+    struct IRInst *inst = AddIRInst(kIRMemcpy, 0, 3);
+    inst->srcs[0] = dst;
+    inst->srcs[1] = src;
+    inst->srcs[2] = size;
+    return length;
+  }
+  if (is_aggregate) {
+    return BuildIRForInitializerOfMembers(type, addr, ofs, list, pos);
+  }
+  (*pos)++;
+  int value = BuildIRForNodeRValue(init);
+  AddIRStore(init->op, AddIRAddrAt(addr, ofs), value, GetSizeOfType(type));
+  return GetSizeOfType(type);
+}
+
+static void BuildIRForLocalInitializer(struct Node *init_expr) {
+  // Bytes not stored by the initializers are cleared at first
+  struct Node *type = GetTypeWithoutAttr(init_expr->left->expr_type);
+  int addr = BuildIRForNode(init_expr->left);
+  struct IRBlock *b = cur_block;
+  int index = b->num_of_insts;
+  struct Node *list = AllocList();
+  PushToList(list, init_expr->right);
+  int pos = 0;
+  int size = BuildIRForInitializerOfType(type, addr, 0, list, &pos);
+  if (size == GetSizeOfType(type)) return;
+  int zero = NewVReg();
+  InsertIRInst(b, index, kIRConst, zero, 0)->imm = 0;
+  int n = NewVReg();
+  InsertIRInst(b, index + 1, kIRConst, n, 0)->imm = GetSizeOfType(type);
+  struct IRInst *inst = InsertIRInst(b, index + 2, kIRMemset, 0, 3);
+  inst->srcs[0] = addr;
+  inst->srcs[1] = zero;
+  inst->srcs[2] = n;
+}
+
+static void BuildIRForStmt(struct Node *node) {
+  if (node->type == kASTExprStmt) {
+    if (node->left) BuildIRForNode(node->left);
+    return;
+  } else if (node->type == kASTList) {
+    for (int i = 0; i < GetSizeOfList(node); i++) {
+      BuildIRForNode(GetNodeAt(node, i));
+    }
+    return;
+  } else if (node->type == kASTDecl) {
+    if (IsASTDeclOfTypedef(node)) {
+      return;
+    }
+    assert(node->right && node->right->type == kASTDecltor);
+    struct Node *init_expr = node->right->decltor_init_expr;
+    if (!init_expr) return;
+    if (!init_expr->expr_type) {
+      // Not analyzed as an assignment
+      BuildIRForLocalInitializer(init_expr);
+      return;
+    }
+    BuildIRForNode(init_expr);
+    return;
+  } else if (node->type == kASTJumpStmt) {
+    if (IsTokenWithType(node->op, kTokenKwBreak)) {
+      if (!break_block) {
+        ErrorWithToken(node->op, "break is not allowed here");
+      }
+      AddIRJump(break_block);
+      StartUnreachableIRBlock();
+      return;
+    }
+    if (IsTokenWithType(node->op, kTokenKwContinue)) {
+      if (!continue_block) {
+        ErrorWithToken(node->op, "continue is not allowed here");
+      }
+      AddIRJump(continue_block);
+      StartUnreachableIRBlock();
+      return;
+    }
+    if (IsTokenWithType(node->op, kTokenKwReturn)) {
+      if (node->right) {
+        int value = BuildIRForNodeRValue(node->right);
+        // The value is converted to the return type as stores to char do
+        struct Node *ret_type = GetReturnTypeOfFunction(
+            GetTypeWithoutAttr(func->func_def->func_type));
+        if (GetSizeOfType(ret_type) == 1 &&
+            GetSizeOfType(node->right->expr_type) != 1) {
+          struct IRInst *sext = AddIRInst(kIRSext, NewVReg(), 1);
+          sext->srcs[0] = value;
+          sext->size = 1;
+          value = sext->dst;
+        }
+        AddIRInst(kIRReturn, 0, 1)->srcs[0] = value;
+      } else {
+        AddIRInst(kIRReturn, 0, 0);
+      }
+      StartUnreachableIRBlock();
+      return;
+    }
+    ErrorWithToken(node->op, "BuildIR: Not implemented jump stmt");
+  } else if (node->type == kASTSelectionStmt) {
+    if (IsTokenWithType(node->op, kTokenKwIf)) {
+      struct IRBlock *true_block = AllocIRBlock();
+      struct IRBlock *false_block = AllocIRBlock();
+      struct IRBlock *end_block =
+          node->if_else_stmt ? AllocIRBlock() : false_block;
+      BuildIRForCondBranch(node->cond, true_block, false_block);
+      StartIRBlock(true_block);
+      BuildIRForNode(node->if_true_stmt);
+      if (node->if_else_stmt) {
+        AddIRJump(end_block);
+        StartIRBlock(false_block);
+        BuildIRForNode(node->if_else_stmt);
+      }
+      StartIRBlock(end_block);
+      return;
+    }
+    ErrorWithToken(node->op, "BuildIR: Not implemented selection stmt");
+  } else if (node->type == kASTForStmt || node->type == kASTWhileStmt) {
+    BuildIRForLoop(node);
+    return;
+  }
+  ErrorWithToken(node->op, "BuildIR: Not implemented");
+}
+
+static int BuildIRForNode(struct Node *node) {
+  // Returns the virtual register which holds the value of node, or 0.
+  // The value is an address if node is an lvalue.
+  if (node->type == kASTList && !node->op) {
+    for (int i = 0; i < GetSizeOfList(node); i++) {
+      BuildIRForNode(GetNodeAt(node, i));
+    }
+    return 0;
+  }
+  if (node->type == kASTExprFuncCall) {
+    node->reg = BuildIRForFuncCall(node);
+    return node->reg;
+  }
+  assert(node && node->op);
+  if (node->type == kASTExpr) {
+    node->reg = BuildIRForExpr(node);
+    return node->reg;
+  }
+  BuildIRForStmt(node);
+  return 0;
+}
+
+static int BuildIRForNodeRValue(struct Node *node) {
+  BuildIRForNode(node);
+  if (!node->expr_type) return node->reg;
+  if (node->expr_type->type != kTypeLValue) return node->reg;
+  if (node->expr_type->right->type == kTypeArray) return node->reg;
+  int size = GetSizeOfType(GetRValueType(node->expr_type));
+  if (size != 8 && size != 4 && size != 1) {
+    ErrorWithToken(node->op, "Dereferencing %d bytes is not implemented.",
+                   size);
+  }
+  node->reg = AddIRLoad(node->op, node->reg, size);
+  return node->reg;
+}
+
+static void AddIRBlockEdge(struct IRBlock *from, struct IRBlock *to) {
+  from->succs[from->num_of_succs++] = to;
+  to->preds = realloc(to->preds, (to->num_of_preds + 1) * sizeof(*to->preds));
+  assert(to->preds);
+  to->preds[to->num_of_preds++] = from;
+}
+
+static void MarkReachableIRBlocks(struct IRBlock *b) {
+  struct IRBlock **stack = malloc(func->num_of_blocks * sizeof(*stack));
+  int sp = 0;
+  b->is_reachable = true;
+  stack[sp++] = b;
+  while (sp) {
+    struct IRBlock *from = stack[--sp];
+    struct IRInst *last = &from->insts[from->num_of_insts - 1];
+    for (int i = 0; i < 2; i++) {
+      struct IRBlock *to = last->targets[i];
+      if (!to || to->is_reachable) continue;
+      to->is_reachable = true;
+      stack[sp++] = to;
+    }
+  }
+}
+
+void BuildIRCFG(struct IRFunc *f) {
+  // Removes unreachable blocks and recomputes ids, preds and succs
+  func = f;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    assert(IsIRBlockTerminated(b));
+    b->is_reachable = false;
+    b->num_of_succs = 0;
+    b->num_of_preds = 0;
+  }
+  MarkReachableIRBlocks(f->blocks[0]);
+  int num_of_blocks = 0;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    if (!b->is_reachable) continue;
+    b->id = num_of_blocks;
+    f->blocks[num_of_blocks++] = b;
+  }
+  f->num_of_blocks = num_of_blocks;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    struct IRInst *last = &b->insts[b->num_of_insts - 1];
+    if (last->targets[0]) AddIRBlockEdge(b, last->targets[0]);
+    if (last->targets[1]) AddIRBlockEdge(b, last->targets[1]);
+  }
+}
+
+struct IRFunc *BuildIR(struct Node *func_def,
+                       struct SymbolEntry *toplevel_ctx) {
+  func = calloc(1, sizeof(struct IRFunc));
+  func->func_def = func_def;
+  func->toplevel_ctx = toplevel_ctx;
+  func->num_of_vregs = 1;
+  func->stack_size = func_def->stack_size_needed;
+  cur_block = NULL;
+  break_block = NULL;
+  continue_block = NULL;
+  StartIRBlock(AllocIRBlock());
+  struct Node *arg_var_list = func_def->arg_var_list;
+  assert(arg_var_list);
+  for (int i = 0; i < GetSizeOfList(arg_var_list); i++) {
+    struct Node *arg_var = GetNodeAt(arg_var_list, i);
+    if (!arg_var) continue;
+    int value = NewVReg();
+    AddIRInst(kIRParam, value, 0)->imm = i;
+    int addr = NewVReg();
+    AddIRInst(kIRLocalAddr, addr, 0)->imm = arg_var->byte_offset;
+    AddIRStore(GetIdentifierTokenFromTypeAttr(arg_var->expr_type), addr, value,
+               GetSizeOfType(arg_var->expr_type));
+  }
+  struct Node *stmt_list = func_def->func_body;
+  for (int i = 0; i < GetSizeOfList(stmt_list); i++) {
+    BuildIRForNode(GetNodeAt(stmt_list, i));
+  }
+  if (!IsIRBlockTerminated(cur_block)) AddIRInst(kIRReturn, 0, 0);
+  BuildIRCFG(func);
+  return func;
+}
+
+static const char *ir_op_names[kNumOfIROps] = {
+    "param", "const", "copy", "sext", "phi", "local_addr", "global_addr",
+    "string_addr", "load", "store", "memset", "memcpy", "neg", "not", "add",
+    "sub", "mul", "div", "mod", "shl", "sar", "and", "or", "xor", "eq", "ne",
+    "lt", "le", "gt", "ge", "call", "jump", "branch", "return", "vsplat",
+    "vload", "vstore", "vadd", "vsub", "vand", "vor", "vxor"};
+
+void PrintIRFunc(struct IRFunc *f) {
+  fprintf(stderr, "IR of %s:\n",
+          CreateTokenStr(f->func_def->func_name_token));
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    fprintf(stderr, "B%d: (preds:", b->id);
+    for (int k = 0; k < b->num_of_preds; k++) {
+      fprintf(stderr, " B%d", b->preds[k]->id);
+    }
+    fprintf(stderr, ")\n");
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      fputs("  ", stderr);
+      if (inst->dst) fprintf(stderr, "v%d = ", inst->dst);
+      fputs(ir_op_names[inst->op], stderr);
+      if (inst->size) fprintf(stderr, ".%d", inst->size);
+      if (inst->symbol) fprintf(stderr, " %s", inst->symbol);
+      for (int s = 0; s < inst->num_of_srcs; s++) {
+        fprintf(stderr, " v%d", inst->srcs[s]);
+      }
+      if (inst->op == kIRConst || inst->op == kIRParam ||
+          inst->op == kIRLocalAddr) {
+        fprintf(stderr, " %ld", inst->imm);
+      }
+      if (inst->op >= kIRVecSplat && inst->op != kIRVecStore) {
+        fprintf(stderr, " vr%ld", inst->imm);
+      }
+      for (int t = 0; t < 2; t++) {
+        if (inst->targets[t]) fprintf(stderr, " B%d", inst->targets[t]->id);
+      }
+      fputc('\n', stderr);
+    }
+  }
+}
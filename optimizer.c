@@ -0,0 +1,2080 @@
+#include "compilium.h"
+
+// Optimization passes on the IR in SSA form.
+
+static struct IRFunc *func;
+
+static void PartitionPhiNodes(struct IRBlock *b) {
+  // Moves phi nodes in front of the other insts of b, keeping their order
+  struct IRInst *insts = malloc(b->num_of_insts * sizeof(struct IRInst));
+  int n = 0;
+  for (int k = 0; k < b->num_of_insts; k++) {
+    if (b->insts[k].op == kIRPhi) insts[n++] = b->insts[k];
+  }
+  for (int k = 0; k < b->num_of_insts; k++) {
+    if (b->insts[k].op != kIRPhi) insts[n++] = b->insts[k];
+  }
+  b->insts = insts;
+  b->capacity = n;
+}
+
+// Inlining.
+// A call of a function defined in this unit is replaced with a copy of the
+// IR of its body if the body is small enough. The block of the call jumps
+// to the copy of the entry, and returns jump to a new block holding the
+// rest of the block, where the return value is merged by a phi node.
+// Params become copies of the args. Calls in the copy are inlined in turn,
+// up to MAX_INLINE_DEPTH levels. Recursive functions, which can reach
+// themselves through calls, are only inlined into the code of the caller
+// itself, so that their expansion stops at one level. Direct recursion of
+// the caller is left as calls.
+// This runs before the other passes, which then specialize the copies for
+// their args.
+
+// Callees of at most this cost are inlined
+#define INLINE_COST_LIMIT 20
+// ... or of this if they are declared inline or static ones called once
+#define INLINE_COST_LIMIT_OF_HINTED 80
+#define MAX_INLINE_DEPTH 4
+#define MAX_RECURSIVE_INLINE_DEPTH 1
+// Nothing is inlined into functions growing beyond this cost
+#define MAX_COST_OF_INLINING_FUNC 600
+
+static struct IRFunc **inline_bodies;
+static int num_of_inline_bodies;
+static bool *is_recursive_body;
+
+static int GetInlineCost(struct IRFunc *f) {
+  // Approximates the number of instructions of f. Copies are mostly
+  // coalesced, and consts and local addresses are folded into operands.
+  int cost = 0;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      enum IROp op = b->insts[k].op;
+      if (op != kIRParam && op != kIRConst && op != kIRCopy && op != kIRPhi &&
+          op != kIRLocalAddr && op != kIRJump) {
+        cost++;
+      }
+    }
+  }
+  return cost;
+}
+
+static bool IsIRFuncOf(struct IRFunc *f, const char *symbol) {
+  return IsEqualTokenWithCStr(f->func_def->func_name_token, symbol);
+}
+
+static int FindInlineBody(const char *symbol) {
+  // Returns the index of the body of the function, or -1
+  for (int i = 0; i < num_of_inline_bodies; i++) {
+    if (IsIRFuncOf(inline_bodies[i], symbol)) return i;
+  }
+  return -1;
+}
+
+static bool CanReachFunc(int from, int to, bool *is_visited) {
+  // Returns true if body from calls body to, directly or through others
+  if (is_visited[from]) return false;
+  is_visited[from] = true;
+  struct IRFunc *f = inline_bodies[from];
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      if (inst->op != kIRCall || !inst->symbol || inst->is_external) continue;
+      int callee = FindInlineBody(inst->symbol);
+      if (callee == to ||
+          (callee >= 0 && CanReachFunc(callee, to, is_visited))) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static int CountRefsOfFunc(const char *symbol) {
+  // Counts calls and address references of the function in the unit
+  int count = 0;
+  for (int i = 0; i < num_of_inline_bodies; i++) {
+    struct IRFunc *f = inline_bodies[i];
+    for (int k = 0; k < f->num_of_blocks; k++) {
+      struct IRBlock *b = f->blocks[k];
+      for (int j = 0; j < b->num_of_insts; j++) {
+        struct IRInst *inst = &b->insts[j];
+        if ((inst->op == kIRCall || inst->op == kIRGlobalAddr) &&
+            inst->symbol && strcmp(inst->symbol, symbol) == 0) {
+          count++;
+        }
+      }
+    }
+  }
+  return count;
+}
+
+static bool IsInlinable(struct IRInst *call, int index, int cost_of_caller) {
+  struct IRFunc *callee = inline_bodies[index];
+  struct Node *func_def = callee->func_def;
+  int max_depth = is_recursive_body[index] ? MAX_RECURSIVE_INLINE_DEPTH
+                                           : MAX_INLINE_DEPTH;
+  if (call->inline_depth >= max_depth || callee->blocks[0]->num_of_preds) {
+    return false;
+  }
+  // Variadic functions end their params with the token "..."
+  struct Node *arg_types = GetArgTypeList(func_def->func_type);
+  int num_of_params = GetSizeOfList(arg_types);
+  if (num_of_params && IsToken(GetNodeAt(arg_types, num_of_params - 1))) {
+    return false;
+  }
+  // Params without names, like the one of f(void), are not read
+  for (int i = 0; i < GetSizeOfList(func_def->arg_var_list); i++) {
+    if (GetNodeAt(func_def->arg_var_list, i) && i >= call->num_of_srcs) {
+      return false;
+    }
+  }
+  int cost = GetInlineCost(callee);
+  if (cost_of_caller + cost > MAX_COST_OF_INLINING_FUNC) return false;
+  bool is_hinted = func_def->is_inline ||
+                   (func_def->is_static && CountRefsOfFunc(call->symbol) == 1);
+  return cost <= (is_hinted ? INLINE_COST_LIMIT_OF_HINTED : INLINE_COST_LIMIT);
+}
+
+static void InsertIRBlocksAfter(struct IRBlock *b, struct IRBlock **list,
+                                int n) {
+  // Places the blocks in list after b in the layout. Edges are not updated.
+  if (func->num_of_blocks + n > func->capacity) {
+    func->capacity = (func->num_of_blocks + n) * 2;
+    func->blocks =
+        realloc(func->blocks, func->capacity * sizeof(struct IRBlock *));
+    assert(func->blocks);
+  }
+  int index = b->id + 1;
+  for (int i = func->num_of_blocks - 1; i >= index; i--) {
+    func->blocks[i + n] = func->blocks[i];
+  }
+  for (int i = 0; i < n; i++) func->blocks[index + i] = list[i];
+  func->num_of_blocks += n;
+  for (int i = index; i < func->num_of_blocks; i++) func->blocks[i]->id = i;
+}
+
+static void AddIRBlockPred(struct IRBlock *b, struct IRBlock *pred) {
+  b->preds = realloc(b->preds, (b->num_of_preds + 1) * sizeof(*b->preds));
+  assert(b->preds);
+  b->preds[b->num_of_preds++] = pred;
+}
+
+static void CopyIRInstForInline(struct IRBlock *to, struct IRInst *src,
+                                int vreg_base, int frame_base,
+                                struct IRBlock **copies, struct IRInst *call) {
+  // Registers of the callee are numbered from vreg_base in the caller
+  struct IRInst *inst = InsertIRInst(to, to->num_of_insts, kIRJump, 0, 0);
+  *inst = *src;
+  inst->dst = src->dst ? vreg_base + src->dst : 0;
+  inst->srcs = malloc(src->num_of_srcs * sizeof(int));
+  for (int s = 0; s < src->num_of_srcs; s++) {
+    inst->srcs[s] = vreg_base + src->srcs[s];
+  }
+  for (int t = 0; t < 2; t++) {
+    if (src->targets[t]) inst->targets[t] = copies[src->targets[t]->id];
+  }
+  if (src->op == kIRParam) {
+    inst->op = kIRCopy;
+    inst->num_of_srcs = 1;
+    inst->srcs = malloc(sizeof(int));
+    inst->srcs[0] = call->srcs[src->imm];
+    inst->imm = 0;
+  } else if (src->op == kIRLocalAddr) {
+    inst->imm += frame_base;
+  } else if (src->op == kIRCall) {
+    inst->inline_depth = call->inline_depth + 1;
+  }
+}
+
+static void InlineCall(struct IRBlock *b, int index, struct IRFunc *callee) {
+  struct IRInst call = b->insts[index];
+  int vreg_base = func->num_of_vregs - 1;
+  func->num_of_vregs += callee->num_of_vregs - 1;
+  // Local vars of the callee are placed below those of the caller
+  int frame_base = (func->stack_size + 15) & ~15;
+  if (callee->stack_size) func->stack_size = frame_base + callee->stack_size;
+  struct IRBlock *rest = calloc(1, sizeof(struct IRBlock));
+  rest->is_reachable = true;
+  for (int k = index + 1; k < b->num_of_insts; k++) {
+    *InsertIRInst(rest, rest->num_of_insts, kIRJump, 0, 0) = b->insts[k];
+  }
+  rest->num_of_succs = b->num_of_succs;
+  for (int k = 0; k < b->num_of_succs; k++) {
+    struct IRBlock *s = b->succs[k];
+    rest->succs[k] = s;
+    for (int p = 0; p < s->num_of_preds; p++) {
+      if (s->preds[p] == b) s->preds[p] = rest;
+    }
+  }
+  int n = callee->num_of_blocks;
+  struct IRBlock **copies = malloc((n + 1) * sizeof(struct IRBlock *));
+  for (int i = 0; i < n; i++) copies[i] = calloc(1, sizeof(struct IRBlock));
+  copies[n] = rest;
+  struct IRInst **defs = calloc(callee->num_of_vregs, sizeof(struct IRInst *));
+  for (int i = 0; i < n; i++) {
+    struct IRBlock *from = callee->blocks[i];
+    for (int k = 0; k < from->num_of_insts; k++) {
+      if (from->insts[k].dst) defs[from->insts[k].dst] = &from->insts[k];
+    }
+  }
+  int *values = malloc(n * sizeof(int));  // returned in preds of rest
+  for (int i = 0; i < n; i++) {
+    struct IRBlock *from = callee->blocks[i];
+    struct IRBlock *to = copies[i];
+    to->is_reachable = true;
+    to->is_loop_header = from->is_loop_header;
+    to->num_of_preds = from->num_of_preds;
+    to->preds = malloc(from->num_of_preds * sizeof(struct IRBlock *));
+    for (int p = 0; p < from->num_of_preds; p++) {
+      to->preds[p] = copies[from->preds[p]->id];
+    }
+    to->num_of_succs = from->num_of_succs;
+    for (int s = 0; s < from->num_of_succs; s++) {
+      to->succs[s] = copies[from->succs[s]->id];
+    }
+    for (int k = 0; k < from->num_of_insts; k++) {
+      struct IRInst *src = &from->insts[k];
+      if (src->op != kIRReturn) {
+        CopyIRInstForInline(to, src, vreg_base, frame_base, copies, &call);
+        continue;
+      }
+      // The value is truncated to the return type as the call does
+      int value = src->num_of_srcs ? vreg_base + src->srcs[0] : 0;
+      if (call.size && !value) {
+        value = NewIRVReg(func);
+        InsertIRInst(to, to->num_of_insts, kIRConst, value, 0);
+      } else if (call.size == 4 &&
+                 GetSignExtendedSizeOfIRInst(defs[src->srcs[0]]) > 4) {
+        struct IRInst *sext =
+            InsertIRInst(to, to->num_of_insts, kIRSext, NewIRVReg(func), 1);
+        sext->srcs[0] = value;
+        sext->size = 4;
+        value = sext->dst;
+      }
+      values[rest->num_of_preds] = value;
+      InsertIRInst(to, to->num_of_insts, kIRJump, 0, 0)->targets[0] = rest;
+      to->num_of_succs = 1;
+      to->succs[0] = rest;
+      AddIRBlockPred(rest, to);
+    }
+  }
+  // The result of the call is defined at the top of the rest
+  struct IRInst *result;
+  if (!call.size || !rest->num_of_preds) {
+    result = InsertIRInst(rest, 0, kIRConst, call.dst, 0);
+  } else if (rest->num_of_preds == 1) {
+    result = InsertIRInst(rest, 0, kIRCopy, call.dst, 1);
+  } else {
+    result = InsertIRInst(rest, 0, kIRPhi, call.dst, rest->num_of_preds);
+  }
+  for (int s = 0; s < result->num_of_srcs; s++) result->srcs[s] = values[s];
+  b->num_of_insts = index;
+  InsertIRInst(b, index, kIRJump, 0, 0)->targets[0] = copies[0];
+  b->num_of_succs = 1;
+  b->succs[0] = copies[0];
+  AddIRBlockPred(copies[0], b);
+  InsertIRBlocksAfter(b, copies, n + 1);
+}
+
+void InlineIRCalls(struct IRFunc *f, struct IRFunc **bodies,
+                   int num_of_bodies) {
+  // bodies: IR of the whole bodies of the functions in this unit, in SSA
+  // form. They are not modified.
+  func = f;
+  inline_bodies = bodies;
+  num_of_inline_bodies = num_of_bodies;
+  is_recursive_body = calloc(num_of_bodies, sizeof(bool));
+  for (int i = 0; i < num_of_bodies; i++) {
+    bool *is_visited = calloc(num_of_bodies, sizeof(bool));
+    is_recursive_body[i] = CanReachFunc(i, i, is_visited);
+  }
+  int cost = GetInlineCost(f);
+  // Copies are placed after the block of the call, so calls in them are
+  // visited later in this loop.
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      if (inst->op != kIRCall || !inst->symbol || inst->is_external ||
+          IsIRFuncOf(f, inst->symbol)) {
+        continue;
+      }
+      int index = FindInlineBody(inst->symbol);
+      if (index < 0 || !IsInlinable(inst, index, cost)) continue;
+      cost += GetInlineCost(inline_bodies[index]);
+      InlineCall(b, k, inline_bodies[index]);
+      break;
+    }
+  }
+}
+
+// Sparse conditional constant propagation (Wegman and Zadeck).
+// Each register has a lattice value: kLatticeTop is not evaluated yet,
+// kLatticeConst is a known constant and kLatticeBottom is variable. Only
+// edges found executable are followed, so values which only flow from
+// branches never taken are still folded.
+
+enum LatticeState {
+  kLatticeTop,
+  kLatticeConst,
+  kLatticeBottom,
+};
+
+struct IRUse {
+  struct IRBlock *block;
+  int index;
+};
+
+static enum LatticeState *lattice_states;
+static long *lattice_values;
+static struct IRUse **uses_of_vreg;
+static int *num_of_uses_of_vreg;
+static bool *is_block_executable;
+static bool **is_edge_executable;  // [block id][pred index]
+static struct IRUse *edge_worklist;  // block and its pred index
+static int num_of_edge_work;
+static int *vreg_worklist;
+static int num_of_vreg_work;
+
+static void CollectUses(void) {
+  uses_of_vreg = calloc(func->num_of_vregs, sizeof(struct IRUse *));
+  num_of_uses_of_vreg = calloc(func->num_of_vregs, sizeof(int));
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      for (int s = 0; s < inst->num_of_srcs; s++) {
+        int v = inst->srcs[s];
+        uses_of_vreg[v] =
+            realloc(uses_of_vreg[v],
+                    (num_of_uses_of_vreg[v] + 1) * sizeof(struct IRUse));
+        assert(uses_of_vreg[v]);
+        uses_of_vreg[v][num_of_uses_of_vreg[v]].block = b;
+        uses_of_vreg[v][num_of_uses_of_vreg[v]].index = k;
+        num_of_uses_of_vreg[v]++;
+      }
+    }
+  }
+}
+
+static void SetLatticeValue(int vreg, enum LatticeState state, long value) {
+  // Values only go down the lattice
+  if (lattice_states[vreg] == state &&
+      (state != kLatticeConst || lattice_values[vreg] == value)) {
+    return;
+  }
+  if (lattice_states[vreg] == kLatticeConst && state == kLatticeConst) {
+    state = kLatticeBottom;
+  }
+  if (lattice_states[vreg] == kLatticeBottom) return;
+  lattice_states[vreg] = state;
+  lattice_values[vreg] = value;
+  vreg_worklist[num_of_vreg_work++] = vreg;
+}
+
+static void MarkEdgeExecutable(struct IRBlock *from, struct IRBlock *to) {
+  for (int p = 0; p < to->num_of_preds; p++) {
+    if (to->preds[p] != from || is_edge_executable[to->id][p]) continue;
+    is_edge_executable[to->id][p] = true;
+    edge_worklist[num_of_edge_work].block = to;
+    edge_worklist[num_of_edge_work].index = p;
+    num_of_edge_work++;
+  }
+}
+
+static bool EvalBinaryIROp(enum IROp op, long l, long r, long *result) {
+  // Folds the operation as the generated code computes it on 64-bit
+  // registers. Returns false if it can not be folded.
+  if (op == kIRAdd) {
+    *result = (long)((unsigned long)l + (unsigned long)r);
+  } else if (op == kIRSub) {
+    *result = (long)((unsigned long)l - (unsigned long)r);
+  } else if (op == kIRMul) {
+    *result = (long)((unsigned long)l * (unsigned long)r);
+  } else if (op == kIRDiv || op == kIRMod) {
+    if (r == 0 || (r == -1 && l == (long)(1UL << 63))) return false;
+    *result = op == kIRDiv ? l / r : l % r;
+  } else if (op == kIRShl) {
+    *result = (long)((unsigned long)l << (r & 63));
+  } else if (op == kIRSar) {
+    *result = l >> (r & 63);
+  } else if (op == kIRAnd) {
+    *result = l & r;
+  } else if (op == kIROr) {
+    *result = l | r;
+  } else if (op == kIRXor) {
+    *result = l ^ r;
+  } else if (op == kIREq) {
+    *result = l == r;
+  } else if (op == kIRNe) {
+    *result = l != r;
+  } else if (op == kIRLt) {
+    *result = l < r;
+  } else if (op == kIRLe) {
+    *result = l <= r;
+  } else if (op == kIRGt) {
+    *result = l > r;
+  } else if (op == kIRGe) {
+    *result = l >= r;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void VisitPhiNode(struct IRBlock *b, struct IRInst *phi) {
+  enum LatticeState state = kLatticeTop;
+  long value = 0;
+  for (int p = 0; p < phi->num_of_srcs; p++) {
+    if (!is_edge_executable[b->id][p]) continue;
+    int src = phi->srcs[p];
+    if (lattice_states[src] == kLatticeTop) continue;
+    if (lattice_states[src] == kLatticeBottom ||
+        (state == kLatticeConst && value != lattice_values[src])) {
+      state = kLatticeBottom;
+      break;
+    }
+    state = kLatticeConst;
+    value = lattice_values[src];
+  }
+  SetLatticeValue(phi->dst, state, value);
+}
+
+static void VisitIRInst(struct IRBlock *b, struct IRInst *inst) {
+  if (inst->op == kIRPhi) {
+    VisitPhiNode(b, inst);
+    return;
+  }
+  if (inst->op == kIRJump) {
+    MarkEdgeExecutable(b, inst->targets[0]);
+    return;
+  }
+  if (inst->op == kIRBranch) {
+    int cond = inst->srcs[0];
+    if (lattice_states[cond] == kLatticeTop) return;
+    if (lattice_states[cond] == kLatticeBottom || lattice_values[cond]) {
+      MarkEdgeExecutable(b, inst->targets[0]);
+    }
+    if (lattice_states[cond] == kLatticeBottom || !lattice_values[cond]) {
+      MarkEdgeExecutable(b, inst->targets[1]);
+    }
+    return;
+  }
+  if (!inst->dst) return;
+  if (inst->op == kIRConst) {
+    SetLatticeValue(inst->dst, kLatticeConst, inst->imm);
+    return;
+  }
+  bool is_foldable =
+      inst->op == kIRCopy || inst->op == kIRSext || inst->op == kIRNeg ||
+      inst->op == kIRNot || (kIRAdd <= inst->op && inst->op <= kIRGe);
+  if (!is_foldable) {
+    SetLatticeValue(inst->dst, kLatticeBottom, 0);
+    return;
+  }
+  long v[2];
+  for (int s = 0; s < inst->num_of_srcs; s++) {
+    int src = inst->srcs[s];
+    if (lattice_states[src] == kLatticeTop) return;
+    if (lattice_states[src] == kLatticeBottom) {
+      SetLatticeValue(inst->dst, kLatticeBottom, 0);
+      return;
+    }
+    v[s] = lattice_values[src];
+  }
+  long result;
+  if (inst->op == kIRCopy) {
+    result = v[0];
+  } else if (inst->op == kIRSext) {
+    result = inst->size == 4 ? (long)(int)v[0] : (long)(signed char)v[0];
+  } else if (inst->op == kIRNeg) {
+    result = (long)(0UL - (unsigned long)v[0]);
+  } else if (inst->op == kIRNot) {
+    result = ~v[0];
+  } else if (!EvalBinaryIROp(inst->op, v[0], v[1], &result)) {
+    SetLatticeValue(inst->dst, kLatticeBottom, 0);
+    return;
+  }
+  SetLatticeValue(inst->dst, kLatticeConst, result);
+}
+
+static void PropagateLatticeValues(void) {
+  int n = func->num_of_blocks;
+  int num_of_edges = 0;
+  for (int i = 0; i < n; i++) num_of_edges += func->blocks[i]->num_of_preds;
+  lattice_states = calloc(func->num_of_vregs, sizeof(enum LatticeState));
+  lattice_values = calloc(func->num_of_vregs, sizeof(long));
+  is_block_executable = calloc(n, sizeof(bool));
+  is_edge_executable = malloc(n * sizeof(bool *));
+  for (int i = 0; i < n; i++) {
+    is_edge_executable[i] = calloc(func->blocks[i]->num_of_preds, sizeof(bool));
+  }
+  edge_worklist = malloc((num_of_edges + 1) * sizeof(struct IRUse));
+  num_of_edge_work = 0;
+  // Each register is pushed at most twice, on going to const and bottom
+  vreg_worklist = malloc(func->num_of_vregs * 2 * sizeof(int));
+  num_of_vreg_work = 0;
+  // The entry block is reached by the edge from the caller
+  edge_worklist[num_of_edge_work].block = func->blocks[0];
+  edge_worklist[num_of_edge_work].index = -1;
+  num_of_edge_work++;
+  while (num_of_edge_work || num_of_vreg_work) {
+    if (num_of_edge_work) {
+      struct IRUse edge = edge_worklist[--num_of_edge_work];
+      struct IRBlock *b = edge.block;
+      if (is_block_executable[b->id]) {
+        // Only phi nodes can be affected by another edge
+        for (int k = 0; k < b->num_of_insts && b->insts[k].op == kIRPhi;
+             k++) {
+          VisitPhiNode(b, &b->insts[k]);
+        }
+        continue;
+      }
+      is_block_executable[b->id] = true;
+      for (int k = 0; k < b->num_of_insts; k++) {
+        VisitIRInst(b, &b->insts[k]);
+      }
+      continue;
+    }
+    int vreg = vreg_worklist[--num_of_vreg_work];
+    for (int i = 0; i < num_of_uses_of_vreg[vreg]; i++) {
+      struct IRUse *use = &uses_of_vreg[vreg][i];
+      if (!is_block_executable[use->block->id]) continue;
+      VisitIRInst(use->block, &use->block->insts[use->index]);
+    }
+  }
+}
+
+static void ReplaceWithConst(struct IRInst *inst, long value) {
+  inst->op = kIRConst;
+  inst->imm = value;
+  inst->num_of_srcs = 0;
+  inst->size = 0;
+  inst->symbol = NULL;
+}
+
+static void RewriteWithLatticeValues(void) {
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    if (!is_block_executable[i]) continue;
+    bool has_folded_phi = false;
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      if (inst->op == kIRBranch &&
+          lattice_states[inst->srcs[0]] == kLatticeConst) {
+        // The edge never taken is removed by RemoveUnreachableIRBlocks()
+        if (!lattice_values[inst->srcs[0]]) inst->targets[0] = inst->targets[1];
+        inst->targets[1] = NULL;
+        inst->op = kIRJump;
+        inst->num_of_srcs = 0;
+        continue;
+      }
+      if (!inst->dst || inst->op == kIRConst ||
+          lattice_states[inst->dst] != kLatticeConst) {
+        continue;
+      }
+      if (inst->op == kIRPhi) has_folded_phi = true;
+      ReplaceWithConst(inst, lattice_values[inst->dst]);
+    }
+    if (has_folded_phi) PartitionPhiNodes(b);
+  }
+}
+
+static void PropagateConstants(struct IRFunc *f) {
+  func = f;
+  CollectUses();
+  PropagateLatticeValues();
+  RewriteWithLatticeValues();
+  RemoveUnreachableIRBlocks(f);
+  EliminateDeadIRInsts(f);
+}
+
+static void MergeStraightLineBlocks(void) {
+  // Appends a block to its only pred if the pred jumps to it
+  // unconditionally. Folded branches often leave such chains of blocks.
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *a = func->blocks[i];
+    if (!a->is_reachable) continue;
+    for (;;) {
+      struct IRInst *last = &a->insts[a->num_of_insts - 1];
+      struct IRBlock *b = last->targets[0];
+      if (last->op != kIRJump || b == a || b->num_of_preds != 1 ||
+          b->insts[0].op == kIRPhi) {
+        break;
+      }
+      a->num_of_insts--;
+      for (int k = 0; k < b->num_of_insts; k++) {
+        *InsertIRInst(a, a->num_of_insts, kIRJump, 0, 0) = b->insts[k];
+      }
+      a->num_of_succs = b->num_of_succs;
+      for (int k = 0; k < b->num_of_succs; k++) {
+        struct IRBlock *s = b->succs[k];
+        a->succs[k] = s;
+        for (int p = 0; p < s->num_of_preds; p++) {
+          if (s->preds[p] == b) s->preds[p] = a;
+        }
+      }
+      b->is_reachable = false;
+    }
+  }
+  RemoveUnreachableIRBlocks(func);
+}
+
+// Copy propagation and common subexpression elimination.
+// Uses of a register are replaced with another register holding the same
+// value: the source of a copy, or the result of the same computation in a
+// dominating block. The replaced insts are removed as dead code.
+
+static void ReplaceVRegs(int *replacement) {
+  // replacement[v] can be replaced again
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      for (int s = 0; s < inst->num_of_srcs; s++) {
+        int v = inst->srcs[s];
+        while (replacement[v] != v) v = replacement[v];
+        inst->srcs[s] = v;
+      }
+    }
+  }
+}
+
+static int *AllocReplacement(void) {
+  int *replacement = malloc(func->num_of_vregs * sizeof(int));
+  for (int v = 0; v < func->num_of_vregs; v++) replacement[v] = v;
+  return replacement;
+}
+
+static void PropagateCopies(void) {
+  int *replacement = AllocReplacement();
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      if (inst->op == kIRCopy) replacement[inst->dst] = inst->srcs[0];
+    }
+  }
+  ReplaceVRegs(replacement);
+  EliminateDeadIRInsts(func);
+}
+
+static struct IRBlock **idom;
+
+static bool Dominates(struct IRBlock *a, struct IRBlock *b) {
+  while (b != a && idom[b->id] != b) b = idom[b->id];
+  return b == a;
+}
+
+static bool IsSameIRValue(struct IRInst *a, struct IRInst *b) {
+  if (a->op != b->op || a->size != b->size || a->imm != b->imm ||
+      a->node != b->node || a->num_of_srcs != b->num_of_srcs) {
+    return false;
+  }
+  if (a->symbol != b->symbol &&
+      (!a->symbol || !b->symbol || strcmp(a->symbol, b->symbol) != 0)) {
+    return false;
+  }
+  for (int s = 0; s < a->num_of_srcs; s++) {
+    if (a->srcs[s] != b->srcs[s]) return false;
+  }
+  return true;
+}
+
+static unsigned long GetHashOfIRValue(struct IRInst *inst) {
+  unsigned long hash = inst->op * 31UL + inst->imm;
+  for (int s = 0; s < inst->num_of_srcs; s++) {
+    hash = hash * 31 + inst->srcs[s];
+  }
+  return hash;
+}
+
+static void EliminateCommonSubexpressions(void) {
+  // Blocks are visited in their order, which places most dominators first
+  int num_of_insts = 0;
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    num_of_insts += func->blocks[i]->num_of_insts;
+  }
+  int table_size = 64;
+  while (table_size < num_of_insts * 2) table_size *= 2;
+  int *heads = malloc(table_size * sizeof(int));
+  for (int i = 0; i < table_size; i++) heads[i] = -1;
+  struct IRInst **entries = malloc(num_of_insts * sizeof(struct IRInst *));
+  struct IRBlock **entry_blocks =
+      malloc(num_of_insts * sizeof(struct IRBlock *));
+  int *next_entries = malloc(num_of_insts * sizeof(int));
+  int num_of_entries = 0;
+  int *replacement = AllocReplacement();
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      enum IROp op = inst->op;
+      if (!inst->dst || op == kIRParam || op == kIRPhi || op == kIRLoad ||
+          op == kIRCall) {
+        continue;
+      }
+      for (int s = 0; s < inst->num_of_srcs; s++) {
+        inst->srcs[s] = replacement[inst->srcs[s]];
+      }
+      int bucket = GetHashOfIRValue(inst) & (table_size - 1);
+      int e = heads[bucket];
+      while (e >= 0 && (!IsSameIRValue(entries[e], inst) ||
+                        !Dominates(entry_blocks[e], b))) {
+        e = next_entries[e];
+      }
+      if (e >= 0) {
+        replacement[inst->dst] = entries[e]->dst;
+        continue;
+      }
+      entries[num_of_entries] = inst;
+      entry_blocks[num_of_entries] = b;
+      next_entries[num_of_entries] = heads[bucket];
+      heads[bucket] = num_of_entries++;
+    }
+  }
+  ReplaceVRegs(replacement);
+  EliminateDeadIRInsts(func);
+}
+
+// Loop-invariant code motion.
+// Loops are found from back edges to their headers, and processed from
+// inner ones. Insts whose sources are defined outside of a loop, or by
+// other invariant insts, are moved to the end of the preheader: the only
+// block outside of the loop which jumps to the header. Rotated loops only
+// reach the preheader when the body runs at least once.
+
+static struct IRInst **defs_of_vregs;
+static int *def_block_ids;  // indexed by registers, -1 if not defined
+static bool *is_in_loop;    // indexed by block ids
+static struct IRBlock **loop_blocks;
+static int num_of_loop_blocks;
+
+static int CollectLoopBlocks(struct IRBlock *header) {
+  // Marks blocks which reach a back edge to header without passing it.
+  // Returns the number of the blocks, or 0 if header is not a loop header.
+  for (int i = 0; i < func->num_of_blocks; i++) is_in_loop[i] = false;
+  num_of_loop_blocks = 0;
+  for (int p = 0; p < header->num_of_preds; p++) {
+    struct IRBlock *latch = header->preds[p];
+    if (!Dominates(header, latch)) continue;
+    if (!is_in_loop[header->id]) {
+      is_in_loop[header->id] = true;
+      loop_blocks[num_of_loop_blocks++] = header;
+    }
+    if (is_in_loop[latch->id]) continue;
+    is_in_loop[latch->id] = true;
+    int begin = num_of_loop_blocks;
+    loop_blocks[num_of_loop_blocks++] = latch;
+    while (begin < num_of_loop_blocks) {
+      struct IRBlock *b = loop_blocks[begin++];
+      for (int k = 0; k < b->num_of_preds; k++) {
+        struct IRBlock *pred = b->preds[k];
+        if (is_in_loop[pred->id]) continue;
+        is_in_loop[pred->id] = true;
+        loop_blocks[num_of_loop_blocks++] = pred;
+      }
+    }
+  }
+  return num_of_loop_blocks;
+}
+
+static void InsertIRBlockBefore(struct IRBlock *b, struct IRBlock *next) {
+  // Places b before next in the layout. Edges are not updated.
+  if (func->num_of_blocks == func->capacity) {
+    func->capacity = func->capacity * 2 + 8;
+    func->blocks =
+        realloc(func->blocks, func->capacity * sizeof(struct IRBlock *));
+    assert(func->blocks);
+  }
+  int index = next->id;
+  for (int i = func->num_of_blocks; i > index; i--) {
+    func->blocks[i] = func->blocks[i - 1];
+    func->blocks[i]->id = i;
+  }
+  func->blocks[index] = b;
+  b->id = index;
+  func->num_of_blocks++;
+}
+
+static struct IRBlock *GetPreheader(struct IRBlock *header,
+                                    bool *is_cfg_changed) {
+  // Returns NULL if the loop is entered from more than one block.
+  // Otherwise, a block is inserted before header if the block entering
+  // the loop also branches elsewhere.
+  struct IRBlock *entering = NULL;
+  int entering_pred_index = 0;
+  for (int p = 0; p < header->num_of_preds; p++) {
+    if (is_in_loop[header->preds[p]->id]) continue;
+    if (entering) return NULL;
+    entering = header->preds[p];
+    entering_pred_index = p;
+  }
+  *is_cfg_changed = false;
+  if (!entering) return NULL;
+  if (entering->num_of_succs == 1) return entering;
+  struct IRBlock *preheader = calloc(1, sizeof(struct IRBlock));
+  InsertIRInst(preheader, 0, kIRJump, 0, 0)->targets[0] = header;
+  struct IRInst *last = &entering->insts[entering->num_of_insts - 1];
+  for (int i = 0; i < 2; i++) {
+    if (last->targets[i] == header) last->targets[i] = preheader;
+  }
+  header->preds[entering_pred_index] = preheader;
+  InsertIRBlockBefore(preheader, header);
+  RemoveUnreachableIRBlocks(func);
+  *is_cfg_changed = true;
+  return preheader;
+}
+
+static bool IsSameRootOfAddr(struct IRInst *a, struct IRInst *b) {
+  if (a->op != b->op) return false;
+  if (a->op == kIRLocalAddr) return a->imm == b->imm;
+  return strcmp(a->symbol, b->symbol) == 0;
+}
+
+static struct IRInst *GetRootOfAddr(int addr, long *ofs, bool *is_ofs_known,
+                                    int depth) {
+  // Returns the LocalAddr or GlobalAddr inst of the object which addr points
+  // into, or NULL if it is not known. *ofs is the offset in the object.
+  struct IRInst *def = defs_of_vregs[addr];
+  if (!def || depth > 16) return NULL;
+  if (def->op == kIRLocalAddr || def->op == kIRGlobalAddr) return def;
+  if (def->op == kIRCopy) {
+    return GetRootOfAddr(def->srcs[0], ofs, is_ofs_known, depth + 1);
+  }
+  if (def->op != kIRAdd && def->op != kIRSub) return NULL;
+  struct IRInst *r = defs_of_vregs[def->srcs[1]];
+  if (r && r->op == kIRConst) {
+    *ofs += def->op == kIRAdd ? r->imm : -r->imm;
+    return GetRootOfAddr(def->srcs[0], ofs, is_ofs_known, depth + 1);
+  }
+  *is_ofs_known = false;
+  struct IRInst *root =
+      GetRootOfAddr(def->srcs[0], ofs, is_ofs_known, depth + 1);
+  if (root || def->op == kIRSub) return root;
+  return GetRootOfAddr(def->srcs[1], ofs, is_ofs_known, depth + 1);
+}
+
+static bool MayAlias(int addr0, int size0, int addr1, int size1) {
+  // Accesses through different vars never overlap
+  long ofs0 = 0;
+  long ofs1 = 0;
+  bool is_ofs0_known = true;
+  bool is_ofs1_known = true;
+  struct IRInst *root0 = GetRootOfAddr(addr0, &ofs0, &is_ofs0_known, 0);
+  struct IRInst *root1 = GetRootOfAddr(addr1, &ofs1, &is_ofs1_known, 0);
+  if (!root0 || !root1) return true;
+  if (!IsSameRootOfAddr(root0, root1)) return false;
+  if (!is_ofs0_known || !is_ofs1_known) return true;
+  return ofs0 < ofs1 + size1 && ofs1 < ofs0 + size0;
+}
+
+static bool IsLoadInvariant(struct IRBlock *b, struct IRInst *load) {
+  // The load should run in every iteration which leaves the loop, so that
+  // hoisting it does not read memory which the loop would not read.
+  for (int i = 0; i < num_of_loop_blocks; i++) {
+    struct IRBlock *exiting = loop_blocks[i];
+    for (int k = 0; k < exiting->num_of_succs; k++) {
+      if (is_in_loop[exiting->succs[k]->id]) continue;
+      if (!Dominates(b, exiting)) return false;
+    }
+  }
+  for (int i = 0; i < num_of_loop_blocks; i++) {
+    struct IRBlock *lb = loop_blocks[i];
+    for (int k = 0; k < lb->num_of_insts; k++) {
+      struct IRInst *inst = &lb->insts[k];
+      if (inst->op == kIRCall || inst->op == kIRMemset ||
+          inst->op == kIRMemcpy) {
+        return false;
+      }
+      if (inst->op != kIRStore) continue;
+      if (MayAlias(inst->srcs[0], inst->size, load->srcs[0], load->size)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static bool IsHoistable(struct IRBlock *b, struct IRInst *inst) {
+  // Consts stay folded into their uses as immediates when lowered
+  enum IROp op = inst->op;
+  if (op == kIRConst || op == kIRLocalAddr || op == kIRGlobalAddr ||
+      op == kIRStringAddr || op == kIRCopy ||
+      op == kIRSext || op == kIRNeg || op == kIRNot ||
+      (kIRAdd <= op && op <= kIRGe && op != kIRDiv && op != kIRMod)) {
+    return true;
+  }
+  if (op == kIRDiv || op == kIRMod) {
+    // Division may trap unless the divisor is a const other than 0 and -1
+    struct IRInst *divisor = defs_of_vregs[inst->srcs[1]];
+    return divisor && divisor->op == kIRConst && divisor->imm != 0 &&
+           divisor->imm != -1;
+  }
+  if (op == kIRLoad) return IsLoadInvariant(b, inst);
+  return false;
+}
+
+static void CollectDefsOfVRegs(void) {
+  // Pointers to the defs are invalidated by inserting or removing insts
+  int n = func->num_of_vregs;
+  defs_of_vregs = calloc(n, sizeof(struct IRInst *));
+  def_block_ids = malloc(n * sizeof(int));
+  for (int v = 0; v < n; v++) def_block_ids[v] = -1;
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      int dst = b->insts[k].dst;
+      if (!dst) continue;
+      defs_of_vregs[dst] = &b->insts[k];
+      def_block_ids[dst] = b->id;
+    }
+  }
+}
+
+static bool IsDefinedOutsideOfLoop(int vreg) {
+  return def_block_ids[vreg] < 0 || !is_in_loop[def_block_ids[vreg]];
+}
+
+static void HoistLoopInvariants(struct IRBlock *preheader) {
+  int n = func->num_of_vregs;
+  CollectDefsOfVRegs();
+  // Finds invariants in the order of their dependencies
+  int *order = calloc(n, sizeof(int));
+  int num_of_invariants = 0;
+  bool is_changed = true;
+  while (is_changed) {
+    is_changed = false;
+    for (int i = 0; i < num_of_loop_blocks; i++) {
+      struct IRBlock *b = loop_blocks[i];
+      for (int k = 0; k < b->num_of_insts; k++) {
+        struct IRInst *inst = &b->insts[k];
+        if (!inst->dst || order[inst->dst]) continue;
+        bool is_invariant = true;
+        for (int s = 0; s < inst->num_of_srcs && is_invariant; s++) {
+          int src = inst->srcs[s];
+          is_invariant = IsDefinedOutsideOfLoop(src) || order[src];
+        }
+        if (!is_invariant || !IsHoistable(b, inst)) continue;
+        order[inst->dst] = ++num_of_invariants;
+        is_changed = true;
+      }
+    }
+  }
+  if (!num_of_invariants) return;
+  struct IRInst *hoisted = malloc(num_of_invariants * sizeof(struct IRInst));
+  for (int i = 0; i < num_of_loop_blocks; i++) {
+    struct IRBlock *b = loop_blocks[i];
+    int num_of_insts = 0;
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      if (inst->dst && order[inst->dst]) {
+        hoisted[order[inst->dst] - 1] = *inst;
+        continue;
+      }
+      b->insts[num_of_insts++] = *inst;
+    }
+    b->num_of_insts = num_of_insts;
+  }
+  for (int i = 0; i < num_of_invariants; i++) {
+    int index = preheader->num_of_insts - 1;
+    *InsertIRInst(preheader, index, kIRJump, 0, 0) = hoisted[i];
+  }
+}
+
+// Induction variable strength reduction.
+// A basic induction variable is a phi node in the loop header which is
+// incremented by a const in each iteration. Addresses base + i * scale
+// with an invariant base become pointers incremented along with i. If i
+// is then used only by exit tests, they compare the pointer instead.
+
+struct InductionVar {
+  int phi;   // value in the current iteration
+  int add;   // phi + step
+  int next;  // value for the next iteration: add or sext.4 of add
+  int init;  // value from the preheader
+  long step;
+};
+
+struct DerivedPointer {
+  int iv_index;
+  int base;
+  long scale;
+  int ptr;       // phi of the pointer
+  int ptr_next;  // value of the pointer for the next iteration
+};
+
+static int InsertIRConstAt(struct IRBlock *b, int index, long imm) {
+  int dst = NewIRVReg(func);
+  InsertIRInst(b, index, kIRConst, dst, 0)->imm = imm;
+  return dst;
+}
+
+static int InsertIRBinaryAt(struct IRBlock *b, int index, enum IROp op,
+                            int l, int r) {
+  int dst = NewIRVReg(func);
+  struct IRInst *inst = InsertIRInst(b, index, op, dst, 2);
+  inst->srcs[0] = l;
+  inst->srcs[1] = r;
+  return dst;
+}
+
+static int InsertIRScaledAt(struct IRBlock *b, int index, int base, int v,
+                            long scale) {
+  // Inserts base + v * scale, and returns the register of the value
+  struct IRInst *def = defs_of_vregs[v];
+  if (def && def->op == kIRConst) {
+    long ofs = def->imm * scale;
+    if (!ofs) return base;
+    return InsertIRBinaryAt(b, index + 1, kIRAdd, base,
+                            InsertIRConstAt(b, index, ofs));
+  }
+  int c = InsertIRConstAt(b, index, scale);
+  int mul = InsertIRBinaryAt(b, index + 1, kIRMul, v, c);
+  return InsertIRBinaryAt(b, index + 2, kIRAdd, base, mul);
+}
+
+static int FindIRInstOfDst(struct IRBlock *b, int dst) {
+  for (int k = 0; k < b->num_of_insts; k++) {
+    if (b->insts[k].dst == dst) return k;
+  }
+  assert(false);
+}
+
+static bool MatchInductionVar(struct IRInst *phi, int preheader_index,
+                              struct InductionVar *iv) {
+  iv->phi = phi->dst;
+  iv->init = phi->srcs[preheader_index];
+  iv->next = phi->srcs[1 - preheader_index];
+  struct IRInst *def = defs_of_vregs[iv->next];
+  // Signed int overflow is undefined, so sext.4 does not change the value
+  if (def && def->op == kIRSext && def->size == 4) {
+    def = defs_of_vregs[def->srcs[0]];
+  }
+  if (!def || (def->op != kIRAdd && def->op != kIRSub) ||
+      def->srcs[0] != phi->dst) {
+    return false;
+  }
+  struct IRInst *step = defs_of_vregs[def->srcs[1]];
+  if (!step || step->op != kIRConst) return false;
+  iv->add = def->dst;
+  iv->step = def->op == kIRAdd ? step->imm : -step->imm;
+  return true;
+}
+
+static bool MatchScaledIV(int v, struct InductionVar *ivs, int num_of_ivs,
+                          int *iv_index, long *scale) {
+  // Matches v = iv * scale
+  struct IRInst *mul = defs_of_vregs[v];
+  if (!mul || mul->op != kIRMul) return false;
+  for (int s = 0; s < 2; s++) {
+    struct IRInst *c = defs_of_vregs[mul->srcs[1 - s]];
+    if (!c || c->op != kIRConst) continue;
+    for (int i = 0; i < num_of_ivs; i++) {
+      if (ivs[i].phi != mul->srcs[s]) continue;
+      *iv_index = i;
+      *scale = c->imm;
+      return true;
+    }
+  }
+  return false;
+}
+
+static int *CountUsesOfVRegs(void) {
+  int *uses = calloc(func->num_of_vregs, sizeof(int));
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      for (int s = 0; s < inst->num_of_srcs; s++) uses[inst->srcs[s]]++;
+    }
+  }
+  return uses;
+}
+
+static void RewriteExitTests(struct InductionVar *iv, struct DerivedPointer *p,
+                             struct IRBlock *preheader) {
+  // Compares of iv->next with invariants are done on p->ptr_next, if they
+  // are all the uses of iv other than its own update.
+  int *uses = CountUsesOfVRegs();
+  if (uses[iv->phi] != 1 || (iv->add != iv->next && uses[iv->add] != 1)) {
+    return;
+  }
+  int num_of_compares = 0;
+  for (int i = 0; i < num_of_loop_blocks; i++) {
+    struct IRBlock *b = loop_blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      bool is_ordered = kIRLt <= inst->op && inst->op <= kIRGe;
+      if (!(kIREq <= inst->op && inst->op <= kIRGe) ||
+          inst->srcs[0] != iv->next) {
+        continue;
+      }
+      if (!IsDefinedOutsideOfLoop(inst->srcs[1]) ||
+          (is_ordered && p->scale <= 0) || !p->scale) {
+        return;
+      }
+      num_of_compares++;
+    }
+  }
+  // The other use is the phi of iv
+  if (!num_of_compares || uses[iv->next] != num_of_compares + 1) return;
+  for (int i = 0; i < num_of_loop_blocks; i++) {
+    struct IRBlock *b = loop_blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      if (!(kIREq <= inst->op && inst->op <= kIRGe) ||
+          inst->srcs[0] != iv->next) {
+        continue;
+      }
+      int limit = inst->srcs[1];
+      inst->srcs[0] = p->ptr_next;
+      inst->srcs[1] = InsertIRScaledAt(preheader, preheader->num_of_insts - 1,
+                                       p->base, limit, p->scale);
+      // insts of b are not moved since preheader is outside of the loop
+    }
+  }
+}
+
+static void ReduceInductionVars(struct IRBlock *header,
+                                struct IRBlock *preheader) {
+  if (header->num_of_preds != 2) return;
+  int preheader_index = header->preds[0] == preheader ? 0 : 1;
+  CollectDefsOfVRegs();
+  int num_of_ivs = 0;
+  struct InductionVar *ivs = NULL;
+  for (int k = 0; k < header->num_of_insts; k++) {
+    struct IRInst *phi = &header->insts[k];
+    if (phi->op != kIRPhi) break;
+    ivs = realloc(ivs, (num_of_ivs + 1) * sizeof(struct InductionVar));
+    if (MatchInductionVar(phi, preheader_index, &ivs[num_of_ivs])) {
+      num_of_ivs++;
+    }
+  }
+  // Finds base + iv * scale, grouped by the values of base and scale
+  int num_of_ptrs = 0;
+  struct DerivedPointer *ptrs = NULL;
+  int num_of_old_vregs = func->num_of_vregs;
+  int *ptr_of_vreg = malloc(num_of_old_vregs * sizeof(int));
+  for (int v = 0; v < num_of_old_vregs; v++) ptr_of_vreg[v] = -1;
+  for (int i = 0; i < num_of_loop_blocks; i++) {
+    struct IRBlock *b = loop_blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      if (inst->op != kIRAdd) continue;
+      for (int s = 0; s < 2; s++) {
+        struct DerivedPointer p;
+        p.base = inst->srcs[1 - s];
+        if (!IsDefinedOutsideOfLoop(p.base) ||
+            !MatchScaledIV(inst->srcs[s], ivs, num_of_ivs, &p.iv_index,
+                           &p.scale)) {
+          continue;
+        }
+        int index = 0;
+        while (index < num_of_ptrs &&
+               (ptrs[index].base != p.base ||
+                ptrs[index].iv_index != p.iv_index ||
+                ptrs[index].scale != p.scale)) {
+          index++;
+        }
+        if (index == num_of_ptrs) {
+          ptrs = realloc(ptrs, (num_of_ptrs + 1) * sizeof(p));
+          ptrs[num_of_ptrs++] = p;
+        }
+        ptr_of_vreg[inst->dst] = index;
+        break;
+      }
+    }
+  }
+  if (!num_of_ptrs) return;
+  // ptr = phi(base + init * scale, ptr_next), ptr_next = ptr + step * scale
+  for (int i = 0; i < num_of_ptrs; i++) {
+    struct DerivedPointer *p = &ptrs[i];
+    struct InductionVar *iv = &ivs[p->iv_index];
+    p->ptr = NewIRVReg(func);
+    int init = InsertIRScaledAt(preheader, preheader->num_of_insts - 1,
+                                p->base, iv->init, p->scale);
+    struct IRBlock *b = func->blocks[def_block_ids[iv->next]];
+    int index = FindIRInstOfDst(b, iv->next) + 1;
+    int step = InsertIRConstAt(b, index, iv->step * p->scale);
+    p->ptr_next = InsertIRBinaryAt(b, index + 1, kIRAdd, p->ptr, step);
+    struct IRInst *phi = InsertIRInst(header, 0, kIRPhi, p->ptr, 2);
+    phi->srcs[preheader_index] = init;
+    phi->srcs[1 - preheader_index] = p->ptr_next;
+    // Defs in blocks changed above are not used any more
+    CollectDefsOfVRegs();
+  }
+  int *replacement = AllocReplacement();
+  for (int v = 0; v < num_of_old_vregs; v++) {
+    if (ptr_of_vreg[v] >= 0) replacement[v] = ptrs[ptr_of_vreg[v]].ptr;
+  }
+  ReplaceVRegs(replacement);
+  EliminateDeadIRInsts(func);
+  for (int i = 0; i < num_of_ivs; i++) {
+    for (int k = 0; k < num_of_ptrs; k++) {
+      if (ptrs[k].iv_index != i) continue;
+      CollectDefsOfVRegs();
+      RewriteExitTests(&ivs[i], &ptrs[k], preheader);
+      break;
+    }
+  }
+}
+
+// Calls whose results are returned as is are lowered to jumps to the
+// callees. A return merging the values of several blocks by a phi node, as
+// left by inlining, is copied into the preds ending with such calls.
+
+static void DuplicateReturnsAfterCalls(void) {
+  bool is_changed = false;
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    struct IRInst *jump = &b->insts[b->num_of_insts - 1];
+    if (jump->op != kIRJump || b->num_of_insts < 2 ||
+        b->insts[b->num_of_insts - 2].op != kIRCall) {
+      continue;
+    }
+    struct IRBlock *ret_block = jump->targets[0];
+    struct IRInst *ret = &ret_block->insts[ret_block->num_of_insts - 1];
+    if (ret->op != kIRReturn) continue;
+    int value = 0;
+    if (ret_block->num_of_insts == 2 && ret->num_of_srcs &&
+        ret_block->insts[0].op == kIRPhi &&
+        ret_block->insts[0].dst == ret->srcs[0]) {
+      for (int p = 0; p < ret_block->num_of_preds; p++) {
+        if (ret_block->preds[p] == b) value = ret_block->insts[0].srcs[p];
+      }
+      if (value != b->insts[b->num_of_insts - 2].dst) continue;
+    } else if (ret_block->num_of_insts != 1 || ret->num_of_srcs) {
+      continue;
+    }
+    jump->op = kIRReturn;
+    jump->targets[0] = NULL;
+    jump->num_of_srcs = value ? 1 : 0;
+    jump->srcs = malloc(sizeof(int));
+    jump->srcs[0] = value;
+    is_changed = true;
+  }
+  if (is_changed) RemoveUnreachableIRBlocks(func);
+}
+
+// Tail recursion elimination.
+// A call of the function itself, whose result is returned as is or
+// combined with a value by an associative and commutative op, becomes a
+// jump back to the top of the body. The old entry becomes a loop header
+// after a new entry block, and phi nodes in it merge the params with the
+// args of such calls. Values
+// combined with the results are accumulated by another phi node instead,
+// and every remaining return combines its value with the accumulator.
+// Functions keeping local vars in memory are not transformed, since the
+// callee could refer to those of the caller through pointers.
+
+struct TailCall {
+  struct IRBlock *block;
+  int num_of_tail_insts;  // from the call to the return
+  int value;              // combined with the result, or 0
+};
+
+static bool IsAccumulatingIROp(enum IROp op) {
+  return op == kIRAdd || op == kIRMul || op == kIRAnd || op == kIROr ||
+         op == kIRXor;
+}
+
+static long GetIdentityOfIROp(enum IROp op) {
+  if (op == kIRMul) return 1;
+  if (op == kIRAnd) return -1;
+  return 0;
+}
+
+static bool MatchTailCall(struct IRBlock *b, struct TailCall *tc,
+                          enum IROp *acc_op) {
+  // *acc_op combines the results of the tail calls matched so far, or is
+  // kIRCopy if they are returned as is. Consts may be placed between the
+  // call and the return.
+  struct IRInst *ret = &b->insts[b->num_of_insts - 1];
+  if (ret->op != kIRReturn) return false;
+  int k = b->num_of_insts - 2;
+  while (k >= 0 &&
+         (b->insts[k].op == kIRConst || IsAccumulatingIROp(b->insts[k].op))) {
+    k--;
+  }
+  if (k < 0) return false;
+  struct IRInst *call = &b->insts[k];
+  if (call->op != kIRCall || !call->symbol || !IsIRFuncOf(func, call->symbol)) {
+    return false;
+  }
+  struct IRBlock *entry = func->blocks[0];
+  for (int i = 0; i < entry->num_of_insts; i++) {
+    struct IRInst *param = &entry->insts[i];
+    if (param->op == kIRParam && param->imm >= call->num_of_srcs) return false;
+  }
+  int result = call->dst;
+  struct IRInst *op = NULL;
+  tc->value = 0;
+  for (int i = k + 1; i < b->num_of_insts - 1; i++) {
+    struct IRInst *inst = &b->insts[i];
+    if (inst->op == kIRConst) continue;
+    if (op || !result || inst->srcs[0] == inst->srcs[1]) return false;
+    if (inst->srcs[0] == result) {
+      tc->value = inst->srcs[1];
+    } else if (inst->srcs[1] == result) {
+      tc->value = inst->srcs[0];
+    } else {
+      return false;
+    }
+    op = inst;
+    result = inst->dst;
+  }
+  if (ret->num_of_srcs ? ret->srcs[0] != result : op != NULL) return false;
+  if (op && *acc_op != kIRCopy && *acc_op != op->op) return false;
+  if (op) *acc_op = op->op;
+  tc->block = b;
+  tc->num_of_tail_insts = b->num_of_insts - k;
+  return true;
+}
+
+bool EliminateTailRecursion(struct IRFunc *f) {
+  // Returns true if any tail call is eliminated
+  func = f;
+  PropagateCopies();
+  DuplicateReturnsAfterCalls();
+  struct IRBlock *header = f->blocks[0];
+  // Variadic functions end their params with the token "..."
+  struct Node *arg_types = GetArgTypeList(f->func_def->func_type);
+  int num_of_types = GetSizeOfList(arg_types);
+  if (f->stack_size || header->num_of_preds ||
+      (num_of_types && IsToken(GetNodeAt(arg_types, num_of_types - 1)))) {
+    return false;
+  }
+  struct TailCall *tail_calls = malloc(f->num_of_blocks * sizeof(*tail_calls));
+  int num_of_tail_calls = 0;
+  enum IROp acc_op = kIRCopy;
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    if (MatchTailCall(f->blocks[i], &tail_calls[num_of_tail_calls], &acc_op)) {
+      num_of_tail_calls++;
+    }
+  }
+  if (!num_of_tail_calls) return false;
+  // Params move to the new entry, and uses of them refer to the phi nodes
+  struct IRBlock *entry = calloc(1, sizeof(struct IRBlock));
+  entry->is_reachable = true;
+  int n = 0;
+  for (int k = 0; k < header->num_of_insts; k++) {
+    struct IRInst *inst = &header->insts[k];
+    if (inst->op == kIRParam) {
+      *InsertIRInst(entry, entry->num_of_insts, kIRJump, 0, 0) = *inst;
+    } else {
+      header->insts[n++] = *inst;
+    }
+  }
+  header->num_of_insts = n;
+  int num_of_params = entry->num_of_insts;
+  int first_merged = f->num_of_vregs;
+  for (int i = 0; i < num_of_params; i++) NewIRVReg(f);
+  int *replacement = AllocReplacement();
+  for (int i = 0; i < num_of_params; i++) {
+    replacement[entry->insts[i].dst] = first_merged + i;
+  }
+  ReplaceVRegs(replacement);
+  int acc = 0;
+  if (acc_op != kIRCopy) {
+    acc = NewIRVReg(f);
+    InsertIRInst(entry, num_of_params, kIRConst, NewIRVReg(f), 0)->imm =
+        GetIdentityOfIROp(acc_op);
+  }
+  InsertIRInst(entry, entry->num_of_insts, kIRJump, 0, 0)->targets[0] = header;
+  entry->num_of_succs = 1;
+  entry->succs[0] = header;
+  AddIRBlockPred(header, entry);
+  InsertIRBlockBefore(entry, header);
+  header->is_loop_header = true;
+  // Tail calls jump to the header with the args in the order of its preds
+  int **args = malloc(num_of_tail_calls * sizeof(int *));
+  int *accs = malloc(num_of_tail_calls * sizeof(int));
+  for (int t = 0; t < num_of_tail_calls; t++) {
+    struct IRBlock *b = tail_calls[t].block;
+    int k = b->num_of_insts - tail_calls[t].num_of_tail_insts;
+    struct IRInst call = b->insts[k];
+    args[t] = malloc(num_of_params * sizeof(int));
+    for (int i = 0; i < num_of_params; i++) {
+      args[t][i] = call.srcs[entry->insts[i].imm];
+    }
+    accs[t] = acc;
+    for (int j = k + 1; j < b->num_of_insts - 1; j++) {
+      struct IRInst *inst = &b->insts[j];
+      b->insts[j - 1] = *inst;
+      if (inst->op == kIRConst) continue;
+      accs[t] = NewIRVReg(f);
+      b->insts[j - 1].dst = accs[t];
+      b->insts[j - 1].srcs[0] = acc;
+      b->insts[j - 1].srcs[1] = replacement[tail_calls[t].value];
+    }
+    b->num_of_insts -= 2;
+    InsertIRInst(b, b->num_of_insts, kIRJump, 0, 0)->targets[0] = header;
+    b->num_of_succs = 1;
+    b->succs[0] = header;
+    AddIRBlockPred(header, b);
+  }
+  // The other returns combine their values with the accumulator
+  for (int i = 0; acc && i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    struct IRInst *ret = &b->insts[b->num_of_insts - 1];
+    if (ret->op != kIRReturn || !ret->num_of_srcs) continue;
+    int value = ret->srcs[0];
+    ret->srcs[0] = NewIRVReg(f);
+    struct IRInst *inst =
+        InsertIRInst(b, b->num_of_insts - 1, acc_op, ret->srcs[0], 2);
+    inst->srcs[0] = acc;
+    inst->srcs[1] = value;
+  }
+  for (int i = 0; i < num_of_params; i++) {
+    struct IRInst *phi =
+        InsertIRInst(header, i, kIRPhi, first_merged + i, header->num_of_preds);
+    phi->srcs[0] = entry->insts[i].dst;
+    for (int t = 0; t < num_of_tail_calls; t++) phi->srcs[t + 1] = args[t][i];
+  }
+  if (acc) {
+    struct IRInst *phi =
+        InsertIRInst(header, 0, kIRPhi, acc, header->num_of_preds);
+    phi->srcs[0] = entry->insts[num_of_params].dst;
+    for (int t = 0; t < num_of_tail_calls; t++) phi->srcs[t + 1] = accs[t];
+  }
+  return true;
+}
+
+// Calls of memset and memcpy with small const sizes become kIRMemset and
+// kIRMemcpy, which are unrolled when lowered. The results of the calls are
+// their first arguments.
+
+static void ExpandMemFuncCalls(void) {
+  CollectDefsOfVRegs();
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      if (inst->op != kIRCall || !inst->symbol || !inst->is_external ||
+          inst->num_of_srcs != 3) {
+        continue;
+      }
+      enum IROp op;
+      if (strcmp(inst->symbol, "memset") == 0) {
+        op = kIRMemset;
+      } else if (strcmp(inst->symbol, "memcpy") == 0) {
+        op = kIRMemcpy;
+      } else {
+        continue;
+      }
+      struct IRInst *size = defs_of_vregs[inst->srcs[2]];
+      if (!size || size->op != kIRConst || size->imm < 0 ||
+          size->imm > MAX_UNROLLED_MEM_OP_SIZE) {
+        continue;
+      }
+      int *srcs = inst->srcs;
+      inst->op = kIRCopy;
+      inst->num_of_srcs = 1;
+      inst->size = 0;
+      inst->symbol = NULL;
+      inst->is_external = false;
+      struct IRInst *mem_op = InsertIRInst(b, k, op, 0, 3);
+      for (int s = 0; s < 3; s++) mem_op->srcs[s] = srcs[s];
+      k++;
+      CollectDefsOfVRegs();
+    }
+  }
+}
+
+// Loop vectorization.
+// A loop of one block is vectorized if it accesses memory only through
+// pointers advancing by the access size in each iteration, and computes
+// the stored values with ops which work lane by lane. A vector loop
+// running vector_size / size iterations at once is placed before it:
+//   preheader: enough iterations and no overlap ? vector loop : remainder
+//   vector loop: ...; enough iterations ? vector loop : vector exit
+//   vector exit: any iteration left ? remainder : exit
+//   remainder: phi nodes of the induction variables; jump to the header
+// The original loop runs the remaining iterations. Vector registers are
+// numbered in each vector loop, since nothing else uses them in between.
+// Loops which only fill memory with a byte or copy it become kIRMemset or
+// kIRMemcpy: of the whole loop if the trip count is a const, or of the
+// vector iterations if they cover at least MIN_SIZE_OF_LOOP_MEM_OP bytes.
+// The vector loop is faster than rep stosb / rep movsb below that.
+
+#define MIN_SIZE_OF_LOOP_MEM_OP 2048
+
+static struct IRBlock *vec_header;
+static struct IRBlock *vec_preheader;
+static int vec_preheader_index;
+static struct InductionVar *vec_ivs;
+static int num_of_vec_ivs;
+static int *vec_iv_of_vreg;  // index of the iv of phi, add and next, or -1
+static struct IRInst *vec_exit_test;
+static int lane_size;
+static int *vec_of_vreg;  // vector value of registers of the loop
+static int num_of_vec_regs;
+static struct IRInst *mem_op_store;  // of loops matched by MatchMemOpIdiom
+static struct IRInst *mem_op_load;   // NULL for loops filling memory
+static long mem_op_byte;             // the byte to fill, or -1 if not const
+
+static bool IsDefinedInVecHeader(int vreg) {
+  return def_block_ids[vreg] == vec_header->id;
+}
+
+static bool IsLaneWiseIROp(enum IROp op) {
+  // Results of these in each lane do not depend on bits in higher lanes
+  return op == kIRAdd || op == kIRSub || op == kIRAnd || op == kIROr ||
+         op == kIRXor;
+}
+
+static enum IROp GetVecIROp(enum IROp op) {
+  if (op == kIRAdd) return kIRVecAdd;
+  if (op == kIRSub) return kIRVecSub;
+  if (op == kIRAnd) return kIRVecAnd;
+  if (op == kIROr) return kIRVecOr;
+  assert(op == kIRXor);
+  return kIRVecXor;
+}
+
+static bool IsVectorizableValue(int vreg) {
+  // Invariants are splatted to every lane
+  if (!IsDefinedInVecHeader(vreg)) return true;
+  if (vec_iv_of_vreg[vreg] >= 0) return false;
+  enum IROp op = defs_of_vregs[vreg]->op;
+  return op == kIRConst || op == kIRLoad || op == kIRSext ||
+         IsLaneWiseIROp(op);
+}
+
+static bool IsSplattedValue(int vreg) {
+  return !IsDefinedInVecHeader(vreg) || defs_of_vregs[vreg]->op == kIRConst;
+}
+
+static int GetIVOfAddr(struct IRInst *inst) {
+  // Returns the iv which is the address of inst, advancing by its size
+  int iv = vec_iv_of_vreg[inst->srcs[0]];
+  if (iv < 0 || vec_ivs[iv].phi != inst->srcs[0] ||
+      vec_ivs[iv].step != inst->size) {
+    return -1;
+  }
+  return iv;
+}
+
+static bool MatchVectorizableLoop(void) {
+  // Values computed in the loop, including phi nodes which are all
+  // induction variables, should be used only in the loop.
+  struct IRBlock *h = vec_header;
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; b != h && k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      for (int s = 0; s < inst->num_of_srcs; s++) {
+        if (IsDefinedInVecHeader(inst->srcs[s])) return false;
+      }
+    }
+  }
+  for (int v = 0; v < func->num_of_vregs; v++) vec_iv_of_vreg[v] = -1;
+  num_of_vec_ivs = 0;
+  int k = 0;
+  for (; h->insts[k].op == kIRPhi; k++) {
+    struct InductionVar *iv = &vec_ivs[num_of_vec_ivs];
+    if (!MatchInductionVar(&h->insts[k], vec_preheader_index, iv)) {
+      return false;
+    }
+    vec_iv_of_vreg[iv->phi] = num_of_vec_ivs;
+    vec_iv_of_vreg[iv->add] = num_of_vec_ivs;
+    vec_iv_of_vreg[iv->next] = num_of_vec_ivs;
+    num_of_vec_ivs++;
+  }
+  int first_non_phi = k;
+  // The loop continues while next of an iv is less than an invariant
+  struct IRInst *branch = &h->insts[h->num_of_insts - 1];
+  if (branch->op != kIRBranch || branch->targets[0] != h ||
+      branch->targets[1] == h || !IsDefinedInVecHeader(branch->srcs[0])) {
+    return false;
+  }
+  struct IRInst *test = defs_of_vregs[branch->srcs[0]];
+  int *uses = CountUsesOfVRegs();
+  if ((test->op != kIRLt && test->op != kIRLe) || uses[test->dst] != 1 ||
+      IsDefinedInVecHeader(test->srcs[1])) {
+    return false;
+  }
+  int exit_iv = vec_iv_of_vreg[test->srcs[0]];
+  if (exit_iv < 0 || vec_ivs[exit_iv].next != test->srcs[0] ||
+      vec_ivs[exit_iv].step <= 0) {
+    return false;
+  }
+  vec_exit_test = test;
+  // Memory is accessed in lanes of the same size
+  lane_size = 0;
+  for (k = first_non_phi; k < h->num_of_insts; k++) {
+    struct IRInst *inst = &h->insts[k];
+    if (inst->op != kIRLoad && inst->op != kIRStore) continue;
+    if ((lane_size && inst->size != lane_size) || GetIVOfAddr(inst) < 0) {
+      return false;
+    }
+    lane_size = inst->size;
+  }
+  if (lane_size != 1 && lane_size != 4 && lane_size != 8) return false;
+  // Counts vector registers needed, without sharing splatted values
+  int num_of_vec_values = 0;
+  for (k = first_non_phi; k < h->num_of_insts - 1; k++) {
+    struct IRInst *inst = &h->insts[k];
+    if (inst == test || inst->op == kIRConst) continue;
+    if (inst->op == kIRStore) {
+      if (!IsVectorizableValue(inst->srcs[1])) return false;
+      num_of_vec_values += IsSplattedValue(inst->srcs[1]);
+      continue;
+    }
+    if (vec_iv_of_vreg[inst->dst] >= 0) continue;
+    if (inst->op == kIRLoad) {
+      num_of_vec_values++;
+      continue;
+    }
+    // sext of a lane does not change the bits stored from it
+    if (inst->op == kIRSext && inst->size >= lane_size &&
+        IsVectorizableValue(inst->srcs[0])) {
+      num_of_vec_values += IsSplattedValue(inst->srcs[0]);
+      continue;
+    }
+    if (!IsLaneWiseIROp(inst->op) || !IsVectorizableValue(inst->srcs[0]) ||
+        !IsVectorizableValue(inst->srcs[1])) {
+      return false;
+    }
+    num_of_vec_values += 1 + IsSplattedValue(inst->srcs[0]) +
+                         IsSplattedValue(inst->srcs[1]);
+  }
+  return num_of_vec_values <= kNumOfPhysicalRegs;
+}
+
+static struct IRInst *AppendIRInst(struct IRBlock *b, enum IROp op,
+                                   int num_of_srcs) {
+  // Inserts an inst before the terminator of b if any. Vector ops get
+  // their registers in the order of insertion.
+  int index = IsIRBlockTerminated(b) ? b->num_of_insts - 1 : b->num_of_insts;
+  bool has_dst = op != kIRVecStore && op != kIRMemset && op != kIRMemcpy &&
+                 op != kIRBranch && op != kIRJump;
+  struct IRInst *inst =
+      InsertIRInst(b, index, op, has_dst ? NewIRVReg(func) : 0, num_of_srcs);
+  if (op >= kIRVecSplat) {
+    inst->size = lane_size;
+    if (has_dst) inst->imm = num_of_vec_regs++;
+  }
+  return inst;
+}
+
+static int AppendIRInst1(struct IRBlock *b, enum IROp op, int src0) {
+  struct IRInst *inst = AppendIRInst(b, op, 1);
+  inst->srcs[0] = src0;
+  return inst->dst;
+}
+
+static int AppendIRInst2(struct IRBlock *b, enum IROp op, int src0,
+                         int src1) {
+  struct IRInst *inst = AppendIRInst(b, op, 2);
+  inst->srcs[0] = src0;
+  inst->srcs[1] = src1;
+  return inst->dst;
+}
+
+static int AppendIRConst(struct IRBlock *b, long imm) {
+  struct IRInst *inst = AppendIRInst(b, kIRConst, 0);
+  inst->imm = imm;
+  return inst->dst;
+}
+
+static void AppendIRBranch(struct IRBlock *b, int cond,
+                           struct IRBlock *if_true,
+                           struct IRBlock *if_false) {
+  struct IRInst *inst = AppendIRInst(b, kIRBranch, 1);
+  inst->srcs[0] = cond;
+  inst->targets[0] = if_true;
+  inst->targets[1] = if_false;
+}
+
+static int GetVecOfValue(int vreg) {
+  if (vec_of_vreg[vreg]) return vec_of_vreg[vreg];
+  int src = vreg;
+  if (IsDefinedInVecHeader(vreg)) {
+    // Consts in the loop are materialized again in the preheader
+    assert(defs_of_vregs[vreg]->op == kIRConst);
+    src = AppendIRConst(vec_preheader, defs_of_vregs[vreg]->imm);
+  }
+  vec_of_vreg[vreg] = AppendIRInst1(vec_preheader, kIRVecSplat, src);
+  return vec_of_vreg[vreg];
+}
+
+static int AppendNoOverlapTest(int ok, int addr0, int addr1) {
+  // ok && (addr0 - addr1 >= vector_size || addr0 - addr1 <= -vector_size)
+  struct IRBlock *p = vec_preheader;
+  int diff = AppendIRInst2(p, kIRSub, addr0, addr1);
+  int ge = AppendIRInst2(p, kIRGe, diff, AppendIRConst(p, vector_size));
+  int le = AppendIRInst2(p, kIRLe, diff, AppendIRConst(p, -vector_size));
+  return AppendIRInst2(p, kIRAnd, ok, AppendIRInst2(p, kIROr, ge, le));
+}
+
+static bool MatchMemOpIdiom(void) {
+  // Matches a loop which only stores an invariant value with the same
+  // bytes in a lane, or only stores what it loads.
+  struct IRBlock *h = vec_header;
+  mem_op_store = NULL;
+  mem_op_load = NULL;
+  for (int k = num_of_vec_ivs; k < h->num_of_insts - 1; k++) {
+    struct IRInst *inst = &h->insts[k];
+    if (inst == vec_exit_test || inst->op == kIRConst ||
+        vec_iv_of_vreg[inst->dst] >= 0) {
+      continue;
+    }
+    if (inst->op == kIRStore && !mem_op_store) {
+      mem_op_store = inst;
+    } else if (inst->op == kIRLoad && !mem_op_load) {
+      mem_op_load = inst;
+    } else if (inst->op != kIRSext) {
+      return false;
+    }
+  }
+  if (!mem_op_store) return false;
+  int value = mem_op_store->srcs[1];
+  if (mem_op_load) {
+    struct IRInst *sext = defs_of_vregs[value];
+    if (sext->op == kIRSext) value = sext->srcs[0];
+    return value == mem_op_load->dst;
+  }
+  if (!IsSplattedValue(value)) return false;
+  struct IRInst *c = defs_of_vregs[value];
+  mem_op_byte = c && c->op == kIRConst ? c->imm & 0xff : -1;
+  if (lane_size == 1) return true;
+  if (mem_op_byte < 0) return false;
+  unsigned long bytes = mem_op_byte * 0x0101010101010101UL;
+  return lane_size == 8 ? (unsigned long)c->imm == bytes
+                        : (unsigned int)c->imm == (unsigned int)bytes;
+}
+
+static int GetBaseOfOffset(int vreg, long *ofs) {
+  // Returns the register which vreg is offset from by consts, adding the
+  // consts to *ofs. 0 is returned for consts.
+  for (;;) {
+    struct IRInst *def = defs_of_vregs[vreg];
+    if (!def) return vreg;
+    if (def->op == kIRConst) {
+      *ofs += def->imm;
+      return 0;
+    }
+    if (def->op == kIRCopy) {
+      vreg = def->srcs[0];
+      continue;
+    }
+    if (def->op != kIRAdd && def->op != kIRSub) return vreg;
+    struct IRInst *l = defs_of_vregs[def->srcs[0]];
+    struct IRInst *r = defs_of_vregs[def->srcs[1]];
+    if (r && r->op == kIRConst) {
+      *ofs += def->op == kIRAdd ? r->imm : -r->imm;
+      vreg = def->srcs[0];
+    } else if (l && l->op == kIRConst && def->op == kIRAdd) {
+      *ofs += l->imm;
+      vreg = def->srcs[1];
+    } else {
+      return vreg;
+    }
+  }
+}
+
+static bool GetConstTripCount(long *count) {
+  // The loop runs while init + step * count does not reach the bound
+  struct InductionVar *iv = &vec_ivs[vec_iv_of_vreg[vec_exit_test->srcs[0]]];
+  long bound_ofs = 0;
+  long init_ofs = 0;
+  if (GetBaseOfOffset(vec_exit_test->srcs[1], &bound_ofs) !=
+      GetBaseOfOffset(iv->init, &init_ofs)) {
+    return false;
+  }
+  long diff = bound_ofs - init_ofs;
+  if (vec_exit_test->op == kIRLt) {
+    *count = diff <= 0 ? 1 : (diff + iv->step - 1) / iv->step;
+  } else {
+    *count = diff < 0 ? 1 : diff / iv->step + 1;
+  }
+  return true;
+}
+
+static void AppendMemOp(struct IRBlock *b, int size) {
+  // Fills or copies size bytes from the first addresses of the loop
+  int src;
+  if (mem_op_load) {
+    src = vec_ivs[GetIVOfAddr(mem_op_load)].init;
+  } else {
+    src = mem_op_byte < 0 ? mem_op_store->srcs[1]
+                          : AppendIRConst(b, mem_op_byte);
+  }
+  struct IRInst *inst = AppendIRInst(b, mem_op_load ? kIRMemcpy : kIRMemset, 3);
+  inst->srcs[0] = vec_ivs[GetIVOfAddr(mem_op_store)].init;
+  inst->srcs[1] = src;
+  inst->srcs[2] = size;
+}
+
+static void AddPredOfVecExit(struct IRBlock *exit, struct IRBlock *pred) {
+  // Phi nodes in exit take the same values from pred as from the header
+  int h_index = 0;
+  while (exit->preds[h_index] != vec_header) h_index++;
+  exit->preds = realloc(exit->preds,
+                        (exit->num_of_preds + 1) * sizeof(struct IRBlock *));
+  exit->preds[exit->num_of_preds++] = pred;
+  for (int k = 0; k < exit->num_of_insts && exit->insts[k].op == kIRPhi;
+       k++) {
+    struct IRInst *phi = &exit->insts[k];
+    phi->srcs = realloc(phi->srcs, exit->num_of_preds * sizeof(int));
+    phi->srcs[phi->num_of_srcs++] = phi->srcs[h_index];
+  }
+}
+
+static void VectorizeLoop(void) {
+  struct IRBlock *h = vec_header;
+  struct IRBlock *p = vec_preheader;
+  long lanes = vector_size / lane_size;
+  int exit_index = vec_iv_of_vreg[vec_exit_test->srcs[0]];
+  struct InductionVar *exit_iv = &vec_ivs[exit_index];
+  enum IROp test_op = vec_exit_test->op;
+  int bound = vec_exit_test->srcs[1];
+  struct IRBlock *exit = h->insts[h->num_of_insts - 1].targets[1];
+  // Accesses through different ivs overlapping in one vector are checked
+  // at runtime, unless they are known to be apart.
+  bool *is_stored_iv = calloc(num_of_vec_ivs, sizeof(bool));
+  bool *is_accessed_iv = calloc(num_of_vec_ivs, sizeof(bool));
+  for (int k = 0; k < h->num_of_insts; k++) {
+    struct IRInst *inst = &h->insts[k];
+    if (inst->op != kIRLoad && inst->op != kIRStore) continue;
+    is_accessed_iv[GetIVOfAddr(inst)] = true;
+    if (inst->op == kIRStore) is_stored_iv[GetIVOfAddr(inst)] = true;
+  }
+  int num_of_pairs = 0;
+  int *pairs = malloc(num_of_vec_ivs * num_of_vec_ivs * 2 * sizeof(int));
+  for (int i = 0; i < num_of_vec_ivs; i++) {
+    for (int j = i + 1; j < num_of_vec_ivs; j++) {
+      if (!is_accessed_iv[i] || !is_accessed_iv[j] ||
+          (!is_stored_iv[i] && !is_stored_iv[j]) ||
+          !MayAlias(vec_ivs[i].init, vector_size, vec_ivs[j].init,
+                    vector_size)) {
+        continue;
+      }
+      pairs[num_of_pairs * 2] = vec_ivs[i].init;
+      pairs[num_of_pairs * 2 + 1] = vec_ivs[j].init;
+      num_of_pairs++;
+    }
+  }
+  p->num_of_insts--;  // jump to the header
+  bool is_mem_op = MatchMemOpIdiom();
+  long trip_count;
+  if (is_mem_op && GetConstTripCount(&trip_count)) {
+    // The whole loop is replaced, unless the accesses overlap
+    struct IRBlock *bulk = calloc(1, sizeof(struct IRBlock));
+    AppendMemOp(bulk, AppendIRConst(bulk, trip_count * lane_size));
+    AppendIRInst(bulk, kIRJump, 0)->targets[0] = exit;
+    if (num_of_pairs) {
+      int ok = AppendIRConst(p, 1);
+      for (int i = 0; i < num_of_pairs; i++) {
+        ok = AppendNoOverlapTest(ok, pairs[i * 2], pairs[i * 2 + 1]);
+      }
+      AppendIRBranch(p, ok, bulk, h);
+    } else {
+      AppendIRInst(p, kIRJump, 0)->targets[0] = bulk;
+    }
+    AddPredOfVecExit(exit, bulk);
+    InsertIRBlockBefore(bulk, h);
+    RemoveUnreachableIRBlocks(func);
+    return;
+  }
+  struct IRBlock *vec_loop = calloc(1, sizeof(struct IRBlock));
+  struct IRBlock *vec_exit = calloc(1, sizeof(struct IRBlock));
+  struct IRBlock *remainder = calloc(1, sizeof(struct IRBlock));
+  vec_loop->is_loop_header = true;
+  // Phi nodes of ivs are placed in the same order in the new blocks
+  int *vec_ivs_in_loop = malloc(num_of_vec_ivs * sizeof(int));
+  int *vec_ivs_next = malloc(num_of_vec_ivs * sizeof(int));
+  for (int i = 0; i < num_of_vec_ivs; i++) {
+    vec_ivs_in_loop[i] =
+        AppendIRInst2(vec_loop, kIRPhi, vec_ivs[i].init, 0);
+  }
+  num_of_vec_regs = 0;
+  vec_of_vreg = calloc(func->num_of_vregs, sizeof(int));
+  for (int k = num_of_vec_ivs; k < h->num_of_insts - 1; k++) {
+    struct IRInst *inst = &h->insts[k];
+    if (inst == vec_exit_test || inst->op == kIRConst ||
+        (inst->dst && vec_iv_of_vreg[inst->dst] >= 0)) {
+      continue;
+    }
+    if (inst->op == kIRLoad) {
+      int addr = vec_ivs_in_loop[GetIVOfAddr(inst)];
+      vec_of_vreg[inst->dst] = AppendIRInst1(vec_loop, kIRVecLoad, addr);
+    } else if (inst->op == kIRStore) {
+      int addr = vec_ivs_in_loop[GetIVOfAddr(inst)];
+      AppendIRInst2(vec_loop, kIRVecStore, addr,
+                   GetVecOfValue(inst->srcs[1]));
+    } else if (inst->op == kIRSext) {
+      vec_of_vreg[inst->dst] = GetVecOfValue(inst->srcs[0]);
+    } else {
+      int l = GetVecOfValue(inst->srcs[0]);
+      int r = GetVecOfValue(inst->srcs[1]);
+      vec_of_vreg[inst->dst] =
+          AppendIRInst2(vec_loop, GetVecIROp(inst->op), l, r);
+    }
+  }
+  for (int i = 0; i < num_of_vec_ivs; i++) {
+    int step = AppendIRConst(p, vec_ivs[i].step * lanes);
+    vec_ivs_next[i] =
+        AppendIRInst2(vec_loop, kIRAdd, vec_ivs_in_loop[i], step);
+    vec_loop->insts[i].srcs[1] = vec_ivs_next[i];
+  }
+  // The last iteration in a vector starts before vec_bound
+  int vec_bound = AppendIRInst2(p, kIRSub, bound,
+                                AppendIRConst(p, (lanes - 1) * exit_iv->step));
+  int ok = AppendIRInst2(p, test_op, exit_iv->init, vec_bound);
+  for (int i = 0; i < num_of_pairs; i++) {
+    ok = AppendNoOverlapTest(ok, pairs[i * 2], pairs[i * 2 + 1]);
+  }
+  AppendIRBranch(
+      vec_loop,
+      AppendIRInst2(vec_loop, test_op, vec_ivs_next[exit_index], vec_bound),
+      vec_loop, vec_exit);
+  AppendIRBranch(
+      vec_exit,
+      AppendIRInst2(vec_exit, test_op, vec_ivs_next[exit_index], bound),
+      remainder, exit);
+  for (int i = 0; i < num_of_vec_ivs; i++) {
+    int phi =
+        AppendIRInst2(remainder, kIRPhi, vec_ivs[i].init, vec_ivs_next[i]);
+    h->insts[i].srcs[vec_preheader_index] = phi;
+  }
+  AppendIRInst(remainder, kIRJump, 0)->targets[0] = h;
+  // Edges are set for the sources of the phi nodes
+  struct IRBlock *vec_entry = vec_loop;
+  struct IRBlock *bulk = NULL;
+  remainder->preds = malloc(3 * sizeof(struct IRBlock *));
+  if (is_mem_op) {
+    // The vector iterations run as one op if they cover enough bytes
+    vec_entry = calloc(1, sizeof(struct IRBlock));
+    bulk = calloc(1, sizeof(struct IRBlock));
+    long n = lanes * exit_iv->step;
+    int diff = AppendIRInst2(vec_entry, kIRSub, vec_bound, exit_iv->init);
+    int count;
+    if (test_op == kIRLt) {
+      diff = AppendIRInst2(vec_entry, kIRAdd, diff,
+                           AppendIRConst(vec_entry, n - 1));
+      count = AppendIRInst2(vec_entry, kIRDiv, diff,
+                            AppendIRConst(vec_entry, n));
+    } else {
+      count = AppendIRInst2(
+          vec_entry, kIRAdd,
+          AppendIRInst2(vec_entry, kIRDiv, diff, AppendIRConst(vec_entry, n)),
+          AppendIRConst(vec_entry, 1));
+    }
+    int size = AppendIRInst2(vec_entry, kIRMul, count,
+                             AppendIRConst(vec_entry, vector_size));
+    int is_large = AppendIRInst2(
+        vec_entry, kIRGe, size,
+        AppendIRConst(vec_entry, MIN_SIZE_OF_LOOP_MEM_OP));
+    AppendIRBranch(vec_entry, is_large, bulk, vec_loop);
+    AppendMemOp(bulk, size);
+    for (int i = 0; i < num_of_vec_ivs; i++) {
+      int ofs = AppendIRInst2(
+          bulk, kIRMul, count,
+          AppendIRConst(bulk, vec_ivs[i].step * lanes));
+      int next = AppendIRInst2(bulk, kIRAdd, vec_ivs[i].init, ofs);
+      remainder->insts[i].srcs =
+          realloc(remainder->insts[i].srcs, 3 * sizeof(int));
+      remainder->insts[i].srcs[2] = next;
+      remainder->insts[i].num_of_srcs = 3;
+    }
+    int bulk_exit_iv = remainder->insts[exit_index].srcs[2];
+    AppendIRBranch(bulk, AppendIRInst2(bulk, test_op, bulk_exit_iv, bound),
+                   remainder, exit);
+    remainder->preds[2] = bulk;
+  }
+  AppendIRBranch(p, ok, vec_entry, remainder);
+  vec_loop->num_of_preds = 2;
+  vec_loop->preds = malloc(2 * sizeof(struct IRBlock *));
+  vec_loop->preds[0] = vec_entry == vec_loop ? p : vec_entry;
+  vec_loop->preds[1] = vec_loop;
+  remainder->num_of_preds = bulk ? 3 : 2;
+  remainder->preds[0] = p;
+  remainder->preds[1] = vec_exit;
+  h->preds[vec_preheader_index] = remainder;
+  AddPredOfVecExit(exit, vec_exit);
+  if (bulk) AddPredOfVecExit(exit, bulk);
+  if (vec_entry != vec_loop) InsertIRBlockBefore(vec_entry, h);
+  InsertIRBlockBefore(vec_loop, h);
+  InsertIRBlockBefore(vec_exit, h);
+  if (bulk) InsertIRBlockBefore(bulk, h);
+  InsertIRBlockBefore(remainder, h);
+  RemoveUnreachableIRBlocks(func);
+}
+
+static void VectorizeLoops(void) {
+  vec_ivs = NULL;
+  for (int i = 1; i < func->num_of_blocks; i++) {
+    struct IRBlock *h = func->blocks[i];
+    if (h->num_of_preds != 2) continue;
+    vec_preheader_index = h->preds[0] == h ? 1 : 0;
+    vec_header = h;
+    vec_preheader = h->preds[vec_preheader_index];
+    if (h->preds[1 - vec_preheader_index] != h ||
+        vec_preheader->num_of_succs != 1) {
+      continue;
+    }
+    CollectDefsOfVRegs();
+    vec_ivs = realloc(vec_ivs, h->num_of_insts * sizeof(struct InductionVar));
+    vec_iv_of_vreg = malloc(func->num_of_vregs * sizeof(int));
+    if (!MatchVectorizableLoop()) continue;
+    VectorizeLoop();
+    // The original loop follows the new blocks
+    i = h->id;
+  }
+}
+
+static void OptimizeLoops(void) {
+  struct IRBlock **done = NULL;  // headers of processed loops
+  int num_of_done = 0;
+  for (;;) {
+    idom = ComputeIRDominators(func);
+    is_in_loop = calloc(func->num_of_blocks, sizeof(bool));
+    loop_blocks = malloc(func->num_of_blocks * sizeof(struct IRBlock *));
+    // Inner loops first, which have fewer blocks
+    struct IRBlock *header = NULL;
+    int min_size = 0;
+    for (int i = 1; i < func->num_of_blocks; i++) {
+      struct IRBlock *b = func->blocks[i];
+      bool is_done = false;
+      for (int k = 0; k < num_of_done; k++) is_done |= done[k] == b;
+      if (is_done) continue;
+      int size = CollectLoopBlocks(b);
+      if (!size || (header && size >= min_size)) continue;
+      header = b;
+      min_size = size;
+    }
+    if (!header) return;
+    CollectLoopBlocks(header);
+    bool is_cfg_changed;
+    struct IRBlock *preheader = GetPreheader(header, &is_cfg_changed);
+    // Loop blocks are collected again with the new block ids
+    if (preheader && is_cfg_changed) continue;
+    done = realloc(done, (num_of_done + 1) * sizeof(struct IRBlock *));
+    done[num_of_done++] = header;
+    if (!preheader) continue;
+    HoistLoopInvariants(preheader);
+    EliminateCommonSubexpressions();
+    ReduceInductionVars(header, preheader);
+  }
+}
+
+void OptimizeIR(struct IRFunc *f) {
+  PropagateConstants(f);
+  func = f;
+  MergeStraightLineBlocks();
+  ExpandMemFuncCalls();
+  PropagateCopies();
+  idom = ComputeIRDominators(func);
+  EliminateCommonSubexpressions();
+  OptimizeLoops();
+  VectorizeLoops();
+  DuplicateReturnsAfterCalls();
+  EliminateDeadIRInsts(func);
+}
@@ -354,6 +354,12 @@ struct Node *ParseDeclSpecs() {
       continue;
     }
     if ((decl_spec = ConsumeToken(kTokenKwStatic))) {
+      PushToList(decl_specs, decl_spec);
+      continue;
+    }
+    // function-specifier
+    if ((decl_spec = ConsumeToken(kTokenKwInline))) {
+      PushToList(decl_specs, decl_spec);
       continue;
     }
     // type-qualifier
@@ -472,13 +478,30 @@ struct Node *ParseDecltor() {
   return n;
 }
 
+struct Node *ParseInitializer() {
+  // returns assign-expr, or ASTList with op "{" for initializer-list
+  struct Node *t;
+  if (!(t = ConsumePunctuator("{"))) return ParseAssignExpr();
+  struct Node *list = AllocList();
+  list->op = t;
+  while (!ConsumePunctuator("}")) {
+    struct Node *init = ParseInitializer();
+    if (!init) ErrorWithToken(NextToken(), "Expected initializer here");
+    PushToList(list, init);
+    if (ConsumePunctuator(",")) continue;
+    ExpectPunctuator("}");
+    break;
+  }
+  return list;
+}
+
 struct Node *ParseInitDecltor() {
   struct Node *decltor = ParseDecltor();
   if (!decltor) return NULL;
   struct Node *t;
   if (!(t = ConsumePunctuator("="))) return decltor;
-  struct Node *init_expr = ParseAssignExpr();
-  assert(init_expr);
+  struct Node *init_expr = ParseInitializer();
+  if (!init_expr) ErrorWithToken(t, "Expected initializer after this token");
   decltor->decltor_init_expr = CreateASTBinOp(t, NULL, init_expr);
   return decltor;
 }
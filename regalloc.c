@@ -0,0 +1,739 @@
+#include "compilium.h"
+
+// Linear scan register allocation over the instructions of a function.
+//
+// Each instruction i has two positions: 2i where it reads its operands and
+// 2i + 1 where it writes its results. A virtual register occupies one
+// interval from its first position to its last one, extended over the basic
+// blocks where it is live. Physical registers which are referred explicitly
+// (parameters, shift counts, dividends and registers destroyed by calls) are
+// recorded per position instead, so a virtual register never gets a register
+// which is in use during its interval.
+// If no register is available, the interval with the lowest spill cost
+// (uses weighted by loop depth, divided by its length) lives in the frame
+// and is reloaded into R10 or R11 around each instruction referring it.
+
+#define NUM_OF_ALLOCATABLE_REGS 11
+static const int allocatable_regs[NUM_OF_ALLOCATABLE_REGS] = {
+    // caller-saved: preferred since they do not need saves in the prologue
+    kRegRSI, kRegRDI, kRegR8, kRegR9, kRegRDX, kRegRCX,
+    // callee-saved: survive calls
+    kRegRBX, kRegR12, kRegR13, kRegR14, kRegR15};
+
+static const int caller_saved_regs[] = {
+    kRegRAX, kRegRCX, kRegRDX, kRegRSI, kRegRDI,
+    kRegR8,  kRegR9,  kRegR10, kRegR11};
+#define NUM_OF_CALLER_SAVED_REGS 9
+
+static const int spill_temp_regs[] = {kRegR11, kRegR10};
+#define NUM_OF_SPILL_TEMP_REGS 2
+
+#define MAX_NUM_OF_REG_REFS 16
+
+enum RegAccess {
+  kAccessRead = 1,
+  kAccessWrite = 2,
+};
+
+struct RegRefs {
+  int num_of_uses;
+  int uses[MAX_NUM_OF_REG_REFS];
+  int num_of_defs;
+  int defs[MAX_NUM_OF_REG_REFS];
+};
+
+static bool IsCalleeSavedReg(int reg) {
+  return reg == kRegRBX || reg == kRegRBP ||
+         (kRegR12 <= reg && reg <= kRegR15);
+}
+
+static int GetAllocatableRegIndex(int reg) {
+  for (int i = 0; i < NUM_OF_ALLOCATABLE_REGS; i++) {
+    if (allocatable_regs[i] == reg) return i;
+  }
+  return -1;
+}
+
+static bool IsVirtualReg(int reg) { return reg >= kNumOfPhysicalRegs; }
+
+static bool IsTrackedReg(int reg) {
+  return IsVirtualReg(reg) || GetAllocatableRegIndex(reg) >= 0;
+}
+
+static bool IsMnemonic(struct Inst *inst, const char *mnemonic) {
+  return inst->mnemonic && strcmp(inst->mnemonic, mnemonic) == 0;
+}
+
+static bool IsJump(struct Inst *inst) {
+  return inst->mnemonic && inst->mnemonic[0] == 'j';
+}
+
+static bool IsTailJump(struct Inst *inst) {
+  // Jumps to another function, which returns to the caller instead
+  return IsMnemonic(inst, "jmp") &&
+         inst->operands[0].type == kOperandFuncSymbol;
+}
+
+static bool IsEndOfBlock(struct Inst *inst) {
+  return IsJump(inst) || IsMnemonic(inst, "ret");
+}
+
+static bool IsMultiplyOrDivideWithRAX(struct Inst *inst) {
+  // rdx:rax is the implicit operand of these
+  if (IsMnemonic(inst, "idiv") || IsMnemonic(inst, "div") ||
+      IsMnemonic(inst, "mul")) {
+    return true;
+  }
+  return IsMnemonic(inst, "imul") && inst->num_of_operands == 1;
+}
+
+static int GetAccessOfOperand(struct Inst *inst, int idx) {
+  if (idx > 0) return kAccessRead;
+  if (IsMnemonic(inst, "cmp") || IsMnemonic(inst, "test") ||
+      IsMnemonic(inst, "push") || IsMnemonic(inst, "call") ||
+      IsJump(inst) || IsMultiplyOrDivideWithRAX(inst)) {
+    return kAccessRead;
+  }
+  if (IsMnemonic(inst, "mov") || IsMnemonic(inst, "movsx") ||
+      IsMnemonic(inst, "movsxd") || IsMnemonic(inst, "movzx") ||
+      IsMnemonic(inst, "lea") || IsMnemonic(inst, "pop") ||
+      strncmp(inst->mnemonic, "set", 3) == 0 ||
+      (IsMnemonic(inst, "imul") && inst->num_of_operands == 3)) {
+    return kAccessWrite;
+  }
+  if (IsMnemonic(inst, "xor") && inst->operands[1].type == kOperandReg &&
+      inst->operands[0].reg == inst->operands[1].reg) {
+    // Zeroing idiom does not depend on the previous value
+    return kAccessWrite;
+  }
+  return kAccessRead | kAccessWrite;
+}
+
+static void AddRegRef(int *regs, int *num_of_regs, int reg) {
+  for (int i = 0; i < *num_of_regs; i++) {
+    if (regs[i] == reg) return;
+  }
+  assert(*num_of_regs < MAX_NUM_OF_REG_REFS);
+  regs[(*num_of_regs)++] = reg;
+}
+
+#define MAX_NUM_OF_REG_SLOTS (MAX_NUM_OF_OPERANDS * 2)
+
+static int GetRegSlotsOfInst(struct Inst *inst, int **slots, int *accesses) {
+  // Stores pointers to the registers referred by the operands of inst, and
+  // returns the number of them. Registers of memory operands are only read.
+  int n = 0;
+  for (int i = 0; inst->mnemonic && i < inst->num_of_operands; i++) {
+    struct Operand *op = &inst->operands[i];
+    if (op->type == kOperandReg) {
+      slots[n] = &op->reg;
+      accesses[n++] = GetAccessOfOperand(inst, i);
+      continue;
+    }
+    if (op->type == kOperandMem) {
+      slots[n] = &op->reg;
+      accesses[n++] = kAccessRead;
+    }
+    if ((op->type == kOperandMem || op->type == kOperandLocalVar) &&
+        op->scale) {
+      slots[n] = &op->index;
+      accesses[n++] = kAccessRead;
+    }
+  }
+  return n;
+}
+
+static void GetRegRefs(struct Inst *inst, struct RegRefs *refs) {
+  refs->num_of_uses = 0;
+  refs->num_of_defs = 0;
+  if (!inst->mnemonic) return;
+  int *slots[MAX_NUM_OF_REG_SLOTS];
+  int accesses[MAX_NUM_OF_REG_SLOTS];
+  int num_of_slots = GetRegSlotsOfInst(inst, slots, accesses);
+  for (int i = 0; i < num_of_slots; i++) {
+    if (accesses[i] & kAccessRead) {
+      AddRegRef(refs->uses, &refs->num_of_uses, *slots[i]);
+    }
+    if (accesses[i] & kAccessWrite) {
+      AddRegRef(refs->defs, &refs->num_of_defs, *slots[i]);
+    }
+  }
+  if (IsMnemonic(inst, "cqo") || IsMnemonic(inst, "cdq")) {
+    AddRegRef(refs->uses, &refs->num_of_uses, kRegRAX);
+    AddRegRef(refs->defs, &refs->num_of_defs, kRegRDX);
+  } else if (IsMultiplyOrDivideWithRAX(inst)) {
+    AddRegRef(refs->uses, &refs->num_of_uses, kRegRAX);
+    if (IsMnemonic(inst, "idiv") || IsMnemonic(inst, "div")) {
+      AddRegRef(refs->uses, &refs->num_of_uses, kRegRDX);
+    }
+    AddRegRef(refs->defs, &refs->num_of_defs, kRegRAX);
+    AddRegRef(refs->defs, &refs->num_of_defs, kRegRDX);
+  } else if (IsMnemonic(inst, "call") || IsTailJump(inst)) {
+    for (int i = 0; i < inst->num_of_call_args; i++) {
+      AddRegRef(refs->uses, &refs->num_of_uses, param_regs[i]);
+    }
+    if (IsTailJump(inst)) return;
+    for (int i = 0; i < NUM_OF_CALLER_SAVED_REGS; i++) {
+      AddRegRef(refs->defs, &refs->num_of_defs, caller_saved_regs[i]);
+    }
+  } else if (IsMnemonic(inst, "rep stosb") || IsMnemonic(inst, "rep movsb")) {
+    // rdi, rcx and rsi advance to the end of the strings
+    int regs[3] = {kRegRDI, kRegRCX,
+                   IsMnemonic(inst, "rep stosb") ? kRegRAX : kRegRSI};
+    for (int i = 0; i < 3; i++) {
+      AddRegRef(refs->uses, &refs->num_of_uses, regs[i]);
+      if (regs[i] != kRegRAX) {
+        AddRegRef(refs->defs, &refs->num_of_defs, regs[i]);
+      }
+    }
+  } else if (IsMnemonic(inst, "ret")) {
+    AddRegRef(refs->uses, &refs->num_of_uses, kRegRAX);
+  }
+}
+
+static bool HasRegRef(int *regs, int num_of_regs, int reg) {
+  for (int i = 0; i < num_of_regs; i++) {
+    if (regs[i] == reg) return true;
+  }
+  return false;
+}
+
+// Bitsets over the registers live across basic blocks
+#define BITS_PER_WORD 64
+
+static bool GetBit(unsigned long *bits, int idx) {
+  return (bits[idx / BITS_PER_WORD] >> (idx % BITS_PER_WORD)) & 1;
+}
+
+static void SetBit(unsigned long *bits, int idx) {
+  bits[idx / BITS_PER_WORD] |= 1UL << (idx % BITS_PER_WORD);
+}
+
+struct RegAllocContext {
+  struct MachineFunc *mf;
+  struct RegRefs *refs;
+  int num_of_regs;  // physical and virtual
+  // basic blocks
+  int num_of_blocks;
+  int *block_begin;  // [num_of_blocks + 1]
+  int *succs;        // [num_of_blocks * 2], -1 if none
+  // liveness of the registers which are used in multiple blocks
+  int *global_index;  // [num_of_regs], -1 if the reg is local to a block
+  int num_of_globals;
+  int num_of_words;
+  unsigned long *live_in;   // [num_of_blocks * num_of_words]
+  unsigned long *live_out;  // [num_of_blocks * num_of_words]
+  // intervals of virtual registers
+  int *start;
+  int *end;
+  long *weight;
+  int *hint;
+  int *assigned;  // physical register or -1 if spilled
+  // number of positions before p where each allocatable reg is in use
+  int *occupied_count[NUM_OF_ALLOCATABLE_REGS];
+};
+
+static void BuildBlocks(struct RegAllocContext *ctx) {
+  struct MachineFunc *mf = ctx->mf;
+  int n = mf->num_of_insts;
+  ctx->block_begin = calloc(n + 1, sizeof(int));
+  int *block_of_inst = calloc(n, sizeof(int));
+  int num_of_blocks = 0;
+  for (int i = 0; i < n; i++) {
+    if (i == 0 || !mf->insts[i].mnemonic || IsEndOfBlock(&mf->insts[i - 1])) {
+      ctx->block_begin[num_of_blocks++] = i;
+    }
+    block_of_inst[i] = num_of_blocks - 1;
+  }
+  ctx->block_begin[num_of_blocks] = n;
+  ctx->num_of_blocks = num_of_blocks;
+  // Map labels to blocks
+  int min_label = 0;
+  int max_label = -1;
+  for (int i = 0; i < n; i++) {
+    struct Inst *inst = &mf->insts[i];
+    if (inst->mnemonic) continue;
+    if (max_label < min_label || inst->label < min_label) {
+      min_label = inst->label;
+    }
+    if (inst->label > max_label) max_label = inst->label;
+  }
+  int *block_of_label = calloc(max_label - min_label + 2, sizeof(int));
+  for (int i = 0; i < n; i++) {
+    struct Inst *inst = &mf->insts[i];
+    if (inst->mnemonic) continue;
+    block_of_label[inst->label - min_label] = block_of_inst[i];
+  }
+  ctx->succs = malloc(num_of_blocks * 2 * sizeof(int));
+  for (int b = 0; b < num_of_blocks; b++) {
+    struct Inst *last = &mf->insts[ctx->block_begin[b + 1] - 1];
+    int *succs = &ctx->succs[b * 2];
+    int next = b + 1 < num_of_blocks ? b + 1 : -1;
+    succs[0] = next;
+    succs[1] = -1;
+    if (IsMnemonic(last, "ret") || IsTailJump(last)) {
+      succs[0] = -1;
+    } else if (IsJump(last)) {
+      struct Operand *target = &last->operands[0];
+      assert(target->type == kOperandLabel);
+      assert(min_label <= target->imm && target->imm <= max_label);
+      succs[0] = block_of_label[target->imm - min_label];
+      if (!IsMnemonic(last, "jmp")) succs[1] = next;
+    }
+  }
+}
+
+static void AnalyzeLiveness(struct RegAllocContext *ctx) {
+  struct RegRefs *refs = ctx->refs;
+  int num_of_blocks = ctx->num_of_blocks;
+  // Registers read before written in a block are live across blocks
+  ctx->global_index = malloc(ctx->num_of_regs * sizeof(int));
+  int *defined_block = malloc(ctx->num_of_regs * sizeof(int));
+  for (int r = 0; r < ctx->num_of_regs; r++) {
+    ctx->global_index[r] = -1;
+    defined_block[r] = -1;
+  }
+  int num_of_globals = 0;
+  for (int b = 0; b < num_of_blocks; b++) {
+    for (int i = ctx->block_begin[b]; i < ctx->block_begin[b + 1]; i++) {
+      for (int k = 0; k < refs[i].num_of_uses; k++) {
+        int r = refs[i].uses[k];
+        if (!IsTrackedReg(r) || defined_block[r] == b) continue;
+        if (ctx->global_index[r] < 0) ctx->global_index[r] = num_of_globals++;
+      }
+      for (int k = 0; k < refs[i].num_of_defs; k++) {
+        defined_block[refs[i].defs[k]] = b;
+      }
+    }
+  }
+  ctx->num_of_globals = num_of_globals;
+  int words = (num_of_globals + BITS_PER_WORD - 1) / BITS_PER_WORD;
+  ctx->num_of_words = words;
+  unsigned long *use_bits = calloc(num_of_blocks * words + 1, sizeof(long));
+  unsigned long *def_bits = calloc(num_of_blocks * words + 1, sizeof(long));
+  ctx->live_in = calloc(num_of_blocks * words + 1, sizeof(long));
+  ctx->live_out = calloc(num_of_blocks * words + 1, sizeof(long));
+  for (int b = 0; b < num_of_blocks; b++) {
+    unsigned long *use = &use_bits[b * words];
+    unsigned long *def = &def_bits[b * words];
+    for (int i = ctx->block_begin[b]; i < ctx->block_begin[b + 1]; i++) {
+      for (int k = 0; k < refs[i].num_of_uses; k++) {
+        int g = ctx->global_index[refs[i].uses[k]];
+        if (g >= 0 && !GetBit(def, g)) SetBit(use, g);
+      }
+      for (int k = 0; k < refs[i].num_of_defs; k++) {
+        int g = ctx->global_index[refs[i].defs[k]];
+        if (g >= 0) SetBit(def, g);
+      }
+    }
+  }
+  // live_out[b] = union of live_in[succ]
+  // live_in[b] = use[b] | (live_out[b] & ~def[b])
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int b = num_of_blocks - 1; b >= 0; b--) {
+      unsigned long *in = &ctx->live_in[b * words];
+      unsigned long *out = &ctx->live_out[b * words];
+      for (int w = 0; w < words; w++) {
+        unsigned long new_out = 0;
+        for (int s = 0; s < 2; s++) {
+          int succ = ctx->succs[b * 2 + s];
+          if (succ >= 0) new_out |= ctx->live_in[succ * words + w];
+        }
+        unsigned long new_in =
+            use_bits[b * words + w] | (new_out & ~def_bits[b * words + w]);
+        if (new_out != out[w] || new_in != in[w]) changed = true;
+        out[w] = new_out;
+        in[w] = new_in;
+      }
+    }
+  }
+}
+
+static void ExtendInterval(struct RegAllocContext *ctx, int reg, int pos) {
+  int v = reg - kNumOfPhysicalRegs;
+  if (pos < ctx->start[v]) ctx->start[v] = pos;
+  if (pos > ctx->end[v]) ctx->end[v] = pos;
+}
+
+static void BuildIntervals(struct RegAllocContext *ctx) {
+  struct MachineFunc *mf = ctx->mf;
+  struct RegRefs *refs = ctx->refs;
+  int n = mf->num_of_insts;
+  int num_of_vregs = mf->num_of_vregs;
+  ctx->start = malloc(num_of_vregs * sizeof(int) + 1);
+  ctx->end = malloc(num_of_vregs * sizeof(int) + 1);
+  ctx->weight = calloc(num_of_vregs + 1, sizeof(long));
+  for (int v = 0; v < num_of_vregs; v++) {
+    ctx->start[v] = 2 * n;
+    ctx->end[v] = -1;
+  }
+  // Loop depth of each instruction. Jumps to backward labels close loops.
+  int *depth = calloc(n + 1, sizeof(int));
+  for (int i = 0; i < n; i++) {
+    struct Inst *inst = &mf->insts[i];
+    if (!IsJump(inst) || inst->operands[0].type != kOperandLabel) continue;
+    int head = -1;
+    for (int k = i; k >= 0; k--) {
+      if (!mf->insts[k].mnemonic &&
+          mf->insts[k].label == inst->operands[0].imm) {
+        head = k;
+        break;
+      }
+    }
+    if (head < 0) continue;
+    depth[head]++;
+    depth[i + 1]--;
+  }
+  for (int i = 1; i <= n; i++) depth[i] += depth[i - 1];
+  for (int b = 0; b < ctx->num_of_blocks; b++) {
+    int first = ctx->block_begin[b];
+    int last = ctx->block_begin[b + 1] - 1;
+    for (int g = 0; g < ctx->num_of_globals; g++) {
+      bool is_in = GetBit(&ctx->live_in[b * ctx->num_of_words], g);
+      bool is_out = GetBit(&ctx->live_out[b * ctx->num_of_words], g);
+      if (!is_in && !is_out) continue;
+      // Find the register of global index g
+      for (int r = kNumOfPhysicalRegs; r < ctx->num_of_regs; r++) {
+        if (ctx->global_index[r] != g) continue;
+        if (is_in) ExtendInterval(ctx, r, 2 * first);
+        if (is_out) ExtendInterval(ctx, r, 2 * last + 1);
+        break;
+      }
+    }
+    for (int i = first; i <= last; i++) {
+      long w = 1;
+      for (int d = 0; d < depth[i] && d < 6; d++) w *= 10;
+      for (int k = 0; k < refs[i].num_of_uses; k++) {
+        int r = refs[i].uses[k];
+        if (!IsVirtualReg(r)) continue;
+        ExtendInterval(ctx, r, 2 * i);
+        ctx->weight[r - kNumOfPhysicalRegs] += w;
+      }
+      for (int k = 0; k < refs[i].num_of_defs; k++) {
+        int r = refs[i].defs[k];
+        if (!IsVirtualReg(r)) continue;
+        ExtendInterval(ctx, r, 2 * i + 1);
+        ctx->weight[r - kNumOfPhysicalRegs] += w;
+      }
+    }
+  }
+}
+
+static void BuildOccupiedCounts(struct RegAllocContext *ctx) {
+  // Marks positions where allocatable physical registers hold values
+  // which are referred explicitly.
+  struct RegRefs *refs = ctx->refs;
+  int num_of_positions = 2 * ctx->mf->num_of_insts;
+  for (int a = 0; a < NUM_OF_ALLOCATABLE_REGS; a++) {
+    int reg = allocatable_regs[a];
+    int *diff = calloc(num_of_positions + 2, sizeof(int));
+    int g = ctx->global_index[reg];
+    for (int b = 0; b < ctx->num_of_blocks; b++) {
+      int first = ctx->block_begin[b];
+      int last = ctx->block_begin[b + 1] - 1;
+      bool is_live =
+          g >= 0 && GetBit(&ctx->live_out[b * ctx->num_of_words], g);
+      int live_end = 2 * last + 1;
+      for (int i = last; i >= first; i--) {
+        if (HasRegRef(refs[i].defs, refs[i].num_of_defs, reg)) {
+          diff[2 * i + 1]++;
+          diff[(is_live ? live_end : 2 * i + 1) + 1]--;
+          is_live = false;
+        }
+        if (HasRegRef(refs[i].uses, refs[i].num_of_uses, reg) && !is_live) {
+          is_live = true;
+          live_end = 2 * i;
+        }
+      }
+      if (is_live) {
+        diff[2 * first]++;
+        diff[live_end + 1]--;
+      }
+    }
+    int *count = calloc(num_of_positions + 2, sizeof(int));
+    int level = 0;
+    for (int p = 0; p <= num_of_positions; p++) {
+      level += diff[p];
+      count[p + 1] = count[p] + (level > 0);
+    }
+    ctx->occupied_count[a] = count;
+  }
+}
+
+static bool IsOccupied(struct RegAllocContext *ctx, int reg, int v) {
+  int a = GetAllocatableRegIndex(reg);
+  if (a < 0) return true;
+  int *count = ctx->occupied_count[a];
+  return count[ctx->end[v] + 1] - count[ctx->start[v]] > 0;
+}
+
+static void SetHints(struct RegAllocContext *ctx) {
+  // Copies between registers are removed if both ends get the same one
+  struct MachineFunc *mf = ctx->mf;
+  ctx->hint = malloc(mf->num_of_vregs * sizeof(int) + 1);
+  for (int v = 0; v < mf->num_of_vregs; v++) ctx->hint[v] = -1;
+  for (int i = 0; i < mf->num_of_insts; i++) {
+    struct Inst *inst = &mf->insts[i];
+    if (!IsMnemonic(inst, "mov") || inst->operands[0].type != kOperandReg ||
+        inst->operands[1].type != kOperandReg) {
+      continue;
+    }
+    int dst = inst->operands[0].reg;
+    int src = inst->operands[1].reg;
+    if (IsVirtualReg(dst) && ctx->hint[dst - kNumOfPhysicalRegs] < 0) {
+      ctx->hint[dst - kNumOfPhysicalRegs] = src;
+    }
+    if (IsVirtualReg(src) && ctx->hint[src - kNumOfPhysicalRegs] < 0) {
+      ctx->hint[src - kNumOfPhysicalRegs] = dst;
+    }
+  }
+}
+
+static bool IsCheaperToSpill(struct RegAllocContext *ctx, int a, int b) {
+  // Compares weight / length of the intervals
+  long len_a = ctx->end[a] - ctx->start[a] + 1;
+  long len_b = ctx->end[b] - ctx->start[b] + 1;
+  return ctx->weight[a] * len_b < ctx->weight[b] * len_a;
+}
+
+static int FindFreeReg(struct RegAllocContext *ctx, int v, int *reg_owner) {
+  int hint = ctx->hint[v];
+  if (hint >= 0) {
+    int reg =
+        IsVirtualReg(hint) ? ctx->assigned[hint - kNumOfPhysicalRegs] : hint;
+    if (reg >= 0 && reg_owner[reg] < 0 && !IsOccupied(ctx, reg, v)) {
+      return reg;
+    }
+  }
+  for (int a = 0; a < NUM_OF_ALLOCATABLE_REGS; a++) {
+    int reg = allocatable_regs[a];
+    if (reg_owner[reg] < 0 && !IsOccupied(ctx, reg, v)) return reg;
+  }
+  return -1;
+}
+
+static void LinearScan(struct RegAllocContext *ctx) {
+  int num_of_vregs = ctx->mf->num_of_vregs;
+  int num_of_positions = 2 * ctx->mf->num_of_insts;
+  ctx->assigned = malloc(num_of_vregs * sizeof(int) + 1);
+  // Sort intervals by their start with counting sort
+  int *count = calloc(num_of_positions + 2, sizeof(int));
+  for (int v = 0; v < num_of_vregs; v++) {
+    ctx->assigned[v] = -1;
+    if (ctx->end[v] >= 0) count[ctx->start[v] + 1]++;
+  }
+  for (int p = 0; p < num_of_positions; p++) count[p + 1] += count[p];
+  int *order = malloc(num_of_vregs * sizeof(int) + 1);
+  int num_of_intervals = 0;
+  for (int v = 0; v < num_of_vregs; v++) {
+    if (ctx->end[v] < 0) continue;
+    order[count[ctx->start[v]]++] = v;
+    num_of_intervals++;
+  }
+  int reg_owner[kNumOfPhysicalRegs];
+  for (int r = 0; r < kNumOfPhysicalRegs; r++) reg_owner[r] = -1;
+  int active[NUM_OF_ALLOCATABLE_REGS];
+  int num_of_active = 0;
+  for (int k = 0; k < num_of_intervals; k++) {
+    int v = order[k];
+    // Expire old intervals
+    for (int i = 0; i < num_of_active;) {
+      int u = active[i];
+      if (ctx->end[u] >= ctx->start[v]) {
+        i++;
+        continue;
+      }
+      reg_owner[ctx->assigned[u]] = -1;
+      active[i] = active[--num_of_active];
+    }
+    int reg = FindFreeReg(ctx, v, reg_owner);
+    if (reg < 0) {
+      // Take the register of the cheapest active interval if possible
+      int victim = -1;
+      for (int i = 0; i < num_of_active; i++) {
+        int u = active[i];
+        if (IsOccupied(ctx, ctx->assigned[u], v)) continue;
+        if (victim < 0 || IsCheaperToSpill(ctx, u, active[victim])) {
+          victim = i;
+        }
+      }
+      if (victim < 0 || !IsCheaperToSpill(ctx, active[victim], v)) continue;
+      int u = active[victim];
+      reg = ctx->assigned[u];
+      ctx->assigned[u] = -1;
+      active[victim] = active[--num_of_active];
+    }
+    ctx->assigned[v] = reg;
+    reg_owner[reg] = v;
+    active[num_of_active++] = v;
+  }
+}
+
+static void AppendInst(struct Inst *insts, int *n, struct Inst *inst) {
+  insts[(*n)++] = *inst;
+}
+
+static void AppendSpillMove(struct Inst *insts, int *n, bool is_load,
+                            int temp, int slot) {
+  struct Inst inst = {0};
+  inst.mnemonic = "mov";
+  inst.num_of_operands = 2;
+  struct Operand *reg_op = &inst.operands[is_load ? 0 : 1];
+  struct Operand *mem_op = &inst.operands[is_load ? 1 : 0];
+  reg_op->type = kOperandReg;
+  reg_op->size = 8;
+  reg_op->reg = temp;
+  mem_op->type = kOperandSpillSlot;
+  mem_op->imm = slot;
+  AppendInst(insts, n, &inst);
+}
+
+static int CountSpilledVRegs(struct RegAllocContext *ctx, struct Inst *inst) {
+  int *slots[MAX_NUM_OF_REG_SLOTS];
+  int accesses[MAX_NUM_OF_REG_SLOTS];
+  int num_of_slots = GetRegSlotsOfInst(inst, slots, accesses);
+  int count = 0;
+  for (int k = 0; k < num_of_slots; k++) {
+    int reg = *slots[k];
+    if (!IsVirtualReg(reg) || ctx->assigned[reg - kNumOfPhysicalRegs] >= 0) {
+      continue;
+    }
+    int j;
+    for (j = 0; j < k; j++) {
+      if (*slots[j] == reg) break;
+    }
+    if (j == k) count++;
+  }
+  return count;
+}
+
+static void CombineSpilledAddress(struct RegAllocContext *ctx,
+                                  struct Inst *inst, struct Inst *insts, int *n,
+                                  int *spill_slot) {
+  // Only two temps are available for spilled registers. If an inst refers
+  // three of them, the base and the index of its memory operand are loaded
+  // into the temps and combined into the first one by lea.
+  struct Operand *mem = NULL;
+  for (int k = 0; k < inst->num_of_operands; k++) {
+    if (inst->operands[k].type == kOperandMem && inst->operands[k].scale) {
+      mem = &inst->operands[k];
+    }
+  }
+  assert(mem && IsVirtualReg(mem->reg) && IsVirtualReg(mem->index));
+  int base = mem->reg - kNumOfPhysicalRegs;
+  int index = mem->index - kNumOfPhysicalRegs;
+  assert(ctx->assigned[base] < 0 && ctx->assigned[index] < 0);
+  AppendSpillMove(insts, n, true, spill_temp_regs[0], spill_slot[base]);
+  AppendSpillMove(insts, n, true, spill_temp_regs[1], spill_slot[index]);
+  struct Inst lea = {0};
+  lea.mnemonic = "lea";
+  lea.num_of_operands = 2;
+  lea.operands[0].type = kOperandReg;
+  lea.operands[0].size = 8;
+  lea.operands[0].reg = spill_temp_regs[0];
+  lea.operands[1] = *mem;
+  lea.operands[1].size = 0;
+  lea.operands[1].reg = spill_temp_regs[0];
+  lea.operands[1].index = spill_temp_regs[1];
+  AppendInst(insts, n, &lea);
+  mem->reg = spill_temp_regs[0];
+  mem->scale = 0;
+  mem->imm = 0;
+}
+
+static void RewriteInsts(struct RegAllocContext *ctx) {
+  struct MachineFunc *mf = ctx->mf;
+  int *spill_slot = malloc(mf->num_of_vregs * sizeof(int) + 1);
+  int num_of_spill_slots = 0;
+  for (int v = 0; v < mf->num_of_vregs; v++) {
+    spill_slot[v] = -1;
+    if (ctx->end[v] >= 0 && ctx->assigned[v] < 0) {
+      spill_slot[v] = num_of_spill_slots++;
+    }
+  }
+  // Each inst may need loads and stores of temps, and a lea to combine them
+  int capacity = mf->num_of_insts * (2 + 2 * NUM_OF_SPILL_TEMP_REGS) + 1;
+  struct Inst *insts = malloc(capacity * sizeof(struct Inst));
+  int n = 0;
+  for (int i = 0; i < mf->num_of_insts; i++) {
+    struct Inst inst = mf->insts[i];
+    int temp_vregs[NUM_OF_SPILL_TEMP_REGS];
+    int temp_access[NUM_OF_SPILL_TEMP_REGS] = {0};
+    int num_of_temps = 0;
+    if (CountSpilledVRegs(ctx, &inst) > NUM_OF_SPILL_TEMP_REGS) {
+      CombineSpilledAddress(ctx, &inst, insts, &n, spill_slot);
+      // The first temp holds the address until the end of inst
+      temp_vregs[num_of_temps++] = -1;
+    }
+    int *slots[MAX_NUM_OF_REG_SLOTS];
+    int accesses[MAX_NUM_OF_REG_SLOTS];
+    int num_of_slots = GetRegSlotsOfInst(&inst, slots, accesses);
+    for (int k = 0; k < num_of_slots; k++) {
+      if (!IsVirtualReg(*slots[k])) continue;
+      int v = *slots[k] - kNumOfPhysicalRegs;
+      if (ctx->assigned[v] >= 0) {
+        *slots[k] = ctx->assigned[v];
+        continue;
+      }
+      int t;
+      for (t = 0; t < num_of_temps; t++) {
+        if (temp_vregs[t] == v) break;
+      }
+      if (t == num_of_temps) {
+        assert(num_of_temps < NUM_OF_SPILL_TEMP_REGS);
+        temp_vregs[num_of_temps++] = v;
+      }
+      temp_access[t] |= accesses[k];
+      *slots[k] = spill_temp_regs[t];
+    }
+    for (int t = 0; t < num_of_temps; t++) {
+      if (!(temp_access[t] & kAccessRead)) continue;
+      AppendSpillMove(insts, &n, true, spill_temp_regs[t],
+                      spill_slot[temp_vregs[t]]);
+    }
+    AppendInst(insts, &n, &inst);
+    for (int t = 0; t < num_of_temps; t++) {
+      if (!(temp_access[t] & kAccessWrite)) continue;
+      AppendSpillMove(insts, &n, false, spill_temp_regs[t],
+                      spill_slot[temp_vregs[t]]);
+    }
+  }
+  mf->insts = insts;
+  mf->num_of_insts = n;
+  mf->capacity = capacity;
+  mf->num_of_spill_slots = num_of_spill_slots;
+  mf->used_callee_saved_regs = 0;
+  for (int i = 0; i < n; i++) {
+    int *slots[MAX_NUM_OF_REG_SLOTS];
+    int accesses[MAX_NUM_OF_REG_SLOTS];
+    int num_of_slots = GetRegSlotsOfInst(&insts[i], slots, accesses);
+    for (int k = 0; k < num_of_slots; k++) {
+      int reg = *slots[k];
+      if (reg == kRegRBP || !IsCalleeSavedReg(reg)) continue;
+      mf->used_callee_saved_regs |= 1 << reg;
+    }
+  }
+}
+
+void AllocateRegisters(struct MachineFunc *mf) {
+  struct RegAllocContext context = {0};
+  struct RegAllocContext *ctx = &context;
+  ctx->mf = mf;
+  ctx->num_of_regs = kNumOfPhysicalRegs + mf->num_of_vregs;
+  mf->used_callee_saved_regs = 0;
+  mf->num_of_spill_slots = 0;
+  if (!mf->num_of_insts) return;
+  ctx->refs = malloc(mf->num_of_insts * sizeof(struct RegRefs));
+  for (int i = 0; i < mf->num_of_insts; i++) {
+    GetRegRefs(&mf->insts[i], &ctx->refs[i]);
+  }
+  BuildBlocks(ctx);
+  AnalyzeLiveness(ctx);
+  BuildIntervals(ctx);
+  BuildOccupiedCounts(ctx);
+  SetHints(ctx);
+  LinearScan(ctx);
+  RewriteInsts(ctx);
+}
@@ -0,0 +1,604 @@
+#include "compilium.h"
+
+// Conversion of the IR into SSA form and back.
+//
+// ConvertToSSA() promotes local vars which are only loaded and stored as a
+// whole to virtual registers (mem2reg). Then every register which has more
+// than one definition is renamed so that each one is defined exactly once,
+// with phi nodes placed on the dominance frontiers of the definitions
+// (Cytron et al.). Dominators are computed by the iterative algorithm of
+// Cooper, Harvey and Kennedy.
+//
+// DestructSSA() replaces phi nodes with copies at the end of predecessors
+// so that the IR can be lowered to machine instructions.
+
+static struct IRFunc *func;
+static bool *is_promoted_var;  // indexed by registers
+
+static void PushBlock(struct IRBlock ***list, int *size, struct IRBlock *b) {
+  // Appends b unless it is already in the list
+  for (int i = 0; i < *size; i++) {
+    if ((*list)[i] == b) return;
+  }
+  *list = realloc(*list, (*size + 1) * sizeof(struct IRBlock *));
+  assert(*list);
+  (*list)[(*size)++] = b;
+}
+
+static struct IRInst **GetDefsOfVRegs(void) {
+  // Returns insts indexed by registers. NULL for registers which are not
+  // defined, or defined more than once.
+  struct IRInst **defs = calloc(func->num_of_vregs, sizeof(struct IRInst *));
+  bool *is_defined = calloc(func->num_of_vregs, sizeof(bool));
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      int dst = b->insts[k].dst;
+      if (!dst) continue;
+      defs[dst] = is_defined[dst] ? NULL : &b->insts[k];
+      is_defined[dst] = true;
+    }
+  }
+  return defs;
+}
+
+static bool HasSideEffect(struct IRInst *inst) {
+  return inst->op == kIRStore || inst->op == kIRMemset ||
+         inst->op == kIRMemcpy || inst->op == kIRVecStore ||
+         inst->op == kIRCall || inst->op == kIRJump ||
+         inst->op == kIRBranch || inst->op == kIRReturn;
+}
+
+void EliminateDeadIRInsts(struct IRFunc *f) {
+  // Removes insts whose results are never used, including phi nodes which
+  // only feed each other around loops.
+  func = f;
+  struct IRInst **defs = GetDefsOfVRegs();
+  bool *is_live = calloc(func->num_of_vregs, sizeof(bool));
+  int *worklist = malloc(func->num_of_vregs * sizeof(int));
+  int num_of_work = 0;
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      if (!HasSideEffect(inst)) continue;
+      for (int s = 0; s < inst->num_of_srcs; s++) {
+        if (is_live[inst->srcs[s]]) continue;
+        is_live[inst->srcs[s]] = true;
+        worklist[num_of_work++] = inst->srcs[s];
+      }
+    }
+  }
+  while (num_of_work) {
+    struct IRInst *def = defs[worklist[--num_of_work]];
+    if (!def) continue;
+    for (int s = 0; s < def->num_of_srcs; s++) {
+      if (is_live[def->srcs[s]]) continue;
+      is_live[def->srcs[s]] = true;
+      worklist[num_of_work++] = def->srcs[s];
+    }
+  }
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    int num_of_insts = 0;
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      if (!HasSideEffect(inst) && !is_live[inst->dst]) continue;
+      b->insts[num_of_insts++] = *inst;
+    }
+    b->num_of_insts = num_of_insts;
+  }
+}
+
+void RemoveUnreachableIRBlocks(struct IRFunc *f) {
+  // BuildIRCFG() for the IR in SSA form. Sources of phi nodes are reordered
+  // to match the new preds, and dropped for removed edges. Phi nodes of
+  // blocks left with one pred become copies.
+  func = f;
+  int num_of_old_blocks = f->num_of_blocks;
+  struct IRBlock **old_blocks =
+      malloc(num_of_old_blocks * sizeof(struct IRBlock *));
+  struct IRBlock ***old_preds =
+      malloc(num_of_old_blocks * sizeof(struct IRBlock **));
+  int *num_of_old_preds = malloc(num_of_old_blocks * sizeof(int));
+  for (int i = 0; i < num_of_old_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    old_blocks[i] = b;
+    num_of_old_preds[i] = b->num_of_preds;
+    old_preds[i] = malloc(b->num_of_preds * sizeof(struct IRBlock *));
+    for (int p = 0; p < b->num_of_preds; p++) old_preds[i][p] = b->preds[p];
+  }
+  BuildIRCFG(f);
+  for (int i = 0; i < num_of_old_blocks; i++) {
+    struct IRBlock *b = old_blocks[i];
+    if (!b->is_reachable) continue;
+    for (int k = 0; k < b->num_of_insts && b->insts[k].op == kIRPhi; k++) {
+      struct IRInst *phi = &b->insts[k];
+      int *srcs = malloc(b->num_of_preds * sizeof(int));
+      for (int p = 0; p < b->num_of_preds; p++) {
+        int old_p = 0;
+        while (old_preds[i][old_p] != b->preds[p]) {
+          old_p++;
+          assert(old_p < num_of_old_preds[i]);
+        }
+        srcs[p] = phi->srcs[old_p];
+      }
+      phi->srcs = srcs;
+      phi->num_of_srcs = b->num_of_preds;
+    }
+    if (b->num_of_preds != 1) continue;
+    for (int k = 0; k < b->num_of_insts && b->insts[k].op == kIRPhi; k++) {
+      b->insts[k].op = kIRCopy;
+    }
+  }
+}
+
+// Promotion of local vars
+
+int GetSignExtendedSizeOfIRInst(struct IRInst *def) {
+  // Returns the number of bytes from which the value defined by def is
+  // known to be sign-extended.
+  if (!def) return 8;
+  if (def->op == kIRLoad || def->op == kIRSext) return def->size;
+  // Results of calls are sign-extended from the size of the return type
+  if (def->op == kIRCall && def->size) return def->size;
+  if (kIREq <= def->op && def->op <= kIRGe) return 1;
+  if (def->op != kIRConst) return 8;
+  if (-128 <= def->imm && def->imm <= 127) return 1;
+  if (-2147483648L <= def->imm && def->imm <= 2147483647L) return 4;
+  return 8;
+}
+
+static int PromoteLocalVars(void) {
+  // Replaces loads and stores of local vars whose address is not taken
+  // with copies from and to one virtual register per var.
+  // Returns the bytes of the frame needed for the vars still accessed in
+  // memory. A var at byte offset ofs lies within ofs bytes from the top.
+  int num_of_bytes = func->stack_size + 1;
+  int *offset_of_vreg = calloc(func->num_of_vregs, sizeof(int));
+  // 0: not accessed, -1: not promotable, otherwise: size of accesses
+  int *access_size = calloc(num_of_bytes, sizeof(int));
+  int *sext_size = malloc(func->num_of_vregs * sizeof(int));
+  struct IRInst **defs = GetDefsOfVRegs();
+  for (int v = 0; v < func->num_of_vregs; v++) {
+    sext_size[v] = GetSignExtendedSizeOfIRInst(defs[v]);
+  }
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      if (inst->op != kIRLocalAddr) continue;
+      assert(0 < inst->imm && inst->imm < num_of_bytes);
+      offset_of_vreg[inst->dst] = inst->imm;
+    }
+  }
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      for (int s = 0; s < inst->num_of_srcs; s++) {
+        int ofs = offset_of_vreg[inst->srcs[s]];
+        if (!ofs) continue;
+        if (s != 0 || (inst->op != kIRLoad && inst->op != kIRStore) ||
+            (access_size[ofs] && access_size[ofs] != inst->size)) {
+          access_size[ofs] = -1;
+          continue;
+        }
+        access_size[ofs] = inst->size;
+      }
+    }
+  }
+  int *var_of_offset = calloc(num_of_bytes, sizeof(int));
+  for (int ofs = 1; ofs < num_of_bytes; ofs++) {
+    if (access_size[ofs] > 0) var_of_offset[ofs] = NewIRVReg(func);
+  }
+  is_promoted_var = calloc(func->num_of_vregs, sizeof(bool));
+  for (int ofs = 1; ofs < num_of_bytes; ofs++) {
+    if (var_of_offset[ofs]) is_promoted_var[var_of_offset[ofs]] = true;
+  }
+  int size_in_memory = 0;
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      if (inst->op == kIRLocalAddr && access_size[inst->imm] < 0 &&
+          inst->imm > size_in_memory) {
+        size_in_memory = inst->imm;
+      }
+      if (inst->op != kIRLoad && inst->op != kIRStore) continue;
+      int var = var_of_offset[offset_of_vreg[inst->srcs[0]]];
+      if (!var) continue;
+      if (inst->op == kIRLoad) {
+        // Values of vars are always kept sign-extended
+        inst->op = kIRCopy;
+        inst->srcs[0] = var;
+        inst->size = 0;
+        continue;
+      }
+      int value = inst->srcs[1];
+      inst->dst = var;
+      inst->num_of_srcs = 1;
+      inst->srcs[0] = value;
+      if (inst->size < sext_size[value]) {
+        inst->op = kIRSext;
+      } else {
+        inst->op = kIRCopy;
+        inst->size = 0;
+      }
+    }
+  }
+  return size_in_memory;
+}
+
+// Dominators
+
+static struct IRBlock **rpo;  // blocks in the reverse postorder
+static int *rpo_index;        // indexed by block ids
+static struct IRBlock **idom;
+static struct IRBlock ***dom_children;
+static int *num_of_dom_children;
+static struct IRBlock ***dom_frontier;
+static int *num_of_dom_frontier;
+
+static void ComputeReversePostorder(void) {
+  int n = func->num_of_blocks;
+  struct IRBlock **stack = malloc(n * sizeof(struct IRBlock *));
+  int *next_succ = calloc(n, sizeof(int));
+  bool *is_visited = calloc(n, sizeof(bool));
+  rpo = malloc(n * sizeof(struct IRBlock *));
+  rpo_index = malloc(n * sizeof(int));
+  int sp = 0;
+  int num_of_unordered = n;
+  stack[sp++] = func->blocks[0];
+  is_visited[0] = true;
+  while (sp) {
+    struct IRBlock *b = stack[sp - 1];
+    if (next_succ[b->id] < b->num_of_succs) {
+      struct IRBlock *s = b->succs[next_succ[b->id]++];
+      if (is_visited[s->id]) continue;
+      is_visited[s->id] = true;
+      stack[sp++] = s;
+      continue;
+    }
+    sp--;
+    rpo[--num_of_unordered] = b;
+  }
+  // BuildIRCFG() removed unreachable blocks
+  assert(num_of_unordered == 0);
+  for (int i = 0; i < n; i++) rpo_index[rpo[i]->id] = i;
+}
+
+static struct IRBlock *IntersectDominators(struct IRBlock *a,
+                                           struct IRBlock *b) {
+  while (a != b) {
+    while (rpo_index[a->id] > rpo_index[b->id]) a = idom[a->id];
+    while (rpo_index[b->id] > rpo_index[a->id]) b = idom[b->id];
+  }
+  return a;
+}
+
+static void ComputeDominators(void) {
+  int n = func->num_of_blocks;
+  ComputeReversePostorder();
+  idom = calloc(n, sizeof(struct IRBlock *));
+  idom[0] = func->blocks[0];
+  bool is_changed = true;
+  while (is_changed) {
+    is_changed = false;
+    for (int i = 1; i < n; i++) {
+      struct IRBlock *b = rpo[i];
+      struct IRBlock *new_idom = NULL;
+      for (int k = 0; k < b->num_of_preds; k++) {
+        struct IRBlock *p = b->preds[k];
+        if (!idom[p->id]) continue;
+        new_idom = new_idom ? IntersectDominators(p, new_idom) : p;
+      }
+      if (idom[b->id] == new_idom) continue;
+      idom[b->id] = new_idom;
+      is_changed = true;
+    }
+  }
+  dom_children = calloc(n, sizeof(struct IRBlock **));
+  num_of_dom_children = calloc(n, sizeof(int));
+  dom_frontier = calloc(n, sizeof(struct IRBlock **));
+  num_of_dom_frontier = calloc(n, sizeof(int));
+  for (int i = 1; i < n; i++) {
+    struct IRBlock *b = func->blocks[i];
+    struct IRBlock *parent = idom[i];
+    PushBlock(&dom_children[parent->id], &num_of_dom_children[parent->id], b);
+    if (b->num_of_preds < 2) continue;
+    for (int k = 0; k < b->num_of_preds; k++) {
+      for (struct IRBlock *runner = b->preds[k]; runner != parent;
+           runner = idom[runner->id]) {
+        PushBlock(&dom_frontier[runner->id], &num_of_dom_frontier[runner->id],
+                  b);
+      }
+    }
+  }
+}
+
+struct IRBlock **ComputeIRDominators(struct IRFunc *f) {
+  // Returns the immediate dominators of blocks indexed by ids
+  func = f;
+  ComputeDominators();
+  return idom;
+}
+
+// Placement of phi nodes and renaming
+
+static int num_of_vars;
+static int num_of_vregs_before_ssa;
+static int *var_of_vreg;  // -1 if the register is already in SSA form
+static int **name_stacks;
+static int *name_stack_sizes;
+static int *undef_vregs;  // value of each var before any definition
+static int *renamed_vars;
+static int num_of_renamed_vars;
+
+static int GetVarOfVReg(int vreg) {
+  if (vreg >= num_of_vregs_before_ssa) return -1;
+  return var_of_vreg[vreg];
+}
+
+static void FindVarsToRename(void) {
+  // Vars are registers defined more than once, and promoted local vars which
+  // may be read without any definition.
+  var_of_vreg = malloc(func->num_of_vregs * sizeof(int));
+  int *num_of_defs = calloc(func->num_of_vregs, sizeof(int));
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      struct IRInst *inst = &b->insts[k];
+      if (!inst->dst) continue;
+      num_of_defs[inst->dst]++;
+    }
+  }
+  num_of_vars = 0;
+  num_of_vregs_before_ssa = func->num_of_vregs;
+  for (int v = 0; v < func->num_of_vregs; v++) {
+    bool is_var = num_of_defs[v] > 1 || is_promoted_var[v];
+    var_of_vreg[v] = is_var ? num_of_vars++ : -1;
+  }
+}
+
+static void InsertPhiNodes(void) {
+  int n = func->num_of_blocks;
+  struct IRBlock ***def_blocks = calloc(num_of_vars, sizeof(struct IRBlock **));
+  int *num_of_def_blocks = calloc(num_of_vars, sizeof(int));
+  int *vreg_of_var = malloc(num_of_vars * sizeof(int));
+  for (int i = 0; i < n; i++) {
+    struct IRBlock *b = func->blocks[i];
+    for (int k = 0; k < b->num_of_insts; k++) {
+      int var = GetVarOfVReg(b->insts[k].dst);
+      if (var < 0) continue;
+      vreg_of_var[var] = b->insts[k].dst;
+      PushBlock(&def_blocks[var], &num_of_def_blocks[var], b);
+    }
+  }
+  // Last var whose phi node is placed in the block, or added to worklist
+  int *phi_placed_for = malloc(n * sizeof(int));
+  int *work_added_for = malloc(n * sizeof(int));
+  for (int i = 0; i < n; i++) {
+    phi_placed_for[i] = -1;
+    work_added_for[i] = -1;
+  }
+  struct IRBlock **worklist = malloc(n * sizeof(struct IRBlock *));
+  for (int var = 0; var < num_of_vars; var++) {
+    int num_of_work = 0;
+    for (int i = 0; i < num_of_def_blocks[var]; i++) {
+      struct IRBlock *b = def_blocks[var][i];
+      work_added_for[b->id] = var;
+      worklist[num_of_work++] = b;
+    }
+    while (num_of_work) {
+      struct IRBlock *b = worklist[--num_of_work];
+      for (int i = 0; i < num_of_dom_frontier[b->id]; i++) {
+        struct IRBlock *d = dom_frontier[b->id][i];
+        if (phi_placed_for[d->id] == var) continue;
+        phi_placed_for[d->id] = var;
+        struct IRInst *phi =
+            InsertIRInst(d, 0, kIRPhi, vreg_of_var[var], d->num_of_preds);
+        phi->imm = var;
+        if (work_added_for[d->id] == var) continue;
+        work_added_for[d->id] = var;
+        worklist[num_of_work++] = d;
+      }
+    }
+  }
+}
+
+static void PushName(int var, int vreg) {
+  name_stacks[var] = realloc(name_stacks[var],
+                             (name_stack_sizes[var] + 1) * sizeof(int));
+  assert(name_stacks[var]);
+  name_stacks[var][name_stack_sizes[var]++] = vreg;
+  renamed_vars = realloc(renamed_vars, (num_of_renamed_vars + 1) * sizeof(int));
+  assert(renamed_vars);
+  renamed_vars[num_of_renamed_vars++] = var;
+}
+
+static int GetCurrentName(int var) {
+  if (name_stack_sizes[var]) {
+    return name_stacks[var][name_stack_sizes[var] - 1];
+  }
+  // Reading a var before its definition gives an indeterminate value.
+  // 0 is defined for it in the entry block after renaming.
+  if (!undef_vregs[var]) undef_vregs[var] = NewIRVReg(func);
+  return undef_vregs[var];
+}
+
+static void RenameVarsInBlock(struct IRBlock *b) {
+  for (int k = 0; k < b->num_of_insts; k++) {
+    struct IRInst *inst = &b->insts[k];
+    if (inst->op != kIRPhi) {
+      for (int s = 0; s < inst->num_of_srcs; s++) {
+        int var = GetVarOfVReg(inst->srcs[s]);
+        if (var >= 0) inst->srcs[s] = GetCurrentName(var);
+      }
+    }
+    int var = GetVarOfVReg(inst->dst);
+    if (var < 0) continue;
+    inst->dst = NewIRVReg(func);
+    PushName(var, inst->dst);
+  }
+  for (int i = 0; i < b->num_of_succs; i++) {
+    struct IRBlock *s = b->succs[i];
+    for (int p = 0; p < s->num_of_preds; p++) {
+      if (s->preds[p] != b) continue;
+      for (int k = 0; k < s->num_of_insts && s->insts[k].op == kIRPhi; k++) {
+        s->insts[k].srcs[p] = GetCurrentName(s->insts[k].imm);
+      }
+    }
+  }
+}
+
+static void RenameVars(void) {
+  // Walks the dominator tree in preorder. Names pushed in a block are
+  // popped when all blocks dominated by it are renamed.
+  int n = func->num_of_blocks;
+  name_stacks = calloc(num_of_vars, sizeof(int *));
+  name_stack_sizes = calloc(num_of_vars, sizeof(int));
+  undef_vregs = calloc(num_of_vars, sizeof(int));
+  renamed_vars = NULL;
+  num_of_renamed_vars = 0;
+  struct IRBlock **stack = malloc(n * sizeof(struct IRBlock *));
+  int *next_child = calloc(n, sizeof(int));
+  int *names_before_block = malloc(n * sizeof(int));
+  int sp = 0;
+  stack[sp++] = func->blocks[0];
+  names_before_block[0] = 0;
+  RenameVarsInBlock(func->blocks[0]);
+  while (sp) {
+    struct IRBlock *b = stack[sp - 1];
+    if (next_child[b->id] < num_of_dom_children[b->id]) {
+      struct IRBlock *c = dom_children[b->id][next_child[b->id]++];
+      names_before_block[c->id] = num_of_renamed_vars;
+      RenameVarsInBlock(c);
+      stack[sp++] = c;
+      continue;
+    }
+    sp--;
+    while (num_of_renamed_vars > names_before_block[b->id]) {
+      name_stack_sizes[renamed_vars[--num_of_renamed_vars]]--;
+    }
+  }
+  for (int var = 0; var < num_of_vars; var++) {
+    if (!undef_vregs[var]) continue;
+    InsertIRInst(func->blocks[0], 0, kIRConst, undef_vregs[var], 0);
+  }
+}
+
+void ConvertToSSA(struct IRFunc *f) {
+  func = f;
+  f->stack_size = PromoteLocalVars();
+  ComputeDominators();
+  FindVarsToRename();
+  InsertPhiNodes();
+  RenameVars();
+  EliminateDeadIRInsts(f);
+}
+
+// Destruction
+
+static bool HasPhiNode(struct IRBlock *b) {
+  return b->num_of_insts && b->insts[0].op == kIRPhi;
+}
+
+static void SplitCriticalEdges(void) {
+  // Copies for phi nodes are placed at the end of predecessors. A block
+  // with two successors gets a new block on the edge to a block with phi
+  // nodes, which is placed right after it.
+  struct IRBlock **blocks =
+      malloc(func->num_of_blocks * 3 * sizeof(struct IRBlock *));
+  int num_of_blocks = 0;
+  for (int i = 0; i < func->num_of_blocks; i++) {
+    struct IRBlock *b = func->blocks[i];
+    blocks[num_of_blocks++] = b;
+    if (b->num_of_succs != 2) continue;
+    for (int k = 0; k < 2; k++) {
+      struct IRBlock *s = b->succs[k];
+      if (!HasPhiNode(s)) continue;
+      struct IRBlock *mid = calloc(1, sizeof(struct IRBlock));
+      InsertIRInst(mid, 0, kIRJump, 0, 0)->targets[0] = s;
+      mid->num_of_succs = 1;
+      mid->succs[0] = s;
+      mid->num_of_preds = 1;
+      mid->preds = malloc(sizeof(struct IRBlock *));
+      mid->preds[0] = b;
+      mid->is_reachable = true;
+      b->succs[k] = mid;
+      b->insts[b->num_of_insts - 1].targets[k] = mid;
+      for (int p = 0; p < s->num_of_preds; p++) {
+        if (s->preds[p] != b) continue;
+        s->preds[p] = mid;
+        break;
+      }
+      blocks[num_of_blocks++] = mid;
+    }
+  }
+  func->blocks = blocks;
+  func->num_of_blocks = num_of_blocks;
+  func->capacity = func->num_of_blocks * 3;
+  for (int i = 0; i < num_of_blocks; i++) blocks[i]->id = i;
+}
+
+static void AddCopyBeforeTerminator(struct IRBlock *b, int dst, int src) {
+  InsertIRInst(b, b->num_of_insts - 1, kIRCopy, dst, 1)->srcs[0] = src;
+}
+
+static void AddParallelCopies(struct IRBlock *b, int *dsts, int *srcs,
+                              int n) {
+  // Copies srcs[i] to dsts[i] for all i at once. dsts are distinct.
+  // A copy is emitted when no other pending copy reads its dst. If every dst
+  // is read by another one, they form cycles, which are broken by saving
+  // one dst in a new register.
+  while (n) {
+    int i;
+    for (i = 0; i < n; i++) {
+      int k;
+      for (k = 0; k < n; k++) {
+        if (k != i && srcs[k] == dsts[i]) break;
+      }
+      if (k == n) break;
+    }
+    if (i == n) {
+      int saved = NewIRVReg(func);
+      AddCopyBeforeTerminator(b, saved, dsts[0]);
+      for (int k = 0; k < n; k++) {
+        if (srcs[k] == dsts[0]) srcs[k] = saved;
+      }
+      continue;
+    }
+    if (dsts[i] != srcs[i]) AddCopyBeforeTerminator(b, dsts[i], srcs[i]);
+    n--;
+    dsts[i] = dsts[n];
+    srcs[i] = srcs[n];
+  }
+}
+
+void DestructSSA(struct IRFunc *f) {
+  func = f;
+  SplitCriticalEdges();
+  for (int i = 0; i < f->num_of_blocks; i++) {
+    struct IRBlock *b = f->blocks[i];
+    int num_of_phis = 0;
+    while (num_of_phis < b->num_of_insts &&
+           b->insts[num_of_phis].op == kIRPhi) {
+      num_of_phis++;
+    }
+    if (!num_of_phis) continue;
+    int *dsts = malloc(num_of_phis * sizeof(int));
+    int *srcs = malloc(num_of_phis * sizeof(int));
+    for (int p = 0; p < b->num_of_preds; p++) {
+      for (int k = 0; k < num_of_phis; k++) {
+        dsts[k] = b->insts[k].dst;
+        srcs[k] = b->insts[k].srcs[p];
+      }
+      AddParallelCopies(b->preds[p], dsts, srcs, num_of_phis);
+    }
+    b->num_of_insts -= num_of_phis;
+    for (int k = 0; k < b->num_of_insts; k++) {
+      b->insts[k] = b->insts[k + num_of_phis];
+    }
+  }
+}
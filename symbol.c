@@ -37,14 +37,49 @@ struct Node *AddLocalVar(struct SymbolEntry **ctx, const char *key,
   return local_var;
 }
 
-void AddGlobalVar(struct SymbolEntry **ctx, const char *key,
-                  struct Node *var_type) {
+static struct Node *MergeRedeclaredType(struct Node *key_token,
+                                        struct Node *prev_type,
+                                        struct Node *type) {
+  // Returns the type of a var declared again with type.
+  // int a[]; int a[3]; => int a[3]
+  struct Node *p = GetTypeWithoutAttr(prev_type);
+  struct Node *t = GetTypeWithoutAttr(type);
+  if (p->type == kTypeArray && t->type == kTypeArray &&
+      (!p->type_array_index_decl || !t->type_array_index_decl) &&
+      IsSameTypeExceptAttr(p->type_array_type_of, t->type_array_type_of)) {
+    return p->type_array_index_decl ? prev_type : type;
+  }
+  if (!IsSameTypeExceptAttr(prev_type, type)) {
+    ErrorWithToken(key_token, "Conflicting types for %s",
+                   CreateTokenStr(key_token));
+  }
+  return prev_type;
+}
+
+struct Node *AddGlobalVar(struct SymbolEntry **ctx, struct Node *key_token,
+                          struct Node *var_type) {
+  // returns ASTGlobalVar. Tentative definitions share the same entry.
+  const char *key = CreateTokenStr(key_token);
   fprintf(stderr, "Gvar: %s: ", key);
   PrintASTNode(var_type);
   fprintf(stderr, "\n");
   assert(ctx);
-  struct SymbolEntry *e = AllocSymbolEntry(kSymbolGlobalVar, key, var_type);
+  for (struct SymbolEntry *e = *ctx; e; e = e->prev) {
+    if (e->type != kSymbolGlobalVar && e->type != kSymbolExternVar) continue;
+    if (strcmp(e->key, key) != 0) continue;
+    if (e->type == kSymbolExternVar) {
+      var_type = MergeRedeclaredType(key_token, e->value, var_type);
+    }
+    if (e->type != kSymbolGlobalVar) continue;
+    struct Node *global_var = e->value;
+    global_var->expr_type =
+        MergeRedeclaredType(key_token, global_var->expr_type, var_type);
+    return global_var;
+  }
+  struct Node *global_var = CreateASTGlobalVar(var_type);
+  struct SymbolEntry *e = AllocSymbolEntry(kSymbolGlobalVar, key, global_var);
   PushSymbol(ctx, e);
+  return global_var;
 }
 void AddExternVar(struct SymbolEntry **ctx, const char *key,
                   struct Node *var_type) {
@@ -71,7 +106,8 @@ struct Node *FindGlobalVar(struct SymbolEntry *e, struct Node *key_token) {
   for (; e; e = e->prev) {
     if (e->type != kSymbolGlobalVar) continue;
     if (!IsEqualTokenWithCStr(key_token, e->key)) continue;
-    return e->value;
+    assert(e->value && e->value->type == kASTGlobalVar);
+    return e->value->expr_type;
   }
   return NULL;
 }
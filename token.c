@@ -41,6 +41,79 @@ char *CreateTokenStr(struct Node *t) {
   return strndup(t->begin, t->length);
 }
 
+int DecodeStringLiteral(struct Node *t, char *buf) {
+  // Writes the bytes represented by string literal token t into buf
+  // (if buf is not NULL) and returns the number of bytes without
+  // the terminating null character.
+  assert(IsTokenWithType(t, kTokenStringLiteral));
+  int length = 0;
+  const char *p = t->begin + 1;
+  const char *end = t->begin + t->length - 1;
+  while (p < end) {
+    char c = *(p++);
+    if (c == '\\') {
+      c = *(p++);
+      if ('0' <= c && c <= '7') {
+        // octal-escape-sequence: up to 3 digits
+        int v = c - '0';
+        for (int i = 0; i < 2 && '0' <= *p && *p <= '7'; i++) {
+          v = v * 8 + *(p++) - '0';
+        }
+        c = v;
+      } else if (c == 'x') {
+        int v = 0;
+        for (; p < end; p++) {
+          if ('0' <= *p && *p <= '9') {
+            v = v * 16 + *p - '0';
+          } else if ('a' <= *p && *p <= 'f') {
+            v = v * 16 + *p - 'a' + 10;
+          } else if ('A' <= *p && *p <= 'F') {
+            v = v * 16 + *p - 'A' + 10;
+          } else {
+            break;
+          }
+        }
+        c = v;
+      } else if (c == 'n') {
+        c = '\n';
+      } else if (c == 't') {
+        c = '\t';
+      } else if (c == 'r') {
+        c = '\r';
+      } else if (c == 'a') {
+        c = '\a';
+      } else if (c == 'b') {
+        c = '\b';
+      } else if (c == 'f') {
+        c = '\f';
+      } else if (c == 'v') {
+        c = '\v';
+      } else if (c != '\\' && c != '\'' && c != '"' && c != '?') {
+        ErrorWithToken(t, "Not implemented escape sequence");
+      }
+    }
+    if (buf) buf[length] = c;
+    length++;
+  }
+  return length;
+}
+
+int EvalCharLiteral(struct Node *t) {
+  assert(IsTokenWithType(t, kTokenCharLiteral));
+  if (t->length == (1 + 1 + 1)) {
+    return t->begin[1];
+  }
+  if (t->length == (1 + 2 + 1) && t->begin[1] == '\\') {
+    if (t->begin[2] == 'n') {
+      return '\n';
+    }
+    if (t->begin[2] == '\\') {
+      return '\\';
+    }
+  }
+  ErrorWithToken(t, "Not implemented char literal");
+}
+
 int IsEqualTokenWithCStr(struct Node *t, const char *s) {
   return IsToken(t) && strlen(s) == (unsigned)t->length &&
          strncmp(t->begin, s, t->length) == 0;
@@ -54,6 +54,7 @@ static struct Node *CreateNextToken(const char *p, const char *src, int *line) {
     if (IsEqualTokenWithCStr(t, "extern")) t->token_type = kTokenKwExtern;
     if (IsEqualTokenWithCStr(t, "for")) t->token_type = kTokenKwFor;
     if (IsEqualTokenWithCStr(t, "if")) t->token_type = kTokenKwIf;
+    if (IsEqualTokenWithCStr(t, "inline")) t->token_type = kTokenKwInline;
     if (IsEqualTokenWithCStr(t, "int")) t->token_type = kTokenKwInt;
     if (IsEqualTokenWithCStr(t, "long")) t->token_type = kTokenKwLong;
     if (IsEqualTokenWithCStr(t, "return")) t->token_type = kTokenKwReturn;
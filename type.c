@@ -1,5 +1,7 @@
 #include "compilium.h"
 
+int EvalExprAsInt(struct Node *n);
+
 int IsSameTypeExceptAttr(struct Node *a, struct Node *b) {
   assert(a && b);
   a = GetTypeWithoutAttr(a);
@@ -7,7 +9,7 @@ int IsSameTypeExceptAttr(struct Node *a, struct Node *b) {
   if (a->type != b->type) return 0;
   if (a->type == kTypeBase) {
     assert(a->op && b->op);
-    return a->op->type == b->op->type;
+    return a->op->token_type == b->op->token_type;
   } else if (a->type == kTypePointer) {
     return IsSameTypeExceptAttr(a->right, b->right);
   } else if (a->type == kTypeFunction) {
@@ -18,6 +20,19 @@ int IsSameTypeExceptAttr(struct Node *a, struct Node *b) {
         return 0;
     }
     return 1;
+  } else if (a->type == kTypeArray) {
+    if (!a->type_array_index_decl != !b->type_array_index_decl) return 0;
+    if (a->type_array_index_decl &&
+        EvalExprAsInt(a->type_array_index_decl) !=
+            EvalExprAsInt(b->type_array_index_decl)) {
+      return 0;
+    }
+    return IsSameTypeExceptAttr(a->type_array_type_of, b->type_array_type_of);
+  } else if (a->type == kTypeStruct) {
+    if (a->tag && b->tag) {
+      return IsEqualTokenWithCStr(a->tag, CreateTokenStr(b->tag));
+    }
+    return a->type_struct_spec == b->type_struct_spec;
   }
   Error("IsSameTypeExceptAttr: Comparing non-type nodes");
 }
@@ -97,6 +112,7 @@ int GetAlignOfType(struct Node *t) {
     assert(IsToken(t->op));
     switch (t->op->token_type) {
       case kTokenKwInt:
+      case kTokenKwLong:
         return 4;
       case kTokenKwChar:
         return 1;
@@ -107,6 +123,8 @@ int GetAlignOfType(struct Node *t) {
     return 8;
   } else if (t->type == kTypeStruct) {
     return CalcStructAlign(t->type_struct_spec);
+  } else if (t->type == kTypeArray) {
+    return GetAlignOfType(t->type_array_type_of);
   }
   PrintASTNode(t);
   assert(false);
@@ -176,7 +194,9 @@ static struct Node *CreateBaseTypeFromDeclSpecs(struct SymbolEntry *ctx,
     struct Node *t = GetNodeAt(decl_specs, i);
     if (IsTokenWithType(t, kTokenKwTypedef) ||
         IsTokenWithType(t, kTokenKwUnsigned) ||
-        IsTokenWithType(t, kTokenKwExtern)) {
+        IsTokenWithType(t, kTokenKwExtern) ||
+        IsTokenWithType(t, kTokenKwStatic) ||
+        IsTokenWithType(t, kTokenKwInline)) {
       continue;
     }
     if (IsTokenWithType(t, kTokenKwConst)) {
@@ -268,6 +288,7 @@ _Noreturn void TestType() {
 
   struct Node *char_type = CreateTypeBase(CreateToken("char"));
   assert(GetSizeOfType(char_type) == 1);
+  assert(!IsSameTypeExceptAttr(int_type, char_type));
 
   struct Node *long_type = CreateTypeBase(CreateToken("long"));
   assert(GetSizeOfType(long_type) == 4);